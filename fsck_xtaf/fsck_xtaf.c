@@ -0,0 +1,564 @@
+/*
+Copyright (c) 2007,2008 Rene Ladan <r.c.ladan@gmail.com> All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+
+See fsck_xtaf.txt for usage information.
+
+*/
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+
+#include "../libxtaf/libxtaf.h"
+
+#define BATCH 256 /* nodes a thread takes at a time */
+#define LOST_SHOW 20 /* lost chains listed */
+
+/* what is wrong with a chain, see check_chain() */
+#define P_START 0 /* the start cluster is not on the volume */
+#define P_FREE 1 /* the chain runs into a free cluster */
+#define P_LINK 2 /* a link to a reserved value or beyond the volume */
+#define P_BAD 3 /* a cluster marked bad */
+#define P_CYCLE 4 /* the chain loops back on itself */
+#define P_SHORT 5 /* fewer clusters than the size needs */
+#define P_LONG 6 /* more clusters than the size needs */
+
+struct problem_s {
+	uint32_t node;
+	int kind;
+	uint32_t cluster; /* where it happens */
+	uint32_t value; /* P_FREE: the free cluster, P_LINK: the entry */
+	uint32_t have; /* P_SHORT, P_LONG: clusters in the chain */
+	uint32_t want; /* and for the size */
+};
+
+/* a cluster in more than one chain, found by find_owners() */
+struct owner_s {
+	uint32_t cluster;
+	uint32_t node;
+};
+
+/* the state shared by the check threads */
+struct check_s {
+	struct xtaf_vol *vol;
+	const struct xtaf_geom *g;
+	struct xtaf_index idx;
+	const uint8_t *fat;
+	uint32_t lastptr; /* highest FAT value which is a link */
+	uint64_t csize;
+	uint32_t *owned; /* one bit per cluster, set with atomics */
+	uint32_t *shared; /* clusters reached by a second chain */
+	uint32_t *walked; /* per node: clusters walked, see find_owners() */
+	uint32_t next; /* next batch of nodes, taken with atomics */
+	int pass; /* 0: check_chain(), 1: find_owners() */
+	uint64_t clusters; /* owned by some chain */
+	uint32_t chains;
+	uint32_t crossed; /* chains running into another one */
+	struct problem_s *probs; /* under mtx */
+	uint32_t nprobs;
+	uint32_t aprobs;
+	struct owner_s *owners; /* under mtx */
+	uint32_t nowners;
+	uint32_t aowners;
+	int nomem;
+	pthread_mutex_t mtx;
+};
+
+double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Masked FAT entry of cluster, which is at most maxcluster.
+ */
+uint32_t fat_next(struct check_s *ck, uint32_t cluster) {
+	const uint8_t *p;
+
+	p = ck->fat + (uint64_t)cluster * ck->g->fatmult;
+	if (ck->g->fatmult == 2)
+		return(((uint32_t)p[0] << 8 | p[1]) & ck->g->fatmask);
+	return(((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | p[3]) & ck->g->fatmask);
+}
+
+int test_bit(const uint32_t *map, uint32_t c) {
+	return((map[c / 32] >> (c % 32)) & 1);
+}
+
+/*
+ * Set the bit of cluster c and tell if it was set already.  Two chains
+ * racing for the same cluster both see it set, exactly one of them first.
+ */
+int claim(uint32_t *map, uint32_t c) {
+	uint32_t bit = 1U << (c % 32);
+
+	return((__atomic_fetch_or(&map[c / 32], bit, __ATOMIC_RELAXED) &
+	    bit) != 0);
+}
+
+void add_problem(struct check_s *ck, uint32_t node, int kind,
+    uint32_t cluster, uint32_t value, uint32_t have, uint32_t want) {
+	struct problem_s *p;
+
+	pthread_mutex_lock(&ck->mtx);
+	if (ck->nprobs == ck->aprobs) {
+		p = realloc(ck->probs, (ck->aprobs + 64) *
+		    sizeof(struct problem_s));
+		if (p == NULL) {
+			ck->nomem = 1;
+			pthread_mutex_unlock(&ck->mtx);
+			return;
+		}
+		ck->probs = p;
+		ck->aprobs += 64;
+	}
+	p = &ck->probs[ck->nprobs++];
+	p->node = node;
+	p->kind = kind;
+	p->cluster = cluster;
+	p->value = value;
+	p->have = have;
+	p->want = want;
+	pthread_mutex_unlock(&ck->mtx);
+}
+
+/*
+ * Tell if cluster c is among the first n clusters of the chain at start,
+ * which were followed already so the walk is safe.
+ */
+int in_chain(struct check_s *ck, uint32_t start, uint32_t c, uint32_t n) {
+	uint32_t i;
+
+	for (i = 0; i < n; i++, start = fat_next(ck, start))
+		if (start == c)
+			return(1);
+	return(0);
+}
+
+/*
+ * Follow the chain of node n, claiming its clusters in the ownership
+ * bitmap.  A cluster claimed before is either an earlier one of the same
+ * chain (a cycle) or one of another chain (a cross link), the walk stops
+ * there.  The length of the chain is checked against the size of a file
+ * when the chain ends properly.
+ */
+void check_chain(struct check_s *ck, uint32_t n, uint64_t *nclust) {
+	const struct xtaf_node *de = &ck->idx.nodes[n];
+	uint32_t c, v, prev = 0, have = 0, want = 0;
+	int isdir;
+
+	isdir = xtaf_is_dir(ck->vol, n);
+	if (!isdir)
+		want = de->fsize / ck->csize + (de->fsize % ck->csize > 0);
+	if (de->fstart == 0) {
+		if (want > 0)
+			add_problem(ck, n, P_SHORT, 0, 0, 0, want);
+		return;
+	}
+	if (de->fstart > ck->g->maxcluster) {
+		add_problem(ck, n, P_START, de->fstart, 0, 0, 0);
+		return;
+	}
+	for (c = de->fstart; ; prev = c, c = v) {
+		if (claim(ck->owned, c)) {
+			ck->walked[n] = have + 1;
+			if (in_chain(ck, de->fstart, c, have))
+				add_problem(ck, n, P_CYCLE, c, 0, 0, 0);
+			else {
+				claim(ck->shared, c);
+				__atomic_fetch_add(&ck->crossed, 1,
+				    __ATOMIC_RELAXED);
+			}
+			break;
+		}
+		v = fat_next(ck, c);
+		if (v == 0) {
+			add_problem(ck, n, P_FREE, prev, c, 0, 0);
+			break;
+		}
+		have++;
+		if (v > ck->lastptr) {
+			if (v == (0xfffffff7 & ck->g->fatmask))
+				add_problem(ck, n, P_BAD, c, 0, 0, 0);
+			else if (v < (0xfffffff8 & ck->g->fatmask))
+				add_problem(ck, n, P_LINK, c, v, 0, 0);
+			else if (!isdir && have != want)
+				add_problem(ck, n, have < want ? P_SHORT :
+				    P_LONG, 0, 0, have, want);
+			break;
+		}
+		if (v == 1 || v > ck->g->maxcluster) {
+			add_problem(ck, n, P_LINK, c, v, 0, 0);
+			break;
+		}
+	}
+	*nclust += have;
+}
+
+/*
+ * Walk the chain of node n again for as far as check_chain() went and
+ * note each shared cluster on it, so all chains on a cross link can be
+ * named.
+ */
+void find_owners(struct check_s *ck, uint32_t n) {
+	struct owner_s *o;
+	uint32_t c, i, len;
+
+	len = ck->walked[n];
+	if (len == 0) /* a chain of its own */
+		len = UINT32_MAX;
+	c = ck->idx.nodes[n].fstart;
+	if (c == 0 || c > ck->g->maxcluster)
+		return;
+	for (i = 0; i < len; i++) {
+		if (test_bit(ck->shared, c)) {
+			pthread_mutex_lock(&ck->mtx);
+			if (ck->nowners == ck->aowners) {
+				o = realloc(ck->owners, (ck->aowners + 64) *
+				    sizeof(struct owner_s));
+				if (o == NULL) {
+					ck->nomem = 1;
+					pthread_mutex_unlock(&ck->mtx);
+					return;
+				}
+				ck->owners = o;
+				ck->aowners += 64;
+			}
+			ck->owners[ck->nowners].cluster = c;
+			ck->owners[ck->nowners++].node = n;
+			pthread_mutex_unlock(&ck->mtx);
+		}
+		c = fat_next(ck, c);
+		if (c < 2 || c > ck->g->maxcluster)
+			break;
+	}
+}
+
+/*
+ * Take batches of nodes until all are done.  Deleted entries are skipped,
+ * their clusters are free.
+ */
+void *check_worker(void *arg) {
+	struct check_s *ck = arg;
+	uint64_t nclust = 0;
+	uint32_t first, n, chains = 0;
+
+	for (;;) {
+		first = __atomic_fetch_add(&ck->next, BATCH, __ATOMIC_RELAXED);
+		if (first >= ck->idx.nnodes)
+			break;
+		for (n = first; n < first + BATCH && n < ck->idx.nnodes; n++) {
+			if (ck->idx.nodes[n].fnl == 0xe5)
+				continue;
+			if (ck->pass == 1) {
+				find_owners(ck, n);
+				continue;
+			}
+			check_chain(ck, n, &nclust);
+			chains += ck->idx.nodes[n].fstart != 0;
+		}
+	}
+	__atomic_fetch_add(&ck->clusters, nclust, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ck->chains, chains, __ATOMIC_RELAXED);
+	return(NULL);
+}
+
+int run_pass(struct check_s *ck, int pass, int nthreads) {
+	pthread_t *tids;
+	int i;
+
+	ck->pass = pass;
+	ck->next = 0;
+	tids = calloc(nthreads, sizeof(pthread_t));
+	if (tids == NULL)
+		return(ENOMEM);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&tids[i], NULL, check_worker, ck))
+			break;
+	if (i == 0)
+		check_worker(ck);
+	while (--i >= 0)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	return(ck->nomem ? ENOMEM : 0);
+}
+
+/*
+ * Write the path of node n into path, as far as it fits.
+ */
+void node_path(struct check_s *ck, uint32_t n, char *path) {
+	size_t len;
+
+	if (n == XTAF_ROOT) {
+		snprintf(path, PATH_MAX, "/");
+		return;
+	}
+	node_path(ck, ck->idx.nodes[n].parent, path);
+	len = strlen(path);
+	snprintf(path + len, PATH_MAX - len, "%s%s", len > 1 ? "/" : "",
+	    ck->idx.pool + ck->idx.nodes[n].name);
+}
+
+int cmp_problem(const void *a, const void *b) {
+	const struct problem_s *pa = a, *pb = b;
+
+	if (pa->node != pb->node)
+		return(pa->node < pb->node ? -1 : 1);
+	return(pa->kind - pb->kind);
+}
+
+int cmp_owner(const void *a, const void *b) {
+	const struct owner_s *oa = a, *ob = b;
+
+	if (oa->cluster != ob->cluster)
+		return(oa->cluster < ob->cluster ? -1 : 1);
+	return(oa->node < ob->node ? -1 : oa->node > ob->node);
+}
+
+void report_problem(struct check_s *ck, struct problem_s *p) {
+	char path[PATH_MAX];
+
+	node_path(ck, p->node, path);
+	switch (p->kind) {
+	case P_START:
+		printf("%s: start cluster %u is not on the volume\n", path,
+		    p->cluster);
+		break;
+	case P_FREE:
+		if (p->cluster == 0)
+			printf("%s: start cluster %u is free\n", path,
+			    p->value);
+		else
+			printf("%s: cluster %u links to free cluster %u\n",
+			    path, p->cluster, p->value);
+		break;
+	case P_LINK:
+		printf("%s: cluster %u links to 0x%x\n", path, p->cluster,
+		    p->value);
+		break;
+	case P_BAD:
+		printf("%s: cluster %u is marked bad\n", path, p->cluster);
+		break;
+	case P_CYCLE:
+		printf("%s: chain loops back to cluster %u\n", path,
+		    p->cluster);
+		break;
+	case P_SHORT:
+	case P_LONG:
+		printf("%s: %u clusters, size %u needs %u\n", path, p->have,
+		    ck->idx.nodes[p->node].fsize, p->want);
+		break;
+	}
+}
+
+/*
+ * Clusters in use in the FAT which no chain owns.  The first ones of lost
+ * chains are those no other lost cluster links to, each is followed to
+ * count its clusters.  What is left are lost cycles.
+ */
+void find_lost(struct check_s *ck, const uint32_t *inuse, uint32_t *nlost,
+    uint32_t *nchains) {
+	uint32_t *linked, c, v, w, len, nwords, shown = 0, inchains = 0;
+
+	*nlost = 0;
+	*nchains = 0;
+	nwords = ck->g->maxcluster / 32 + 1;
+	linked = calloc(nwords, sizeof(uint32_t));
+	if (linked == NULL) {
+		ck->nomem = 1;
+		return;
+	}
+	/* bad and reserved clusters are not part of a chain */
+	for (w = 0; w < nwords; w++)
+		if ((inuse[w] & ~ck->owned[w]) != 0)
+			for (c = w * 32; c < w * 32 + 32; c++) {
+				if (c < 1 || c > ck->g->maxcluster ||
+				    !test_bit(inuse, c) ||
+				    test_bit(ck->owned, c))
+					continue;
+				v = fat_next(ck, c);
+				if (v > ck->lastptr &&
+				    v < (0xfffffff8 & ck->g->fatmask))
+					continue;
+				(*nlost)++;
+				if (v >= 2 && v <= ck->g->maxcluster)
+					claim(linked, v);
+			}
+	for (w = 0; w < nwords; w++)
+		if ((inuse[w] & ~ck->owned[w] & ~linked[w]) != 0)
+			for (c = w * 32; c < w * 32 + 32; c++) {
+				if (c < 1 || c > ck->g->maxcluster ||
+				    !test_bit(inuse, c) ||
+				    test_bit(ck->owned, c) ||
+				    test_bit(linked, c))
+					continue;
+				v = fat_next(ck, c);
+				if (v > ck->lastptr &&
+				    v < (0xfffffff8 & ck->g->fatmask))
+					continue;
+				for (len = 0, v = c; v >= 2 &&
+				    v <= ck->g->maxcluster &&
+				    !claim(ck->owned, v); len++)
+					v = fat_next(ck, v);
+				(*nchains)++;
+				inchains += len;
+				if (shown++ < LOST_SHOW)
+					printf("lost chain at cluster %u, %u "
+					    "clusters\n", c, len);
+			}
+	if (shown > LOST_SHOW)
+		printf("... %u more lost chains\n", shown - LOST_SHOW);
+	if (inchains < *nlost)
+		printf("%u lost clusters are in cycles\n", *nlost - inchains);
+	free(linked);
+}
+
+int usage(void) {
+	printf("See fsck_xtaf.txt for usage information.\n");
+	return(2);
+}
+
+int main(int argc, char *argv[]) {
+	struct check_s ck;
+	struct xtaf_stats st;
+	struct xtaf_usage u;
+	const uint32_t *inuse;
+	char path[PATH_MAX];
+	uint32_t i, j, nlost, nlchains, nwords;
+	double start;
+	int ch, nthreads, error, bad;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	while ((ch = getopt(argc, argv, "j:")) != -1)
+		switch (ch) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			return(usage());
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || nthreads < 1)
+		return(usage());
+
+	bzero(&ck, sizeof(struct check_s));
+	start = now();
+	error = xtaf_open(argv[0], NULL, &ck.vol);
+	if (error) {
+		fprintf(stderr, "fsck_xtaf: cannot open %s: %s\n", argv[0],
+		    strerror(error));
+		return(2);
+	}
+	ck.g = xtaf_geometry(ck.vol);
+	xtaf_get_index(ck.vol, &ck.idx);
+	error = xtaf_fat(ck.vol, &ck.fat);
+	if (error == 0)
+		error = xtaf_usage(ck.vol, &u, &inuse);
+	if (error) {
+		fprintf(stderr, "fsck_xtaf: cannot read the FAT: %s\n",
+		    strerror(error));
+		xtaf_close(ck.vol);
+		return(2);
+	}
+	ck.lastptr = 0xffffffef & ck.g->fatmask;
+	ck.csize = 512 * ck.g->spc;
+	nwords = ck.g->maxcluster / 32 + 1;
+	ck.owned = calloc(nwords, sizeof(uint32_t));
+	ck.shared = calloc(nwords, sizeof(uint32_t));
+	ck.walked = calloc(ck.idx.nnodes, sizeof(uint32_t));
+	if (ck.owned == NULL || ck.shared == NULL || ck.walked == NULL) {
+		fprintf(stderr, "fsck_xtaf: out of memory\n");
+		xtaf_close(ck.vol);
+		return(2);
+	}
+	pthread_mutex_init(&ck.mtx, NULL);
+
+	/* every chain, then who else is on the cross links found */
+	error = run_pass(&ck, 0, nthreads);
+	if (error == 0 && ck.crossed > 0)
+		error = run_pass(&ck, 1, nthreads);
+	if (error || ck.nomem) {
+		fprintf(stderr, "fsck_xtaf: out of memory\n");
+		xtaf_close(ck.vol);
+		return(2);
+	}
+
+	if (ck.nprobs > 0)
+		qsort(ck.probs, ck.nprobs, sizeof(struct problem_s),
+		    cmp_problem);
+	for (i = 0; i < ck.nprobs; i++)
+		report_problem(&ck, &ck.probs[i]);
+	if (ck.nowners > 0)
+		qsort(ck.owners, ck.nowners, sizeof(struct owner_s),
+		    cmp_owner);
+	for (i = 0; i < ck.nowners; i = j) {
+		printf("cluster %u is shared by:\n", ck.owners[i].cluster);
+		for (j = i; j < ck.nowners &&
+		    ck.owners[j].cluster == ck.owners[i].cluster; j++) {
+			node_path(&ck, ck.owners[j].node, path);
+			printf("\t%s\n", path);
+		}
+	}
+	find_lost(&ck, inuse, &nlost, &nlchains);
+	if (ck.nomem) {
+		fprintf(stderr, "fsck_xtaf: out of memory\n");
+		xtaf_close(ck.vol);
+		return(2);
+	}
+	xtaf_get_stats(ck.vol, &st);
+	if (st.baddirs > 0)
+		printf("%u directories could not be read\n", st.baddirs);
+
+	bad = ck.nprobs + ck.crossed + nlchains + st.baddirs + (nlost > 0);
+	printf("chains       = %u, %llu clusters\n", ck.chains,
+	    (unsigned long long)ck.clusters);
+	printf("broken       = %u chains\n", ck.nprobs);
+	printf("cross-linked = %u chains\n", ck.crossed);
+	printf("lost         = %u clusters in %u chains\n", nlost, nlchains);
+	printf("checked in %.2f s with %i threads: %s\n", now() - start,
+	    nthreads, bad ? "NOT CLEAN" : "clean");
+
+	pthread_mutex_destroy(&ck.mtx);
+	free(ck.probs);
+	free(ck.owners);
+	free(ck.owned);
+	free(ck.shared);
+	free(ck.walked);
+	xtaf_close(ck.vol);
+	return(bad ? 1 : 0);
+}
@@ -0,0 +1,628 @@
+/*
+Copyright (c) 2007,2008 Rene Ladan <r.c.ladan@gmail.com> All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+
+libxtaf: asynchronous reads of XTAF volumes, see libxtaf.txt.
+
+*/
+#ifdef __linux__
+#define _GNU_SOURCE /* O_DIRECT, statx(2) */
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h> /* BLKSSZGET */
+#ifdef __NR_io_uring_setup
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#define HAVE_URING
+#endif
+#endif
+
+#include "libxtaf.h"
+
+#define AIO_DEPTH 8 /* default requests in flight */
+#define AIO_MAXDEPTH 256
+#define AIO_MAXLEN (1024 * 1024 * 1024) /* bytes per request */
+#define AIO_MAXBUFS 16 /* regions from xtaf_aio_alloc() */
+#define AIO_ALIGN 4096 /* of those regions, at least a page */
+#define DIRECT_ALIGN 512 /* what O_DIRECT needs at least, see dio_align() */
+
+#define ENGINE_SYNC 0 /* depth 1, read in xtaf_aio_submit() */
+#define ENGINE_THREADS 1
+#define ENGINE_URING 2
+
+/* a request in flight */
+struct slot_s {
+	struct xtaf_aio_req *req;
+	size_t len; /* bytes to read, for O_DIRECT rounded up from req->len */
+	size_t done; /* bytes read so far */
+	int fd; /* the descriptor it is read from */
+	int next; /* free list */
+};
+
+#ifdef HAVE_URING
+/* the rings shared with the kernel, see io_uring_setup(2) */
+struct ring_s {
+	int fd;
+	uint8_t *sq, *cq;
+	size_t sqlen, cqlen;
+	struct io_uring_sqe *sqes;
+	size_t sqeslen;
+	unsigned *sqhead, *sqtail, *sqarray, sqmask;
+	unsigned *cqhead, *cqtail, cqmask;
+	struct io_uring_cqe *cqes;
+};
+#endif
+
+/*
+ * An engine belongs to one thread.  The slots, their free list and the
+ * buffers are only touched by that thread.  With ENGINE_THREADS and
+ * ENGINE_SYNC, finished slots are queued in done under mtx, and with
+ * ENGINE_THREADS the slots to read are queued in todo for the workers.
+ */
+struct xtaf_aio {
+	struct xtaf_vol *vol;
+	int engine;
+	unsigned depth;
+	unsigned inflight;
+	int fd; /* xtaf_fd() of vol */
+	int dfd; /* the image opened with O_DIRECT, or -1 */
+	unsigned dalign; /* alignment dfd needs */
+	struct slot_s *slots;
+	int freeslot;
+	struct iovec bufs[AIO_MAXBUFS];
+	unsigned nbufs;
+	int registered; /* bufs are registered with the ring */
+	pthread_mutex_t mtx;
+	pthread_cond_t work; /* todo is not empty, or quit */
+	pthread_cond_t finished; /* done is not empty */
+	int *todo, *done; /* rings of depth slots */
+	unsigned todohead, ntodo, donehead, ndone;
+	pthread_t *tids;
+	unsigned nthreads;
+	int quit;
+#ifdef HAVE_URING
+	struct ring_s ring;
+#endif
+};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static unsigned defdepth = AIO_DEPTH;
+static int defflags;
+
+/*
+ * Take the defaults from the environment: XTAF_DEPTH requests in flight,
+ * XTAF_AIO=threads to skip io_uring, XTAF_DIRECT to read with O_DIRECT.
+ */
+static void init(void) {
+	char *env;
+	unsigned long d;
+
+	env = getenv("XTAF_DEPTH");
+	if (env != NULL) {
+		d = strtoul(env, NULL, 0);
+		if (d >= 1 && d <= AIO_MAXDEPTH)
+			defdepth = d;
+	}
+	env = getenv("XTAF_AIO");
+	if (env != NULL && !strcmp(env, "threads"))
+		defflags |= XTAF_AIO_THREADS;
+	if (getenv("XTAF_DIRECT") != NULL)
+		defflags |= XTAF_AIO_DIRECT;
+}
+
+unsigned xtaf_aio_default(void) {
+	pthread_once(&once, init);
+	return(defdepth);
+}
+
+/*
+ * Read slot sl with pread(2), until done, the end of the image or an
+ * error.  Requests O_DIRECT refuses are read through the page cache.
+ */
+static void read_slot(struct xtaf_aio *aio, struct slot_s *sl) {
+	struct xtaf_aio_req *r = sl->req;
+	ssize_t s;
+
+	while (sl->done < sl->len) {
+		s = pread(sl->fd, (uint8_t *)r->buf + sl->done,
+		    sl->len - sl->done, r->off + sl->done);
+		if (s == -1 && errno == EINTR)
+			continue;
+		if (s == -1 && errno == EINVAL && sl->fd == aio->dfd) {
+			sl->fd = aio->fd;
+			sl->len = r->len;
+			continue;
+		}
+		if (s == -1) {
+			r->res = -errno;
+			return;
+		}
+		if (s == 0)
+			break;
+		sl->done += s;
+	}
+	r->res = sl->done < r->len ? sl->done : r->len;
+}
+
+/*
+ * The buffer of xtaf_aio_alloc() holding len bytes at addr, or -1.
+ */
+static int find_buf(struct xtaf_aio *aio, uintptr_t addr, size_t len) {
+	unsigned b;
+
+	for (b = 0; b < aio->nbufs; b++)
+		if (addr >= (uintptr_t)aio->bufs[b].iov_base &&
+		    addr + len <= (uintptr_t)aio->bufs[b].iov_base +
+		    aio->bufs[b].iov_len)
+			return(b);
+	return(-1);
+}
+
+static void push_done(struct xtaf_aio *aio, int slot) {
+	pthread_mutex_lock(&aio->mtx);
+	aio->done[(aio->donehead + aio->ndone++) % aio->depth] = slot;
+	pthread_cond_signal(&aio->finished);
+	pthread_mutex_unlock(&aio->mtx);
+}
+
+static void *worker(void *arg) {
+	struct xtaf_aio *aio = arg;
+	int slot;
+
+	pthread_mutex_lock(&aio->mtx);
+	for (;;) {
+		while (aio->ntodo == 0 && !aio->quit)
+			pthread_cond_wait(&aio->work, &aio->mtx);
+		if (aio->ntodo == 0)
+			break;
+		slot = aio->todo[aio->todohead];
+		aio->todohead = (aio->todohead + 1) % aio->depth;
+		aio->ntodo--;
+		pthread_mutex_unlock(&aio->mtx);
+		read_slot(aio, &aio->slots[slot]);
+		pthread_mutex_lock(&aio->mtx);
+		aio->done[(aio->donehead + aio->ndone++) % aio->depth] = slot;
+		pthread_cond_signal(&aio->finished);
+	}
+	pthread_mutex_unlock(&aio->mtx);
+	return(NULL);
+}
+
+#ifdef HAVE_URING
+static void ring_free(struct ring_s *rg) {
+	if (rg->sqes != MAP_FAILED)
+		munmap(rg->sqes, rg->sqeslen);
+	if (rg->cq != MAP_FAILED && rg->cq != rg->sq)
+		munmap(rg->cq, rg->cqlen);
+	if (rg->sq != MAP_FAILED)
+		munmap(rg->sq, rg->sqlen);
+	close(rg->fd);
+}
+
+/*
+ * Set up a ring for entries requests and map it.  IORING_OP_READ needs
+ * Linux 5.6, which is also when IORING_FEAT_RW_CUR_POS came.
+ */
+static int ring_init(struct ring_s *rg, unsigned entries) {
+	struct io_uring_params p;
+	int error;
+
+	bzero(&p, sizeof(p));
+	rg->sq = rg->cq = MAP_FAILED;
+	rg->sqes = MAP_FAILED;
+	rg->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (rg->fd == -1)
+		return(errno);
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(rg->fd);
+		return(ENOSYS);
+	}
+	rg->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	rg->cqlen = p.cq_off.cqes + p.cq_entries *
+	    sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (rg->cqlen > rg->sqlen)
+			rg->sqlen = rg->cqlen;
+		rg->cqlen = rg->sqlen;
+	}
+	rg->sq = mmap(NULL, rg->sqlen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, rg->fd, IORING_OFF_SQ_RING);
+	if (rg->sq != MAP_FAILED && (p.features & IORING_FEAT_SINGLE_MMAP))
+		rg->cq = rg->sq;
+	else if (rg->sq != MAP_FAILED)
+		rg->cq = mmap(NULL, rg->cqlen, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, rg->fd, IORING_OFF_CQ_RING);
+	rg->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (rg->cq != MAP_FAILED)
+		rg->sqes = mmap(NULL, rg->sqeslen, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, rg->fd, IORING_OFF_SQES);
+	if (rg->sqes == MAP_FAILED) {
+		error = errno;
+		ring_free(rg);
+		return(error);
+	}
+	rg->sqhead = (unsigned *)(rg->sq + p.sq_off.head);
+	rg->sqtail = (unsigned *)(rg->sq + p.sq_off.tail);
+	rg->sqmask = *(unsigned *)(rg->sq + p.sq_off.ring_mask);
+	rg->sqarray = (unsigned *)(rg->sq + p.sq_off.array);
+	rg->cqhead = (unsigned *)(rg->cq + p.cq_off.head);
+	rg->cqtail = (unsigned *)(rg->cq + p.cq_off.tail);
+	rg->cqmask = *(unsigned *)(rg->cq + p.cq_off.ring_mask);
+	rg->cqes = (struct io_uring_cqe *)(rg->cq + p.cq_off.cqes);
+	return(0);
+}
+
+/*
+ * Queue the rest of slot on the ring and hand it to the kernel.  If that
+ * fails the entry stays queued, ring_reap() submits it again.
+ */
+static void ring_read(struct xtaf_aio *aio, int slot) {
+	struct ring_s *rg = &aio->ring;
+	struct slot_s *sl = &aio->slots[slot];
+	struct io_uring_sqe *sqe;
+	uintptr_t addr;
+	unsigned tail;
+	int b;
+
+	tail = *rg->sqtail;
+	sqe = &rg->sqes[tail & rg->sqmask];
+	bzero(sqe, sizeof(struct io_uring_sqe));
+	addr = (uintptr_t)sl->req->buf + sl->done;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = sl->fd;
+	sqe->off = sl->req->off + sl->done;
+	sqe->addr = addr;
+	sqe->len = sl->len - sl->done;
+	sqe->user_data = slot;
+	if (aio->registered && (b = find_buf(aio, addr, sqe->len)) != -1) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = b;
+	}
+	rg->sqarray[tail & rg->sqmask] = tail & rg->sqmask;
+	__atomic_store_n(rg->sqtail, tail + 1, __ATOMIC_RELEASE);
+	syscall(__NR_io_uring_enter, rg->fd, 1, 0, 0, NULL, 0);
+}
+
+/*
+ * Wait for the next request to complete.  Short reads are continued, and
+ * requests O_DIRECT refuses are read again through the page cache.
+ */
+static int ring_reap(struct xtaf_aio *aio, int *slotp) {
+	struct ring_s *rg = &aio->ring;
+	struct io_uring_cqe *cqe;
+	struct slot_s *sl;
+	unsigned head, pending;
+	int slot, res;
+
+	for (;;) {
+		head = *rg->cqhead;
+		if (head == __atomic_load_n(rg->cqtail, __ATOMIC_ACQUIRE)) {
+			pending = *rg->sqtail -
+			    __atomic_load_n(rg->sqhead, __ATOMIC_ACQUIRE);
+			if (syscall(__NR_io_uring_enter, rg->fd, pending, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+			    errno != EINTR && errno != EAGAIN &&
+			    errno != EBUSY)
+				return(errno);
+			continue;
+		}
+		cqe = &rg->cqes[head & rg->cqmask];
+		slot = cqe->user_data;
+		res = cqe->res;
+		__atomic_store_n(rg->cqhead, head + 1, __ATOMIC_RELEASE);
+		sl = &aio->slots[slot];
+		if (res == -EINVAL && sl->fd == aio->dfd) {
+			sl->fd = aio->fd;
+			sl->len = sl->req->len;
+			ring_read(aio, slot);
+		} else if (res == -EINTR || res == -EAGAIN)
+			ring_read(aio, slot);
+		else if (res > 0 && sl->done + res < sl->len) {
+			sl->done += res;
+			ring_read(aio, slot);
+		} else {
+			if (res >= 0 && (res += sl->done) > sl->req->len)
+				res = sl->req->len; /* the rounded up tail */
+			sl->req->res = res;
+			*slotp = slot;
+			return(0);
+		}
+	}
+}
+#endif
+
+/*
+ * The alignment of buffers, offsets and lengths O_DIRECT needs on fd: what
+ * statx(2) tells since Linux 6.1, or the logical sector size of a block
+ * device, but at least DIRECT_ALIGN.
+ */
+static unsigned dio_align(int fd) {
+	unsigned align = DIRECT_ALIGN;
+#ifdef __linux__
+	struct stat st;
+	int ssz;
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+
+	if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+	    (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align > 0) {
+		if (stx.stx_dio_offset_align > align)
+			align = stx.stx_dio_offset_align;
+		if (stx.stx_dio_mem_align > align)
+			align = stx.stx_dio_mem_align;
+		return(align);
+	}
+#endif
+	if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) &&
+	    ioctl(fd, BLKSSZGET, &ssz) == 0 && ssz > (int)align)
+		align = ssz;
+#endif
+	return(align);
+}
+
+/*
+ * Start an engine for vol with depth requests in flight (0 for the
+ * default, see xtaf_aio_default()).  It uses io_uring where the kernel
+ * has it, otherwise a pool of depth threads doing pread(2).  With depth 1
+ * the reads are simply done by xtaf_aio_submit().
+ */
+int xtaf_aio_open(struct xtaf_vol *vol, unsigned depth, int flags,
+    struct xtaf_aio **aiop) {
+	struct xtaf_aio *aio;
+	unsigned i;
+
+	pthread_once(&once, init);
+	if (depth == 0)
+		depth = defdepth;
+	if (depth > AIO_MAXDEPTH)
+		depth = AIO_MAXDEPTH;
+	flags |= defflags;
+	aio = calloc(1, sizeof(struct xtaf_aio));
+	if (aio == NULL)
+		return(ENOMEM);
+	aio->slots = calloc(depth, sizeof(struct slot_s));
+	aio->todo = malloc(depth * sizeof(int));
+	aio->done = malloc(depth * sizeof(int));
+	if (aio->slots == NULL || aio->todo == NULL || aio->done == NULL) {
+		free(aio->slots);
+		free(aio->todo);
+		free(aio->done);
+		free(aio);
+		return(ENOMEM);
+	}
+	aio->vol = vol;
+	aio->depth = depth;
+	aio->fd = xtaf_fd(vol);
+	aio->dfd = -1;
+	for (i = 0; i < depth; i++)
+		aio->slots[i].next = i + 1 < depth ? (int)i + 1 : -1;
+	pthread_mutex_init(&aio->mtx, NULL);
+	pthread_cond_init(&aio->work, NULL);
+	pthread_cond_init(&aio->finished, NULL);
+#ifdef O_DIRECT
+	if (flags & XTAF_AIO_DIRECT)
+		aio->dfd = xtaf_reopen(vol, O_DIRECT);
+	if (aio->dfd != -1)
+		aio->dalign = dio_align(aio->dfd);
+#endif
+	aio->engine = ENGINE_SYNC;
+	if (depth == 1) {
+		*aiop = aio;
+		return(0);
+	}
+#ifdef HAVE_URING
+	if (!(flags & XTAF_AIO_THREADS) && ring_init(&aio->ring, depth) == 0) {
+		aio->engine = ENGINE_URING;
+		*aiop = aio;
+		return(0);
+	}
+#endif
+	aio->tids = malloc(depth * sizeof(pthread_t));
+	if (aio->tids != NULL)
+		for (; aio->nthreads < depth; aio->nthreads++)
+			if (pthread_create(&aio->tids[aio->nthreads], NULL,
+			    worker, aio))
+				break;
+	if (aio->nthreads > 0)
+		aio->engine = ENGINE_THREADS;
+	*aiop = aio;
+	return(0);
+}
+
+/*
+ * Wait for the requests in flight and stop the engine.  The buffers from
+ * xtaf_aio_alloc() are freed.
+ */
+void xtaf_aio_close(struct xtaf_aio *aio) {
+	struct xtaf_aio_req *r;
+	unsigned i;
+
+	if (aio == NULL)
+		return;
+	while (xtaf_aio_wait(aio, &r) == 0)
+		;
+	pthread_mutex_lock(&aio->mtx);
+	aio->quit = 1;
+	pthread_cond_broadcast(&aio->work);
+	pthread_mutex_unlock(&aio->mtx);
+	for (i = 0; i < aio->nthreads; i++)
+		pthread_join(aio->tids[i], NULL);
+#ifdef HAVE_URING
+	if (aio->engine == ENGINE_URING)
+		ring_free(&aio->ring);
+#endif
+	if (aio->dfd != -1)
+		close(aio->dfd);
+	for (i = 0; i < aio->nbufs; i++)
+		free(aio->bufs[i].iov_base);
+	pthread_mutex_destroy(&aio->mtx);
+	pthread_cond_destroy(&aio->work);
+	pthread_cond_destroy(&aio->finished);
+	free(aio->tids);
+	free(aio->slots);
+	free(aio->todo);
+	free(aio->done);
+	free(aio);
+}
+
+/*
+ * Allocate size bytes of buffer, page aligned for O_DIRECT and registered
+ * with the ring, so reads into it skip mapping the pages each time.  Call
+ * it before submitting, buffers allocated while requests are in flight are
+ * not registered.  NULL if out of memory.
+ */
+void *xtaf_aio_alloc(struct xtaf_aio *aio, size_t size) {
+	size_t align = AIO_ALIGN;
+	long page;
+	void *p;
+
+	page = sysconf(_SC_PAGESIZE);
+	if (page > AIO_ALIGN)
+		align = page;
+	if (aio->nbufs == AIO_MAXBUFS || posix_memalign(&p, align, size))
+		return(NULL);
+	aio->bufs[aio->nbufs].iov_base = p;
+	aio->bufs[aio->nbufs].iov_len = size;
+	aio->nbufs++;
+#ifdef HAVE_URING
+	if (aio->engine == ENGINE_URING && aio->inflight == 0) {
+		/* all or nothing, the kernel takes the whole set */
+		if (aio->registered)
+			syscall(__NR_io_uring_register, aio->ring.fd,
+			    IORING_UNREGISTER_BUFFERS, NULL, 0);
+		aio->registered = syscall(__NR_io_uring_register,
+		    aio->ring.fd, IORING_REGISTER_BUFFERS, aio->bufs,
+		    aio->nbufs) == 0;
+	}
+#endif
+	return(p);
+}
+
+/*
+ * Queue request r, which must stay put until xtaf_aio_wait() returns it.
+ * EAGAIN when depth requests are in flight already.  With O_DIRECT, an
+ * aligned request whose length is not, like the tail of a file, is read
+ * rounded up if that still fits in r->room.
+ */
+int xtaf_aio_submit(struct xtaf_aio *aio, struct xtaf_aio_req *r) {
+	struct slot_s *sl;
+	size_t rlen;
+	int slot;
+
+	if (r->len > AIO_MAXLEN)
+		return(EINVAL);
+	if (aio->freeslot == -1)
+		return(EAGAIN);
+	slot = aio->freeslot;
+	sl = &aio->slots[slot];
+	aio->freeslot = sl->next;
+	sl->req = r;
+	sl->len = r->len;
+	sl->done = 0;
+	sl->fd = aio->fd;
+	if (aio->dfd != -1 && ((uintptr_t)r->buf | r->off) % aio->dalign == 0) {
+		rlen = (r->len + aio->dalign - 1) / aio->dalign * aio->dalign;
+		if (rlen == r->len || rlen <= r->room) {
+			sl->fd = aio->dfd;
+			sl->len = rlen;
+		}
+	}
+	r->res = 0;
+	aio->inflight++;
+	xtaf_count_read(aio->vol, r->off, r->len, r->purpose);
+	switch (aio->engine) {
+#ifdef HAVE_URING
+	case ENGINE_URING:
+		ring_read(aio, slot);
+		break;
+#endif
+	case ENGINE_THREADS:
+		pthread_mutex_lock(&aio->mtx);
+		aio->todo[(aio->todohead + aio->ntodo++) % aio->depth] = slot;
+		pthread_cond_signal(&aio->work);
+		pthread_mutex_unlock(&aio->mtx);
+		break;
+	default:
+		read_slot(aio, sl);
+		push_done(aio, slot);
+	}
+	return(0);
+}
+
+/*
+ * Wait for a request to complete, in any order, and return it in *rp.
+ * (*rp)->res holds the number of bytes read, less than len only at the
+ * end of the image, or -errno.  ENOENT if nothing is in flight.
+ */
+int xtaf_aio_wait(struct xtaf_aio *aio, struct xtaf_aio_req **rp) {
+	struct slot_s *sl;
+	int slot = 0, error = 0;
+
+	if (aio->inflight == 0)
+		return(ENOENT);
+#ifdef HAVE_URING
+	if (aio->engine == ENGINE_URING)
+		error = ring_reap(aio, &slot);
+	else
+#endif
+	{
+		pthread_mutex_lock(&aio->mtx);
+		while (aio->ndone == 0)
+			pthread_cond_wait(&aio->finished, &aio->mtx);
+		slot = aio->done[aio->donehead];
+		aio->donehead = (aio->donehead + 1) % aio->depth;
+		aio->ndone--;
+		pthread_mutex_unlock(&aio->mtx);
+	}
+	if (error)
+		return(error);
+	sl = &aio->slots[slot];
+	*rp = sl->req;
+	sl->next = aio->freeslot;
+	aio->freeslot = slot;
+	aio->inflight--;
+	return(0);
+}
+
+unsigned xtaf_aio_depth(struct xtaf_aio *aio) {
+	return(aio->depth);
+}
+
+const char *xtaf_aio_engine(struct xtaf_aio *aio) {
+	return(aio->engine == ENGINE_URING ? "io_uring" :
+	    aio->engine == ENGINE_THREADS ? "threads" : "sync");
+}
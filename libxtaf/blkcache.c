@@ -0,0 +1,283 @@
+/*
+Copyright (c) 2007,2008 Rene Ladan <r.c.ladan@gmail.com> All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+
+libxtaf: block cache for the metadata of XTAF volumes, see libxtaf.txt.
+
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blkcache.h"
+
+#define NIL 0xffffffff
+
+struct slot_s {
+	uint64_t file;
+	uint64_t blk;
+	uint32_t next; /* in the hash chain */
+	uint32_t len; /* valid bytes, short at the end of an image */
+	uint8_t ref; /* hit since the clock hand passed */
+	uint8_t pad[7];
+};
+
+/*
+ * The blocks are spread over the shards by hash, each shard is a hash table
+ * with its own lock and CLOCK replacement: the hand clears the ref bit of
+ * the slots it passes and evicts the first one without it.  New blocks
+ * start without the ref bit, so a large one-off read like a FAT load only
+ * pushes out blocks which have not been hit since.
+ */
+struct shard_s {
+	pthread_mutex_t mtx;
+	struct slot_s *slots;
+	uint32_t *heads; /* of the hash chains */
+	uint8_t *data;
+	uint32_t nslots;
+	uint32_t nused;
+	uint32_t nheads; /* power of 2 */
+	uint32_t hand;
+};
+
+static struct shard_s shards[BLKCACHE_SHARDS];
+static size_t cachesize;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static uint64_t mix(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return(h);
+}
+
+static uint64_t hash(uint64_t file, uint64_t blk) {
+	return(mix(file ^ mix(blk)));
+}
+
+/*
+ * Name an image by the device, inode, size and modification time of its
+ * file, so a rewritten image does not get the blocks of the old one.
+ */
+uint64_t blkcache_file(uint64_t dev, uint64_t ino, uint64_t size,
+    uint64_t mtime) {
+	return(mix(mix(mix(dev) ^ ino) ^ size) ^ mtime);
+}
+
+static void shard_free(struct shard_s *s) {
+	free(s->slots);
+	free(s->heads);
+	free(s->data);
+	s->slots = NULL;
+	s->heads = NULL;
+	s->data = NULL;
+	s->nslots = s->nused = s->nheads = s->hand = 0;
+}
+
+static int shard_alloc(struct shard_s *s, uint32_t nslots) {
+	uint32_t i;
+
+	if (nslots == 0)
+		return(0);
+	for (s->nheads = 1; s->nheads < nslots; s->nheads <<= 1)
+		;
+	s->slots = calloc(nslots, sizeof(struct slot_s));
+	s->heads = malloc(s->nheads * sizeof(uint32_t));
+	s->data = malloc((size_t)nslots * BLKCACHE_BLOCK);
+	if (s->slots == NULL || s->heads == NULL || s->data == NULL) {
+		shard_free(s);
+		return(ENOMEM);
+	}
+	for (i = 0; i < s->nheads; i++)
+		s->heads[i] = NIL;
+	s->nslots = nslots;
+	return(0);
+}
+
+/*
+ * Replace all shards by ones holding size bytes in total, the caller holds
+ * the locks of all shards.
+ */
+static int resize(size_t size) {
+	uint32_t nslots;
+	int i, error = 0;
+
+	nslots = size / BLKCACHE_BLOCK / BLKCACHE_SHARDS;
+	cachesize = (size_t)nslots * BLKCACHE_BLOCK * BLKCACHE_SHARDS;
+	for (i = 0; i < BLKCACHE_SHARDS; i++) {
+		shard_free(&shards[i]);
+		if (error == 0)
+			error = shard_alloc(&shards[i], nslots);
+	}
+	if (error) {
+		for (i = 0; i < BLKCACHE_SHARDS; i++)
+			shard_free(&shards[i]);
+		cachesize = 0;
+	}
+	return(error);
+}
+
+/*
+ * Create the shards, with a size of XTAF_CACHE bytes if set in the
+ * environment (a k, m or g suffix is allowed, 0 disables the cache).
+ */
+static void init(void) {
+	char *env, *end;
+	uint64_t size = BLKCACHE_DEFAULT;
+	int i;
+
+	for (i = 0; i < BLKCACHE_SHARDS; i++)
+		pthread_mutex_init(&shards[i].mtx, NULL);
+	env = getenv("XTAF_CACHE");
+	if (env != NULL) {
+		size = strtoull(env, &end, 0);
+		switch (*end) {
+		case 'g':
+		case 'G':
+			size *= 1024;
+			/* FALLTHROUGH */
+		case 'm':
+		case 'M':
+			size *= 1024;
+			/* FALLTHROUGH */
+		case 'k':
+		case 'K':
+			size *= 1024;
+		}
+	}
+	resize(size);
+}
+
+/*
+ * Set the memory budget of the cache to size bytes, dropping all blocks.
+ * 0 disables the cache.
+ */
+int blkcache_setsize(size_t size) {
+	int i, error;
+
+	pthread_once(&once, init);
+	for (i = 0; i < BLKCACHE_SHARDS; i++)
+		pthread_mutex_lock(&shards[i].mtx);
+	error = resize(size);
+	for (i = BLKCACHE_SHARDS - 1; i >= 0; i--)
+		pthread_mutex_unlock(&shards[i].mtx);
+	return(error);
+}
+
+size_t blkcache_size(void) {
+	pthread_once(&once, init);
+	return(cachesize);
+}
+
+static uint32_t find(struct shard_s *s, uint64_t h, uint64_t file,
+    uint64_t blk) {
+	uint32_t i;
+
+	for (i = s->heads[(h >> 8) & (s->nheads - 1)]; i != NIL;
+	    i = s->slots[i].next)
+		if (s->slots[i].blk == blk && s->slots[i].file == file)
+			break;
+	return(i);
+}
+
+/*
+ * Copy len bytes at offset off of block blk of file to buf.  Returns 1 on
+ * a hit, 0 if the block is not in the cache or shorter than off + len.
+ */
+int blkcache_get(uint64_t file, uint64_t blk, void *buf, uint32_t off,
+    uint32_t len) {
+	struct shard_s *s;
+	uint64_t h;
+	uint32_t i;
+	int hit = 0;
+
+	pthread_once(&once, init);
+	h = hash(file, blk);
+	s = &shards[h & (BLKCACHE_SHARDS - 1)];
+	pthread_mutex_lock(&s->mtx);
+	if (s->nslots > 0) {
+		i = find(s, h, file, blk);
+		if (i != NIL && off + len <= s->slots[i].len) {
+			if (len > 0)
+				memcpy(buf, s->data +
+				    (size_t)i * BLKCACHE_BLOCK + off, len);
+			s->slots[i].ref = 1;
+			hit = 1;
+		}
+	}
+	pthread_mutex_unlock(&s->mtx);
+	return(hit);
+}
+
+/*
+ * Add block blk of file, of which len bytes are valid, evicting another
+ * block if the shard is full.
+ */
+void blkcache_put(uint64_t file, uint64_t blk, const void *buf,
+    uint32_t len) {
+	struct shard_s *s;
+	uint32_t *p;
+	uint64_t h;
+	uint32_t i;
+
+	pthread_once(&once, init);
+	h = hash(file, blk);
+	s = &shards[h & (BLKCACHE_SHARDS - 1)];
+	pthread_mutex_lock(&s->mtx);
+	if (s->nslots == 0 || len > BLKCACHE_BLOCK) {
+		pthread_mutex_unlock(&s->mtx);
+		return;
+	}
+	i = find(s, h, file, blk);
+	if (i == NIL) {
+		if (s->nused < s->nslots)
+			i = s->nused++;
+		else {
+			while (s->slots[s->hand].ref) {
+				s->slots[s->hand].ref = 0;
+				s->hand = (s->hand + 1) % s->nslots;
+			}
+			i = s->hand;
+			s->hand = (s->hand + 1) % s->nslots;
+			/* unlink the victim from its chain */
+			p = &s->heads[(hash(s->slots[i].file,
+			    s->slots[i].blk) >> 8) & (s->nheads - 1)];
+			while (*p != i)
+				p = &s->slots[*p].next;
+			*p = s->slots[i].next;
+		}
+		s->slots[i].file = file;
+		s->slots[i].blk = blk;
+		s->slots[i].ref = 0;
+		p = &s->heads[(h >> 8) & (s->nheads - 1)];
+		s->slots[i].next = *p;
+		*p = i;
+	}
+	memcpy(s->data + (size_t)i * BLKCACHE_BLOCK, buf, len);
+	s->slots[i].len = len;
+	pthread_mutex_unlock(&s->mtx);
+}
@@ -0,0 +1,48 @@
+/*
+Copyright (c) 2007,2008 Rene Ladan <r.c.ladan@gmail.com> All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+
+libxtaf: block cache for the metadata of XTAF volumes, see libxtaf.txt.
+
+*/
+#ifndef _BLKCACHE_H_
+#define _BLKCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLKCACHE_BLOCK 4096 /* bytes, blocks are aligned in the image */
+#define BLKCACHE_SHARDS 16 /* power of 2 */
+#define BLKCACHE_DEFAULT (32 * 1024 * 1024)
+
+/*
+ * One cache for the whole process.  A block is named by the image it comes
+ * from (see blkcache_file()) and its number in that image.
+ */
+uint64_t blkcache_file(uint64_t, uint64_t, uint64_t, uint64_t);
+int blkcache_setsize(size_t);
+size_t blkcache_size(void);
+int blkcache_get(uint64_t, uint64_t, void *, uint32_t, uint32_t);
+void blkcache_put(uint64_t, uint64_t, const void *, uint32_t);
+
+#endif /* !_BLKCACHE_H_ */
@@ -0,0 +1,1137 @@
+/*
+Copyright (c) 2007,2008 Rene Ladan <r.c.ladan@gmail.com> All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+
+libxtaf: read-only access to XTAF volumes, see libxtaf.txt.
+
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libxtaf.h"
+#include "blkcache.h"
+#include "../xtaf/sys/fs/xtaf/fat_scan.h"
+#include "../xtaf/sys/fs/xtaf/name_hash.h"
+
+#define FAT32_MASK 0x0fffffff
+#define FAT16_MASK 0x0000ffff
+#define DIRENT_SIZE 64
+#define META_RUN 256 /* blocks per read on a cache miss */
+#define NAMES_MIN 8 /* smaller directories are scanned, see dir_names() */
+#define AIO_CHUNK (256 * 1024) /* larger reads are split, see read_at() */
+#define AIO_POOL 4 /* idle engines kept per volume, see aio_get() */
+
+/*
+ * The index and the geometry do not change once the volume is open, so
+ * lookups need no locking.  The FAT and the usage bitmap are loaded on
+ * first use under loadmtx, and so are the name tables of the directories,
+ * which are read without the lock once they are published.  The counters
+ * are protected by statmtx.  The boot block, the FAT and the directories
+ * are read through the block cache, which is shared by all volumes, see
+ * blkcache.c.  Large reads are spread over an engine of aio.c taken from
+ * aiopool under aiomtx.  The engines in aiopool belong to process aiopid,
+ * a child forked after the volume was read from has none of their threads.
+ */
+struct xtaf_vol {
+	struct xtaf_geom geom;
+	struct xtaf_index idx;
+	int ownindex; /* idx was built here, not passed in */
+	uint32_t nalloc; /* nodes allocated while building */
+	uint32_t poolalloc;
+	int fd;
+	char *path; /* for xtaf_reopen() */
+	uint64_t cacheid; /* name of the image in the block cache */
+	uint8_t *fat; /* on-disk (big endian) order */
+	uint32_t *inuse; /* bit set for clusters in use */
+	struct xtaf_usage usage;
+	struct hash_table **names; /* by node, see dir_names() */
+	pthread_mutex_t loadmtx;
+	struct xtaf_stats stats;
+	uint64_t nextoff; /* where the last read ended */
+	struct xtaf_trace trace;
+	pthread_mutex_t statmtx;
+	struct xtaf_aio *aiopool[AIO_POOL];
+	uint32_t naio;
+	pid_t aiopid;
+	pthread_mutex_t aiomtx;
+};
+
+struct xtaf_dir {
+	struct xtaf_vol *vol;
+	uint32_t next;
+	uint32_t last;
+};
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static uint16_t be16(const uint8_t *p) {
+	return((uint16_t)p[0] << 8 | p[1]);
+}
+
+static uint32_t be32(const uint8_t *p) {
+	return((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | p[3]);
+}
+
+static void stats_add(struct xtaf_vol *vol, uint64_t *counter, uint64_t n) {
+	pthread_mutex_lock(&vol->statmtx);
+	*counter += n;
+	pthread_mutex_unlock(&vol->statmtx);
+}
+
+/*
+ * Count a read of len bytes at image offset off, for callers which read
+ * xtaf_fd() themselves as well.
+ */
+void xtaf_count_read(struct xtaf_vol *vol, uint64_t off, uint64_t len,
+    int purpose) {
+	pthread_mutex_lock(&vol->statmtx);
+	vol->stats.reads++;
+	if (off != vol->nextoff)
+		vol->stats.seeks++;
+	vol->stats.bytes += len;
+	vol->nextoff = off + len;
+	if (vol->trace.fn != NULL)
+		vol->trace.fn(vol->trace.arg, off, len, purpose);
+	pthread_mutex_unlock(&vol->statmtx);
+}
+
+/*
+ * pread(2) all len bytes at off.
+ */
+static int read_sync(struct xtaf_vol *vol, void *buf, size_t len,
+    uint64_t off, int purpose) {
+	ssize_t s;
+	size_t done;
+
+	xtaf_count_read(vol, off, len, purpose);
+	for (done = 0; done < len; done += s) {
+		s = pread(vol->fd, (uint8_t *)buf + done, len - done,
+		    off + done);
+		if (s == -1 && errno == EINTR)
+			s = 0;
+		else if (s <= 0)
+			return(EIO);
+	}
+	return(0);
+}
+
+/*
+ * Forget the idle engines of vol if they were started by the parent of this
+ * process.  Their threads only exist in the parent, so they cannot be
+ * closed here, what they hold is left behind.
+ */
+static void aio_forked(struct xtaf_vol *vol) {
+	if (vol->aiopid != getpid()) {
+		vol->naio = 0;
+		vol->aiopid = getpid();
+	}
+}
+
+/*
+ * Take an idle engine of vol, or start a new one.  NULL if that fails.
+ */
+static struct xtaf_aio *aio_get(struct xtaf_vol *vol) {
+	struct xtaf_aio *aio = NULL;
+
+	pthread_mutex_lock(&vol->aiomtx);
+	aio_forked(vol);
+	if (vol->naio > 0)
+		aio = vol->aiopool[--vol->naio];
+	pthread_mutex_unlock(&vol->aiomtx);
+	if (aio == NULL && xtaf_aio_open(vol, 0, 0, &aio))
+		return(NULL);
+	return(aio);
+}
+
+static void aio_put(struct xtaf_vol *vol, struct xtaf_aio *aio) {
+	pthread_mutex_lock(&vol->aiomtx);
+	aio_forked(vol);
+	if (vol->naio < AIO_POOL) {
+		vol->aiopool[vol->naio++] = aio;
+		aio = NULL;
+	}
+	pthread_mutex_unlock(&vol->aiomtx);
+	xtaf_aio_close(aio);
+}
+
+/*
+ * Read all n requests, with as many in flight as the engine allows.  Each
+ * has to be read in full.  Without an engine they are read one by one.
+ */
+static int read_reqs(struct xtaf_vol *vol, struct xtaf_aio_req *reqs,
+    uint32_t n) {
+	struct xtaf_aio *aio;
+	struct xtaf_aio_req *r;
+	uint32_t i, done;
+	int error = 0, e;
+
+	aio = n > 1 ? aio_get(vol) : NULL;
+	if (aio == NULL) {
+		for (i = 0; i < n && error == 0; i++)
+			error = read_sync(vol, reqs[i].buf, reqs[i].len,
+			    reqs[i].off, reqs[i].purpose);
+		return(error);
+	}
+	for (i = done = 0; done < i || (i < n && error == 0);) {
+		if (i < n && error == 0 &&
+		    (e = xtaf_aio_submit(aio, &reqs[i])) != EAGAIN) {
+			if (e)
+				error = e;
+			else
+				i++;
+			continue;
+		}
+		e = xtaf_aio_wait(aio, &r);
+		if (e) {
+			/* the engine is broken, do not keep it */
+			xtaf_aio_close(aio);
+			return(e);
+		}
+		done++;
+		if (error == 0 && r->res != (ssize_t)r->len)
+			error = r->res < 0 ? -r->res : EIO;
+	}
+	aio_put(vol, aio);
+	return(error);
+}
+
+/*
+ * Read all len bytes at off.  Large reads, like the FAT of a big disk,
+ * are split in pieces of AIO_CHUNK bytes which are read in parallel.
+ */
+static int read_at(struct xtaf_vol *vol, void *buf, size_t len, uint64_t off,
+    int purpose) {
+	struct xtaf_aio_req *reqs;
+	uint32_t i, n;
+	int error;
+
+	n = (len + AIO_CHUNK - 1) / AIO_CHUNK;
+	if (n <= 1 || (reqs = calloc(n, sizeof(struct xtaf_aio_req))) == NULL)
+		return(read_sync(vol, buf, len, off, purpose));
+	for (i = 0; i < n; i++) {
+		reqs[i].buf = (uint8_t *)buf + (size_t)i * AIO_CHUNK;
+		reqs[i].off = off + (uint64_t)i * AIO_CHUNK;
+		reqs[i].len = i < n - 1 ? AIO_CHUNK : len - (size_t)i *
+		    AIO_CHUNK;
+		reqs[i].purpose = purpose;
+	}
+	error = read_reqs(vol, reqs, n);
+	free(reqs);
+	return(error);
+}
+
+/*
+ * Read len bytes of metadata at off through the block cache.  Blocks in the
+ * cache are copied, runs of missing blocks are read with one read_at() and
+ * added to the cache.  Reads larger than half the cache bypass it, they
+ * would only evict each other.
+ */
+static int read_meta(struct xtaf_vol *vol, void *buf, size_t len,
+    uint64_t off, int purpose) {
+	uint8_t *run;
+	uint64_t blk, last, end, rlen;
+	uint32_t boff, blen, i;
+	size_t done;
+	int error;
+
+	if (len > blkcache_size() / 2)
+		return(read_at(vol, buf, len, off, purpose));
+	end = off + len;
+	for (done = 0; done < len; done += blen) {
+		blk = (off + done) / BLKCACHE_BLOCK;
+		boff = (off + done) % BLKCACHE_BLOCK;
+		blen = BLKCACHE_BLOCK - boff;
+		if (blen > len - done)
+			blen = len - done;
+		if (blkcache_get(vol->cacheid, blk, (uint8_t *)buf + done, boff,
+		    blen)) {
+			stats_add(vol, &vol->stats.cache_hits, 1);
+			continue;
+		}
+
+		/* read this block and the missing ones following it */
+		for (last = blk + 1; last * BLKCACHE_BLOCK < end &&
+		    last - blk < META_RUN &&
+		    !blkcache_get(vol->cacheid, last, NULL, 0, 0); last++)
+			;
+		rlen = (last - blk) * BLKCACHE_BLOCK;
+		if (blk * BLKCACHE_BLOCK + rlen > vol->geom.mediasize) {
+			if (end > vol->geom.mediasize)
+				return(EIO);
+			rlen = vol->geom.mediasize - blk * BLKCACHE_BLOCK;
+		}
+		stats_add(vol, &vol->stats.cache_misses, last - blk);
+		run = malloc(rlen);
+		if (run == NULL)
+			return(ENOMEM);
+		error = read_at(vol, run, rlen, blk * BLKCACHE_BLOCK, purpose);
+		if (error) {
+			free(run);
+			return(error);
+		}
+		for (i = 0; i < last - blk; i++)
+			blkcache_put(vol->cacheid, blk + i,
+			    run + (size_t)i * BLKCACHE_BLOCK,
+			    rlen - (size_t)i * BLKCACHE_BLOCK < BLKCACHE_BLOCK ?
+			    rlen - (size_t)i * BLKCACHE_BLOCK : BLKCACHE_BLOCK);
+		memcpy((uint8_t *)buf + done, run + boff, blen);
+		free(run);
+	}
+	return(0);
+}
+
+/*
+ * Read the boot block and work out the layout, like mountxtaf(): the FAT
+ * at sector 8 with one entry per cluster of the medium rounded up to 4 kB,
+ * then the root directory, after 4 kB of zeroes on hard disks.
+ */
+static int read_geometry(struct xtaf_vol *vol) {
+	struct xtaf_geom *g = &vol->geom;
+	uint8_t boot[512], quirkblk[4096];
+	off_t size;
+	size_t i;
+	int error;
+
+	size = lseek(vol->fd, 0, SEEK_END);
+	if (size <= 0)
+		return(EINVAL);
+	g->mediasize = size;
+	error = read_meta(vol, boot, sizeof(boot), 0, XTAF_IO_BOOT);
+	if (error)
+		return(error);
+	if (memcmp(boot, "XTAF", 4))
+		return(EINVAL);
+	memcpy(g->magic, boot, 4);
+	g->volid = be32(boot + 4);
+	g->spc = be32(boot + 8);
+	g->nfat = be32(boot + 12);
+	if (g->nfat != 1 || g->spc == 0 || g->spc & (g->spc - 1))
+		return(EINVAL);
+
+	g->numclusters = g->mediasize / (512 * g->spc);
+	if (g->numclusters >= 0xfff4) {
+		g->fatmask = FAT32_MASK;
+		g->fatmult = 4;
+	} else {
+		g->fatmask = FAT16_MASK;
+		g->fatmult = 2;
+	}
+	g->fatsize = g->numclusters * g->fatmult;
+	if (g->fatsize % 4096 != 0)
+		g->fatsize = ((g->fatsize / 4096) + 1) * 4096;
+	g->fatsecs = g->fatsize / 512;
+	g->fatstart = 8;
+	g->rootstart = g->fatsecs + g->fatstart;
+
+	/* correct for hd quirk */
+	error = read_meta(vol, quirkblk, sizeof(quirkblk),
+	    (uint64_t)g->rootstart * 512, XTAF_IO_BOOT);
+	if (error)
+		return(error);
+	for (i = 0; i < sizeof(quirkblk) && quirkblk[i] == 0; i++)
+		;
+	if (i == sizeof(quirkblk))
+		g->rootstart += 8;
+
+	g->firstcluster = g->rootstart + g->spc;
+	if (g->mediasize / 512 <= g->firstcluster)
+		return(EINVAL);
+	g->maxcluster = (g->mediasize / 512 - g->firstcluster) / g->spc + 1;
+	if (g->maxcluster >= g->numclusters)
+		g->maxcluster = g->numclusters - 1;
+	return(0);
+}
+
+/*
+ * Make sure the whole FAT is in memory, so following a chain costs memory
+ * reads instead of a seek and a tiny read per link.
+ */
+static int need_fat(struct xtaf_vol *vol) {
+	uint8_t *fat;
+	double start;
+	int error = 0;
+
+	pthread_mutex_lock(&vol->loadmtx);
+	stats_add(vol, vol->fat != NULL ? &vol->stats.mem_hits :
+	    &vol->stats.mem_misses, 1);
+	if (vol->fat == NULL) {
+		start = now();
+		fat = malloc(vol->geom.fatsize);
+		if (fat == NULL)
+			error = ENOMEM;
+		else if ((error = read_meta(vol, fat, vol->geom.fatsize,
+		    (uint64_t)vol->geom.fatstart * 512, XTAF_IO_FAT)) != 0)
+			free(fat);
+		else
+			vol->fat = fat;
+		pthread_mutex_lock(&vol->statmtx);
+		vol->stats.fat_seconds += now() - start;
+		pthread_mutex_unlock(&vol->statmtx);
+	}
+	pthread_mutex_unlock(&vol->loadmtx);
+	return(error);
+}
+
+/*
+ * Return the masked FAT entry for cluster, 0 (free) if it lies outside the
+ * FAT.
+ */
+static uint32_t fat_entry(struct xtaf_vol *vol, uint32_t cluster) {
+	uint8_t *p;
+
+	if ((uint64_t)cluster * vol->geom.fatmult >= vol->geom.fatsize)
+		return(0);
+	p = vol->fat + (uint64_t)cluster * vol->geom.fatmult;
+	if (vol->geom.fatmult == 2)
+		return(be16(p) & vol->geom.fatmask);
+	return(be32(p) & vol->geom.fatmask);
+}
+
+/*
+ * Follow the chain starting at cluster start and return it as runs of
+ * physically consecutive clusters in *extp (to be freed by the caller),
+ * their number in *nextp and the number of clusters in *nclustp.  size is
+ * the file size in bytes and is used to check that the chain is long
+ * enough, pass 0 for directories.
+ */
+int xtaf_extents(struct xtaf_vol *vol, uint32_t start, uint32_t size,
+    struct xtaf_extent **extp, uint32_t *nextp, uint32_t *nclustp) {
+	struct xtaf_geom *g = &vol->geom;
+	struct xtaf_extent *ext = NULL, *e;
+	uint32_t cluster, sector, nc, links, next = 0, alloc = 0, nclust = 0;
+	int error;
+
+	error = need_fat(vol);
+	if (error)
+		return(error);
+	nc = size / (512 * g->spc);
+	if (size % (512 * g->spc) > 0)
+		nc++;
+	for (cluster = start, links = 0; ; links++) {
+		if (links > g->numclusters) {
+			free(ext);
+			return(ELOOP);
+		}
+		sector = (cluster - 1) * g->spc + g->rootstart;
+		if (next > 0 && ext[next - 1].sector +
+		    ext[next - 1].nclust * g->spc == sector)
+			ext[next - 1].nclust++;
+		else {
+			if (next == alloc) {
+				alloc = alloc == 0 ? 4 : alloc * 2;
+				e = realloc(ext,
+				    alloc * sizeof(struct xtaf_extent));
+				if (e == NULL) {
+					free(ext);
+					return(ENOMEM);
+				}
+				ext = e;
+			}
+			ext[next].sector = sector;
+			ext[next].nclust = 1;
+			next++;
+		}
+		nclust++;
+
+		cluster = fat_entry(vol, cluster);
+		/* from wikpedia::File_Allocation_Table :
+		   0 = free cluster
+		   2 .. 0x?fffffef = pointer to next, used
+		   1, 0x?ffffff0 .. 0x?ffffff6 = reserved value
+		   0x?ffffff7 = bad sector in cluster or reserved cluster
+		   0x?ffffff8 .. 0x?fffffff = last cluster in file
+		*/
+		if (cluster < 2 || cluster > (0xffffffef & g->fatmask))
+			break;
+	}
+	stats_add(vol, &vol->stats.fat_lookups, links + 1);
+	if (nclust < nc) {
+		free(ext);
+		return(EIO);
+	}
+	*extp = ext;
+	*nextp = next;
+	if (nclustp != NULL)
+		*nclustp = nclust;
+	return(0);
+}
+
+/*
+ * Read all clusters of the directory starting at cluster clust, using one
+ * read per run.  The number of 64 byte slots is returned in nent, the
+ * caller has to free the result.
+ */
+static int read_dir(struct xtaf_vol *vol, uint32_t clust, uint8_t **dirp,
+    uint32_t *nent) {
+	struct xtaf_extent *ext;
+	uint32_t i, next, nclust;
+	uint64_t csize, pos;
+	uint8_t *dir;
+	int error;
+
+	csize = 512 * vol->geom.spc;
+	error = xtaf_extents(vol, clust, 0, &ext, &next, &nclust);
+	if (error)
+		return(error);
+	dir = malloc(nclust * csize);
+	if (dir == NULL) {
+		free(ext);
+		return(ENOMEM);
+	}
+	for (i = 0, pos = 0; i < next; i++) {
+		error = read_meta(vol, dir + pos, ext[i].nclust * csize,
+		    (uint64_t)ext[i].sector * 512, XTAF_IO_DIR);
+		if (error) {
+			free(dir);
+			free(ext);
+			return(error);
+		}
+		pos += ext[i].nclust * csize;
+	}
+	free(ext);
+	stats_add(vol, &vol->stats.dir_clusters, nclust);
+	*dirp = dir;
+	*nent = pos / DIRENT_SIZE;
+	return(0);
+}
+
+/*
+ * Append a name to the pool, returns its offset.
+ */
+static uint32_t pool_add(struct xtaf_vol *vol, const char *name) {
+	struct xtaf_index *idx = &vol->idx;
+	uint32_t len;
+	char *pool;
+
+	len = strlen(name) + 1;
+	if (idx->poolsize + len > vol->poolalloc) {
+		vol->poolalloc = vol->poolalloc == 0 ? 4096 :
+		    vol->poolalloc * 2;
+		pool = realloc(idx->pool, vol->poolalloc);
+		if (pool == NULL)
+			return(XTAF_NO_NODE);
+		idx->pool = pool;
+	}
+	memcpy(idx->pool + idx->poolsize, name, len);
+	idx->poolsize += len;
+	return(idx->poolsize - len);
+}
+
+/*
+ * Add a node for the 64 byte directory entry de to the index.  The name of
+ * a deleted entry runs up to the first 0x00 or 0xff byte.
+ */
+static int add_node(struct xtaf_vol *vol, uint32_t parent, uint32_t slot,
+    const uint8_t *de) {
+	struct xtaf_index *idx = &vol->idx;
+	struct xtaf_node *n;
+	char fname[43];
+	int i;
+
+	if (idx->nnodes == vol->nalloc) {
+		vol->nalloc = vol->nalloc == 0 ? 256 : vol->nalloc * 2;
+		n = realloc(idx->nodes, vol->nalloc * sizeof(struct xtaf_node));
+		if (n == NULL)
+			return(ENOMEM);
+		idx->nodes = n;
+	}
+	bzero(fname, sizeof(fname));
+	if (de[0] == 0xe5) {
+		for (i = 0; i < 42; i++) {
+			if (de[2 + i] == 0x00 || de[2 + i] == 0xff)
+				break;
+			fname[i] = de[2 + i];
+		}
+	} else
+		memcpy(fname, de + 2, de[0] > 42 ? 42 : de[0]);
+
+	n = &idx->nodes[idx->nnodes];
+	bzero(n, sizeof(struct xtaf_node));
+	n->name = pool_add(vol, fname);
+	if (n->name == XTAF_NO_NODE)
+		return(ENOMEM);
+	n->parent = parent;
+	n->slot = slot;
+	n->fnl = de[0];
+	n->attr = de[1];
+	n->fstart = be32(de + 44);
+	n->fsize = be32(de + 48);
+	for (i = 0; i < 6; i++)
+		n->dati[i] = be16(de + 52 + 2 * i);
+	idx->nnodes++;
+	return(0);
+}
+
+/*
+ * Is node n a directory which can be entered?
+ */
+int xtaf_is_dir(struct xtaf_vol *vol, uint32_t n) {
+	return(n == XTAF_ROOT || (vol->idx.nodes[n].fnl != 0xe5 &&
+	    (vol->idx.nodes[n].attr & 16)));
+}
+
+/*
+ * Scan every directory of the volume once, breadth-first.  The node array
+ * doubles as the queue of the scan.  Each directory cluster is only entered
+ * once, so a corrupt tree cannot make this loop.  Directories which cannot
+ * be read are counted in baddirs and left empty.
+ */
+static int build_index(struct xtaf_vol *vol) {
+	struct xtaf_index *idx = &vol->idx;
+	uint8_t root[DIRENT_SIZE], *dir, *seen;
+	uint32_t n, entry, nent, clust;
+	int error = 0;
+
+	seen = calloc(vol->geom.numclusters / 8 + 1, sizeof(uint8_t));
+	if (seen == NULL)
+		return(ENOMEM);
+	bzero(root, sizeof(root));
+	root[1] = 16; /* directory, fstart 0 */
+	error = add_node(vol, 0, 0, root);
+	if (error == 0)
+		idx->nodes[XTAF_ROOT].fstart = 1;
+	for (n = 0; error == 0 && n < idx->nnodes; n++) {
+		if (!xtaf_is_dir(vol, n))
+			continue;
+		clust = idx->nodes[n].fstart;
+		if (clust < 1 || clust >= vol->geom.numclusters ||
+		    seen[clust / 8] & (1 << (clust % 8)))
+			continue;
+		seen[clust / 8] |= 1 << (clust % 8);
+		if (read_dir(vol, clust, &dir, &nent)) {
+			vol->stats.baddirs++;
+			continue;
+		}
+		vol->stats.dirs++;
+		idx->nodes[n].first = idx->nnodes;
+		for (entry = 0; error == 0 && entry < nent; entry++) {
+			if (dir[entry * DIRENT_SIZE] == 0x00 ||
+			    dir[entry * DIRENT_SIZE] == 0xff)
+				continue; /* to next slot */
+			error = add_node(vol, n, entry,
+			    dir + entry * DIRENT_SIZE);
+		}
+		idx->nodes[n].nchild = idx->nnodes - idx->nodes[n].first;
+		free(dir);
+	}
+	free(seen);
+	return(error);
+}
+
+static int vol_alloc(const char *path, const struct xtaf_trace *trace,
+    struct xtaf_vol **volp) {
+	struct xtaf_vol *vol;
+	struct stat st;
+	int error;
+
+	vol = calloc(1, sizeof(struct xtaf_vol));
+	if (vol == NULL)
+		return(ENOMEM);
+	vol->path = strdup(path);
+	if (vol->path == NULL) {
+		free(vol);
+		return(ENOMEM);
+	}
+	vol->fd = open(path, O_RDONLY);
+	if (vol->fd == -1 || fstat(vol->fd, &st) == -1) {
+		error = errno;
+		if (vol->fd != -1)
+			close(vol->fd);
+		free(vol->path);
+		free(vol);
+		return(error);
+	}
+	vol->cacheid = blkcache_file(st.st_dev, st.st_ino, st.st_size,
+	    (uint64_t)st.st_mtime * 1000000000 + st.st_mtim.tv_nsec);
+	if (trace != NULL)
+		vol->trace = *trace;
+	pthread_mutex_init(&vol->loadmtx, NULL);
+	pthread_mutex_init(&vol->statmtx, NULL);
+	pthread_mutex_init(&vol->aiomtx, NULL);
+	vol->aiopid = getpid();
+	*volp = vol;
+	return(0);
+}
+
+/*
+ * Open the volume in the image or device at path and build its index.
+ * trace may be NULL.
+ */
+int xtaf_open(const char *path, const struct xtaf_trace *trace,
+    struct xtaf_vol **volp) {
+	struct xtaf_vol *vol;
+	double start;
+	int error;
+
+	error = vol_alloc(path, trace, &vol);
+	if (error)
+		return(error);
+	vol->ownindex = 1;
+	error = read_geometry(vol);
+	if (error == 0)
+		error = need_fat(vol);
+	if (error == 0) {
+		start = now();
+		error = build_index(vol);
+		vol->stats.index_seconds += now() - start;
+	}
+	if (error) {
+		xtaf_close(vol);
+		return(error);
+	}
+	*volp = vol;
+	return(0);
+}
+
+/*
+ * Read only the boot block and the layout of the volume at path, for
+ * tools which do not trust or need the rest.
+ */
+int xtaf_probe(const char *path, struct xtaf_geom *geom) {
+	struct xtaf_vol *vol;
+	int error;
+
+	error = vol_alloc(path, NULL, &vol);
+	if (error)
+		return(error);
+	error = read_geometry(vol);
+	if (error == 0)
+		*geom = vol->geom;
+	xtaf_close(vol);
+	return(error);
+}
+
+/*
+ * Open the volume at path with a geometry and index saved earlier, see
+ * xtaf_geometry() and xtaf_get_index().  Nothing is read until needed.
+ * The index is used in place and must stay valid until xtaf_close().
+ */
+int xtaf_open_index(const char *path, const struct xtaf_geom *geom,
+    const struct xtaf_index *idx, const struct xtaf_trace *trace,
+    struct xtaf_vol **volp) {
+	struct xtaf_vol *vol;
+	int error;
+
+	if (idx->nnodes == 0 || geom->spc == 0 || geom->fatsize <
+	    (uint64_t)geom->numclusters * geom->fatmult)
+		return(EINVAL);
+	error = vol_alloc(path, trace, &vol);
+	if (error)
+		return(error);
+	vol->geom = *geom;
+	vol->idx = *idx;
+	*volp = vol;
+	return(0);
+}
+
+void xtaf_close(struct xtaf_vol *vol) {
+	uint32_t n;
+
+	if (vol == NULL)
+		return;
+	aio_forked(vol);
+	while (vol->naio > 0)
+		xtaf_aio_close(vol->aiopool[--vol->naio]);
+	close(vol->fd);
+	free(vol->path);
+	free(vol->fat);
+	free(vol->inuse);
+	if (vol->names != NULL)
+		for (n = 0; n < vol->idx.nnodes; n++)
+			if (vol->names[n] != NULL) {
+				hash_table_destroy(vol->names[n]);
+				free(vol->names[n]);
+			}
+	free(vol->names);
+	if (vol->ownindex) {
+		free(vol->idx.nodes);
+		free(vol->idx.pool);
+	}
+	pthread_mutex_destroy(&vol->loadmtx);
+	pthread_mutex_destroy(&vol->statmtx);
+	pthread_mutex_destroy(&vol->aiomtx);
+	free(vol);
+}
+
+const struct xtaf_geom *xtaf_geometry(struct xtaf_vol *vol) {
+	return(&vol->geom);
+}
+
+void xtaf_get_index(struct xtaf_vol *vol, struct xtaf_index *idx) {
+	*idx = vol->idx;
+}
+
+void xtaf_get_stats(struct xtaf_vol *vol, struct xtaf_stats *st) {
+	pthread_mutex_lock(&vol->statmtx);
+	*st = vol->stats;
+	pthread_mutex_unlock(&vol->statmtx);
+}
+
+/*
+ * The descriptor of the image, for pread(2) or zero-copy by the caller.
+ */
+int xtaf_fd(struct xtaf_vol *vol) {
+	return(vol->fd);
+}
+
+/*
+ * Open the image again with extra open(2) flags, such as O_DIRECT, which
+ * would otherwise apply to xtaf_fd() as well.  Returns the descriptor, or
+ * -1 with errno set.
+ */
+int xtaf_reopen(struct xtaf_vol *vol, int flags) {
+	return(open(vol->path, O_RDONLY | flags));
+}
+
+/*
+ * Return the name table of directory node dir, built on the first lookup in
+ * it.  NULL for small directories, or if there is no memory for the table.
+ * The index does not change, so the table never has to be rebuilt.
+ */
+static struct hash_table *dir_names(struct xtaf_vol *vol, uint32_t dir) {
+	struct xtaf_index *idx = &vol->idx;
+	struct hash_table **names, *nt;
+	uint32_t n;
+
+	if (idx->nodes[dir].nchild < NAMES_MIN)
+		return(NULL);
+	names = __atomic_load_n(&vol->names, __ATOMIC_ACQUIRE);
+	if (names != NULL &&
+	    (nt = __atomic_load_n(&names[dir], __ATOMIC_ACQUIRE)) != NULL)
+		return(nt);
+
+	pthread_mutex_lock(&vol->loadmtx);
+	if (vol->names == NULL)
+		__atomic_store_n(&vol->names, calloc(idx->nnodes,
+		    sizeof(struct hash_table *)), __ATOMIC_RELEASE);
+	nt = NULL;
+	if (vol->names != NULL && (nt = vol->names[dir]) == NULL &&
+	    (nt = calloc(1, sizeof(struct hash_table))) != NULL) {
+		if (hash_table_init(nt, idx->nodes[dir].nchild) == 0)
+			for (n = idx->nodes[dir].first; n <
+			    idx->nodes[dir].first + idx->nodes[dir].nchild; n++)
+				if (idx->nodes[n].fnl != 0xe5)
+					hash_table_add(nt, name_hash(
+					    (uint8_t *)idx->pool +
+					    idx->nodes[n].name, 42), n);
+		if (nt->ht_slots == NULL) {
+			free(nt);
+			nt = NULL;
+		} else
+			__atomic_store_n(&vol->names[dir], nt,
+			    __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&vol->loadmtx);
+	return(nt);
+}
+
+/*
+ * Find name in directory node dir, deleted entries are skipped.
+ */
+uint32_t xtaf_get_entry(struct xtaf_vol *vol, uint32_t dir, const char *name) {
+	struct xtaf_index *idx = &vol->idx;
+	struct hash_table *nt;
+	uint32_t n, hash, pos = 0;
+
+	nt = dir_names(vol, dir);
+	if (nt != NULL) {
+		hash = name_hash((const uint8_t *)name, 42);
+		while ((n = hash_table_find(nt, hash, &pos)) != HASH_NOT_FOUND)
+			if (!strcmp(idx->pool + idx->nodes[n].name, name))
+				return(n);
+		return(XTAF_NO_NODE);
+	}
+	for (n = idx->nodes[dir].first;
+	    n < idx->nodes[dir].first + idx->nodes[dir].nchild; n++)
+		if (idx->nodes[n].fnl != 0xe5 &&
+		    !strcmp(idx->pool + idx->nodes[n].name, name))
+			return(n);
+	return(XTAF_NO_NODE);
+}
+
+/*
+ * Look up path, relative to directory node dir unless it starts with a /.
+ */
+int xtaf_lookup(struct xtaf_vol *vol, uint32_t dir, const char *path,
+    uint32_t *node) {
+	const char *part, *end;
+	char name[43];
+	uint32_t n;
+	size_t len;
+
+	if (path == NULL || *path == '\0' || dir >= vol->idx.nnodes)
+		return(EINVAL);
+	n = path[0] == '/' ? XTAF_ROOT : dir;
+	for (part = path; *part != '\0'; part = end) {
+		for (; *part == '/'; part++)
+			;
+		end = strchr(part, '/');
+		if (end == NULL)
+			end = part + strlen(part);
+		len = end - part;
+		if (len == 0 || (len == 1 && part[0] == '.'))
+			continue;
+		if (!xtaf_is_dir(vol, n))
+			return(ENOTDIR);
+		if (len == 2 && !strncmp(part, "..", 2))
+			n = vol->idx.nodes[n].parent;
+		else {
+			if (len >= sizeof(name))
+				return(ENOENT);
+			memcpy(name, part, len);
+			name[len] = '\0';
+			n = xtaf_get_entry(vol, n, name);
+			if (n == XTAF_NO_NODE)
+				return(ENOENT);
+		}
+	}
+	*node = n;
+	return(0);
+}
+
+int xtaf_stat(struct xtaf_vol *vol, uint32_t n, struct xtaf_stat *st) {
+	if (n >= vol->idx.nnodes)
+		return(ENOENT);
+	st->node = n;
+	st->n = &vol->idx.nodes[n];
+	st->name = vol->idx.pool + st->n->name;
+	st->isdir = xtaf_is_dir(vol, n);
+	st->deleted = st->n->fnl == 0xe5;
+	return(0);
+}
+
+/*
+ * Iterate over the entries of directory node n, deleted ones included.
+ */
+int xtaf_opendir(struct xtaf_vol *vol, uint32_t n, struct xtaf_dir **dirp) {
+	struct xtaf_dir *dir;
+
+	if (n >= vol->idx.nnodes)
+		return(ENOENT);
+	if (!xtaf_is_dir(vol, n))
+		return(ENOTDIR);
+	dir = malloc(sizeof(struct xtaf_dir));
+	if (dir == NULL)
+		return(ENOMEM);
+	dir->vol = vol;
+	dir->next = vol->idx.nodes[n].first;
+	dir->last = dir->next + vol->idx.nodes[n].nchild;
+	*dirp = dir;
+	return(0);
+}
+
+/*
+ * Fill in st for the next entry, returns ENOENT after the last one.
+ */
+int xtaf_readdir(struct xtaf_dir *dir, struct xtaf_stat *st) {
+	if (dir->next >= dir->last)
+		return(ENOENT);
+	return(xtaf_stat(dir->vol, dir->next++, st));
+}
+
+void xtaf_closedir(struct xtaf_dir *dir) {
+	free(dir);
+}
+
+/*
+ * Read up to len bytes at offset off of file node n, like pread(2): the
+ * number of bytes read is returned, 0 at the end of the file and -1 with
+ * errno set on errors.  The extents it spans are read in parallel.
+ */
+ssize_t xtaf_pread(struct xtaf_vol *vol, uint32_t n, void *buf, size_t len,
+    uint64_t off) {
+	struct xtaf_node *node;
+	struct xtaf_extent *ext;
+	struct xtaf_aio_req *reqs;
+	uint64_t csize, elen, skip, chunk;
+	uint32_t i, next, nreqs = 0;
+	size_t done = 0;
+	int error;
+
+	if (n >= vol->idx.nnodes) {
+		errno = ENOENT;
+		return(-1);
+	}
+	if (xtaf_is_dir(vol, n)) {
+		errno = EISDIR;
+		return(-1);
+	}
+	node = &vol->idx.nodes[n];
+	if (off >= node->fsize)
+		return(0);
+	if (len > node->fsize - off)
+		len = node->fsize - off;
+	error = xtaf_extents(vol, node->fstart, node->fsize, &ext, &next,
+	    NULL);
+	if (error) {
+		errno = error;
+		return(-1);
+	}
+	reqs = calloc(next + len / AIO_CHUNK + 1, sizeof(struct xtaf_aio_req));
+	if (reqs == NULL) {
+		free(ext);
+		errno = ENOMEM;
+		return(-1);
+	}
+	csize = 512 * vol->geom.spc;
+	for (i = 0, skip = off; i < next && done < len; i++) {
+		elen = ext[i].nclust * csize;
+		if (skip >= elen) {
+			skip -= elen;
+			continue;
+		}
+		for (; skip < elen && done < len; skip += chunk) {
+			chunk = elen - skip < len - done ? elen - skip :
+			    len - done;
+			if (chunk > AIO_CHUNK)
+				chunk = AIO_CHUNK;
+			reqs[nreqs].buf = (uint8_t *)buf + done;
+			reqs[nreqs].len = chunk;
+			reqs[nreqs].off = (uint64_t)ext[i].sector * 512 + skip;
+			reqs[nreqs].purpose = XTAF_IO_DATA;
+			nreqs++;
+			done += chunk;
+		}
+		skip = 0;
+	}
+	free(ext);
+	error = read_reqs(vol, reqs, nreqs);
+	free(reqs);
+	if (error) {
+		errno = error;
+		return(-1);
+	}
+	return(done);
+}
+
+/*
+ * Count the FAT entries by kind and build the in-use bitmap (one bit per
+ * cluster, clusters 1 .. maxcluster), in one pass over the FAT.  inusep
+ * may be NULL.
+ */
+int xtaf_usage(struct xtaf_vol *vol, struct xtaf_usage *u,
+    const uint32_t **inusep) {
+	struct fat_usage fu;
+	uint32_t *inuse;
+	int error;
+
+	error = need_fat(vol);
+	if (error)
+		return(error);
+	pthread_mutex_lock(&vol->loadmtx);
+	stats_add(vol, vol->inuse != NULL ? &vol->stats.mem_hits :
+	    &vol->stats.mem_misses, 1);
+	if (vol->inuse == NULL) {
+		inuse = calloc(vol->geom.maxcluster / 32 + 1,
+		    sizeof(uint32_t));
+		if (inuse == NULL) {
+			pthread_mutex_unlock(&vol->loadmtx);
+			return(ENOMEM);
+		}
+		bzero(&fu, sizeof(struct fat_usage));
+		fat_scan(vol->fat + vol->geom.fatmult, 1, vol->geom.maxcluster,
+		    vol->geom.fatmult, &fu, inuse);
+		stats_add(vol, &vol->stats.fat_lookups, vol->geom.maxcluster);
+		vol->usage.free = fu.fu_free;
+		vol->usage.used = fu.fu_used;
+		vol->usage.reserved = fu.fu_reserved;
+		vol->usage.bad = fu.fu_bad;
+		vol->usage.eof = fu.fu_eof;
+		vol->inuse = inuse;
+	}
+	pthread_mutex_unlock(&vol->loadmtx);
+	*u = vol->usage;
+	if (inusep != NULL)
+		*inusep = vol->inuse;
+	return(0);
+}
+
+/*
+ * Return the FAT as read from the image: big endian, fatmult bytes per
+ * entry, entry 0 first.  It belongs to vol.
+ */
+int xtaf_fat(struct xtaf_vol *vol, const uint8_t **fatp) {
+	int error;
+
+	error = need_fat(vol);
+	if (error)
+		return(error);
+	*fatp = vol->fat;
+	return(0);
+}
+
+/*
+ * Set the memory budget of the block cache shared by all volumes of the
+ * process, 0 disables it.  The blocks in the cache are dropped.
+ */
+int xtaf_cache_size(size_t size) {
+	return(blkcache_setsize(size));
+}
+
+struct xtaf_datetime xtaf_dosdati(uint16_t date, uint16_t time) {
+	struct xtaf_datetime dt;
+
+	dt.year = (date >> 9) + 1980;
+	/* wikipedia says s/1980/2000 for FATX, seems wrong */
+	dt.month = date >> 5 & 0x000f;
+	dt.day = date & 0x001f;
+	dt.hour = time >> 11;
+	dt.minute = time >> 5 & 0x003f;
+	dt.second = (time & 0x001f) << 1;
+	return(dt);
+}
+
+/*
+ * Convert an XTAF date and time to a time_t, they are in local time.
+ */
+time_t xtaf_time(uint16_t date, uint16_t time) {
+	struct xtaf_datetime dt;
+	struct tm tm;
+
+	dt = xtaf_dosdati(date, time);
+	bzero(&tm, sizeof(struct tm));
+	tm.tm_year = dt.year - 1900;
+	tm.tm_mon = dt.month > 0 ? dt.month - 1 : 0;
+	tm.tm_mday = dt.day > 0 ? dt.day : 1;
+	tm.tm_hour = dt.hour;
+	tm.tm_min = dt.minute;
+	tm.tm_sec = dt.second;
+	tm.tm_isdst = -1;
+	return(mktime(&tm));
+}
@@ -0,0 +1,217 @@
+/*
+Copyright (c) 2007,2008 Rene Ladan <r.c.ladan@gmail.com> All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+
+libxtaf: read-only access to XTAF volumes, see libxtaf.txt.
+
+*/
+#ifndef _LIBXTAF_H_
+#define _LIBXTAF_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+#define XTAF_ROOT 0 /* node of the root directory */
+#define XTAF_NO_NODE 0xffffffff
+
+/* what a read of the image is for, see struct xtaf_trace */
+#define XTAF_IO_BOOT 0 /* boot block and the quirk check */
+#define XTAF_IO_FAT 1
+#define XTAF_IO_DIR 2
+#define XTAF_IO_DATA 3
+
+struct xtaf_vol; /* an open volume, safe to share between threads */
+struct xtaf_dir; /* a readdir iterator, one per thread */
+struct xtaf_aio; /* an asynchronous read engine, one per thread */
+
+/* flags of xtaf_aio_open() */
+#define XTAF_AIO_THREADS 1 /* use the thread pool even if io_uring works */
+#define XTAF_AIO_DIRECT 2 /* read with O_DIRECT where the request allows */
+
+/* boot block and layout of the volume, in host byte order */
+struct xtaf_geom {
+	char magic[4]; /* "XTAF" */
+	uint32_t volid;
+	uint32_t spc; /* sectors per cluster */
+	uint32_t nfat; /* always 1 */
+	uint32_t fatmask;
+	uint8_t fatmult; /* bytes per FAT entry */
+	uint8_t pad[3];
+	uint32_t fatstart; /* sector */
+	uint32_t fatsize; /* bytes */
+	uint32_t fatsecs;
+	uint32_t rootstart; /* sector of cluster 1, the root directory */
+	uint32_t firstcluster; /* sector of cluster 2 */
+	uint32_t maxcluster;
+	uint32_t numclusters; /* entries in the FAT */
+	uint64_t mediasize; /* bytes */
+};
+
+/*
+ * One directory entry in use, or the root directory (node 0).  The index
+ * of a volume is an array of these in breadth-first order, so the entries
+ * of a directory are consecutive, and a pool of nul-terminated names.
+ */
+struct xtaf_node { /* 44 bytes */
+	uint32_t parent; /* node of the parent directory, 0 for the root */
+	uint32_t first; /* directories: node of the first entry */
+	uint32_t nchild; /* directories: number of entries */
+	uint32_t fstart; /* first cluster, 0 for empty files */
+	uint32_t fsize; /* 0 for directories */
+	uint32_t name; /* offset in the name pool */
+	uint32_t slot; /* 64 byte slot in the parent directory */
+	uint8_t fnl; /* name length, 0xe5 for deleted entries */
+	uint8_t attr; /* 1 r, 2 h, 4 s, 8 v, 16 d, 32 a */
+	uint8_t pad[2];
+	uint16_t dati[6]; /* cdate ctime adate atime udate utime */
+};
+
+/* a date and time of struct xtaf_node, see xtaf_dosdati() */
+struct xtaf_datetime { /* 12 bytes */
+	uint16_t year;
+	uint16_t month;
+	uint16_t day;
+	uint16_t hour;
+	uint16_t minute;
+	uint16_t second;
+};
+
+struct xtaf_index {
+	struct xtaf_node *nodes;
+	uint32_t nnodes;
+	char *pool;
+	uint32_t poolsize;
+};
+
+/* a node as returned by xtaf_stat() and xtaf_readdir() */
+struct xtaf_stat {
+	uint32_t node;
+	const struct xtaf_node *n;
+	const char *name;
+	int isdir; /* a directory which can be entered */
+	int deleted;
+};
+
+/* a run of physically consecutive clusters */
+struct xtaf_extent {
+	uint32_t sector; /* first sector of the run */
+	uint32_t nclust;
+};
+
+/* cluster counts from the FAT, see xtaf_usage() */
+struct xtaf_usage {
+	uint32_t free;
+	uint32_t used; /* pointing to the next cluster */
+	uint32_t reserved;
+	uint32_t bad;
+	uint32_t eof; /* one per chain */
+};
+
+/* counters of a volume, see xtaf_get_stats() */
+struct xtaf_stats {
+	uint64_t reads;
+	uint64_t seeks; /* reads which do not start where the last one ended */
+	uint64_t bytes; /* read from the image */
+	uint64_t fat_lookups;
+	uint64_t dir_clusters; /* directory clusters read */
+	uint64_t cache_hits; /* blocks found in the block cache */
+	uint64_t cache_misses;
+	uint64_t mem_hits; /* FAT or usage bitmap in memory already */
+	uint64_t mem_misses; /* or loaded */
+	uint32_t dirs; /* directories in the index */
+	uint32_t baddirs; /* directories which could not be read */
+	double fat_seconds; /* wall time spent loading the FAT */
+	double index_seconds; /* and building the index */
+};
+
+/*
+ * Called for every read of the image, under the lock of the volume so
+ * the calls are serialized.
+ */
+struct xtaf_trace {
+	void (*fn)(void *arg, uint64_t off, uint64_t len, int purpose);
+	void *arg;
+};
+
+/* a read queued with xtaf_aio_submit() */
+struct xtaf_aio_req {
+	void *buf;
+	size_t len;
+	size_t room; /* bytes buf can hold if more than len, see aio.c */
+	uint64_t off; /* in the image */
+	int purpose; /* XTAF_IO_*, for the stats and the trace */
+	void *arg; /* for the caller */
+	ssize_t res; /* on completion: bytes read, or -errno */
+};
+
+/*
+ * All functions returning int return 0 or an errno value: ENOENT, ENOTDIR,
+ * EISDIR, EINVAL (not an XTAF volume or a bad argument), EIO (short read or
+ * a broken chain), ELOOP (a looping chain) or ENOMEM.  Nothing is printed.
+ */
+int xtaf_open(const char *, const struct xtaf_trace *, struct xtaf_vol **);
+int xtaf_open_index(const char *, const struct xtaf_geom *,
+    const struct xtaf_index *, const struct xtaf_trace *,
+    struct xtaf_vol **);
+void xtaf_close(struct xtaf_vol *);
+int xtaf_probe(const char *, struct xtaf_geom *);
+
+const struct xtaf_geom *xtaf_geometry(struct xtaf_vol *);
+void xtaf_get_index(struct xtaf_vol *, struct xtaf_index *);
+void xtaf_get_stats(struct xtaf_vol *, struct xtaf_stats *);
+int xtaf_fd(struct xtaf_vol *);
+void xtaf_count_read(struct xtaf_vol *, uint64_t, uint64_t, int);
+int xtaf_reopen(struct xtaf_vol *, int);
+
+int xtaf_lookup(struct xtaf_vol *, uint32_t, const char *, uint32_t *);
+uint32_t xtaf_get_entry(struct xtaf_vol *, uint32_t, const char *);
+int xtaf_is_dir(struct xtaf_vol *, uint32_t);
+int xtaf_stat(struct xtaf_vol *, uint32_t, struct xtaf_stat *);
+
+int xtaf_opendir(struct xtaf_vol *, uint32_t, struct xtaf_dir **);
+int xtaf_readdir(struct xtaf_dir *, struct xtaf_stat *);
+void xtaf_closedir(struct xtaf_dir *);
+
+int xtaf_extents(struct xtaf_vol *, uint32_t, uint32_t, struct xtaf_extent **,
+    uint32_t *, uint32_t *);
+ssize_t xtaf_pread(struct xtaf_vol *, uint32_t, void *, size_t, uint64_t);
+int xtaf_usage(struct xtaf_vol *, struct xtaf_usage *, const uint32_t **);
+int xtaf_fat(struct xtaf_vol *, const uint8_t **);
+
+int xtaf_cache_size(size_t);
+
+int xtaf_aio_open(struct xtaf_vol *, unsigned, int, struct xtaf_aio **);
+void xtaf_aio_close(struct xtaf_aio *);
+void *xtaf_aio_alloc(struct xtaf_aio *, size_t);
+int xtaf_aio_submit(struct xtaf_aio *, struct xtaf_aio_req *);
+int xtaf_aio_wait(struct xtaf_aio *, struct xtaf_aio_req **);
+unsigned xtaf_aio_depth(struct xtaf_aio *);
+unsigned xtaf_aio_default(void);
+const char *xtaf_aio_engine(struct xtaf_aio *);
+
+struct xtaf_datetime xtaf_dosdati(uint16_t, uint16_t);
+time_t xtaf_time(uint16_t, uint16_t);
+
+#endif /* !_LIBXTAF_H_ */
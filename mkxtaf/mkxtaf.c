@@ -0,0 +1,542 @@
+/*
+Copyright (c) 2007,2008 Rene Ladan <r.c.ladan@gmail.com> All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+
+See mkxtaf.txt for usage information.
+
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+
+#define FAT32_MASK 0x0fffffff
+#define FAT16_MASK 0x0000ffff
+#define MAXJUMP 64 /* clusters skipped at most by a fragmenting jump */
+
+/* the generator settings, see usage() */
+struct opts_s {
+	uint64_t mediasize;
+	uint32_t spc;
+	uint32_t frag; /* percentage of clusters not following the previous */
+	uint32_t depth;
+	uint32_t fanout; /* subdirectories per directory */
+	uint32_t files; /* files per directory */
+	uint64_t minsize;
+	uint64_t maxsize;
+	uint32_t deleted; /* percentage of entries marked deleted */
+	uint32_t seed;
+	int quirk;
+	int nodata;
+	FILE *list;
+};
+
+/* the image being built, same names as struct info_s in uxtaf.c */
+struct image_s {
+	int fd;
+	uint32_t spc;
+	uint32_t fatmask;
+	uint8_t fatmult;
+	uint32_t fatstart;
+	uint32_t fatsize;
+	uint32_t rootstart;
+	uint32_t maxcluster;
+	uint32_t numclusters;
+	uint8_t *fat;
+	uint8_t *used; /* one byte per cluster, also covers deleted files */
+	uint32_t next; /* allocation cursor */
+	uint32_t nfiles;
+	uint32_t ndirs;
+	uint64_t nbytes;
+};
+
+uint32_t rnd_state;
+
+/*
+ * xorshift32, good enough and the same everywhere for a given seed.
+ */
+uint32_t rnd(void) {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return(rnd_state);
+}
+
+void put16(uint8_t *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+void put32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+void set_fat(struct image_s *img, uint32_t cluster, uint32_t value) {
+	value &= img->fatmask;
+	if (img->fatmult == 2)
+		put16(img->fat + cluster * 2, value);
+	else
+		put32(img->fat + cluster * 4, value);
+}
+
+uint64_t cluster_offset(struct image_s *img, uint32_t cluster) {
+	return(((uint64_t)(cluster - 1) * img->spc + img->rootstart) * 512);
+}
+
+/*
+ * Same layout as attach() in uxtaf.c and mountxtaf(): FAT at sector 8,
+ * one entry per cluster of the whole medium rounded up to 4 kB, then the
+ * root directory, optionally after a 4 kB hole of zeroes.
+ */
+int layout(struct image_s *img, struct opts_s *o) {
+	uint32_t firstcluster;
+
+	img->spc = o->spc;
+	img->numclusters = o->mediasize / (512 * o->spc);
+	if (img->numclusters >= 0xfff4) {
+		img->fatmask = FAT32_MASK;
+		img->fatmult = 4;
+	} else {
+		img->fatmask = FAT16_MASK;
+		img->fatmult = 2;
+	}
+	img->fatsize = img->numclusters * img->fatmult;
+	if (img->fatsize % 4096 != 0)
+		img->fatsize = ((img->fatsize / 4096) + 1) * 4096;
+	img->fatstart = 8;
+	img->rootstart = img->fatsize / 512 + img->fatstart;
+	if (o->quirk)
+		img->rootstart += 8;
+
+	firstcluster = img->rootstart + img->spc;
+	if (o->mediasize / 512 <= firstcluster + img->spc) {
+		fprintf(stderr, "mkxtaf: medium too small\n");
+		return(1);
+	}
+	img->maxcluster = (o->mediasize / 512 - firstcluster) / img->spc + 1;
+	if (img->maxcluster >= img->numclusters)
+		img->maxcluster = img->numclusters - 1;
+
+	img->fat = calloc(img->fatsize, sizeof(uint8_t));
+	img->used = calloc(img->maxcluster + 1, sizeof(uint8_t));
+	if (img->fat == NULL || img->used == NULL) {
+		fprintf(stderr, "mkxtaf: out of memory\n");
+		return(1);
+	}
+	/* media descriptor and the root directory, which is one cluster */
+	set_fat(img, 0, 0xfffffff8);
+	set_fat(img, 1, 0xffffffff);
+	img->used[1] = 1;
+	img->next = 2;
+	return(0);
+}
+
+/*
+ * Allocate one cluster after prev (0 for the first of a chain).  With
+ * probability frag the cursor jumps ahead first; it wraps around at the
+ * end of the medium.
+ */
+uint32_t alloc_cluster(struct image_s *img, struct opts_s *o, uint32_t prev) {
+	uint32_t tries;
+
+	if (prev != 0 && rnd() % 100 < o->frag)
+		img->next += 1 + rnd() % MAXJUMP;
+	for (tries = 0; tries <= img->maxcluster; tries++, img->next++) {
+		if (img->next > img->maxcluster)
+			img->next = 2;
+		if (!img->used[img->next]) {
+			img->used[img->next] = 1;
+			return(img->next++);
+		}
+	}
+	return(0);
+}
+
+/*
+ * Allocate a chain for size bytes (at least one cluster), link it in the
+ * FAT unless the file is deleted, and return the clusters in chain.
+ */
+uint32_t *alloc_chain(struct image_s *img, struct opts_s *o, uint64_t size,
+    int deleted, uint32_t *nc) {
+	uint32_t *chain, i;
+
+	*nc = (size + 512 * img->spc - 1) / (512 * img->spc);
+	if (*nc == 0)
+		*nc = 1;
+	chain = malloc(*nc * sizeof(uint32_t));
+	if (chain == NULL)
+		return(NULL);
+	for (i = 0; i < *nc; i++) {
+		chain[i] = alloc_cluster(img, o, i > 0 ? chain[i - 1] : 0);
+		if (chain[i] == 0) {
+			fprintf(stderr, "mkxtaf: medium full\n");
+			free(chain);
+			return(NULL);
+		}
+		if (i > 0 && !deleted)
+			set_fat(img, chain[i - 1], chain[i]);
+	}
+	if (!deleted)
+		set_fat(img, chain[*nc - 1], 0xffffffff);
+	return(chain);
+}
+
+/*
+ * Write size bytes of data to the chain.  The contents only depend on the
+ * seed, the start cluster and the offset, so a reader can verify them.
+ */
+int write_data(struct image_s *img, uint32_t *chain, uint32_t nc,
+    uint64_t size) {
+	uint32_t csize, i, j, state;
+	uint8_t *buf;
+	size_t len;
+
+	csize = 512 * img->spc;
+	buf = malloc(csize);
+	if (buf == NULL)
+		return(1);
+	state = chain[0] * 2654435761U + 1;
+	for (i = 0; i < nc && size > 0; i++, size -= len) {
+		for (j = 0; j < csize; j += 4) {
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			memcpy(buf + j, &state, 4);
+		}
+		len = size < csize ? size : csize;
+		if (pwrite(img->fd, buf, len, cluster_offset(img, chain[i])) !=
+		    (ssize_t)len) {
+			fprintf(stderr, "mkxtaf: write error %i\n", errno);
+			free(buf);
+			return(1);
+		}
+	}
+	free(buf);
+	return(0);
+}
+
+/*
+ * Random date/time between 2005 and 2012 in FAT format.
+ */
+void random_dati(uint8_t *p) {
+	uint16_t date, time;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		date = (25 + rnd() % 8) << 9 | (1 + rnd() % 12) << 5 |
+		    (1 + rnd() % 28);
+		time = (rnd() % 24) << 11 | (rnd() % 60) << 5 | rnd() % 30;
+		put16(p + 4 * i, date);
+		put16(p + 4 * i + 2, time);
+	}
+}
+
+/*
+ * Fill in the 64 byte directory entry at p.
+ */
+void make_entry(uint8_t *p, char *name, uint8_t attr, uint32_t start,
+    uint32_t size, int deleted) {
+	memset(p, 0xff, 64);
+	p[0] = deleted ? 0xe5 : strlen(name);
+	p[1] = attr;
+	memcpy(p + 2, name, strlen(name));
+	put32(p + 44, start);
+	put32(p + 48, size);
+	random_dati(p + 52);
+}
+
+/*
+ * Log-uniform file size between minsize and maxsize.
+ */
+uint64_t random_size(struct opts_s *o) {
+	double lo, hi, x;
+
+	if (o->maxsize <= o->minsize)
+		return(o->minsize);
+	lo = o->minsize + 1;
+	hi = o->maxsize + 1;
+	x = (double)rnd() / 4294967296.0;
+	return((uint64_t)(lo * pow(hi / lo, x)) - 1);
+}
+
+/*
+ * Create a directory at the given depth and return its start cluster, or
+ * fill the root directory (cluster 1) if root is set.  path is used for
+ * the list file only.
+ */
+uint32_t make_dir(struct image_s *img, struct opts_s *o, uint32_t depth,
+    char *path, int root) {
+	uint32_t nent, ndir, nfile, maxent, i, nc, *chain, start, sub, entry;
+	uint8_t *dir;
+	uint64_t size;
+	int deleted;
+	char name[43], subpath[1024];
+
+	ndir = depth < o->depth ? o->fanout : 0;
+	nfile = o->files;
+	maxent = 8 * img->spc; /* the root directory is a single cluster */
+	if (root && ndir > maxent)
+		ndir = maxent;
+	if (root && nfile > maxent - ndir)
+		nfile = maxent - ndir;
+	nent = ndir + nfile;
+	nc = (nent * 64 + 512 * img->spc - 1) / (512 * img->spc);
+	if (nc == 0)
+		nc = 1;
+	dir = malloc(nc * 512 * img->spc);
+	if (dir == NULL)
+		return(0);
+	memset(dir, 0xff, nc * 512 * img->spc); /* unused slots */
+
+	for (entry = 0; entry < nent; entry++) {
+		deleted = rnd() % 100 < o->deleted;
+		if (entry < ndir) {
+			snprintf(name, sizeof(name), "dir%04u", entry);
+			snprintf(subpath, sizeof(subpath), "%s/%s", path, name);
+			if (deleted) {
+				make_entry(dir + entry * 64, name, 16, 0, 0, 1);
+				continue;
+			}
+			sub = make_dir(img, o, depth + 1, subpath, 0);
+			if (sub == 0) {
+				free(dir);
+				return(0);
+			}
+			make_entry(dir + entry * 64, name, 16, sub, 0, 0);
+			img->ndirs++;
+			continue;
+		}
+		snprintf(name, sizeof(name), "file%04u.bin", entry);
+		snprintf(subpath, sizeof(subpath), "%s/%s", path, name);
+		size = random_size(o);
+		start = 0;
+		if (size > 0) {
+			chain = alloc_chain(img, o, size, deleted, &nc);
+			if (chain == NULL) {
+				free(dir);
+				return(0);
+			}
+			start = chain[0];
+			if (!o->nodata && write_data(img, chain, nc, size)) {
+				free(chain);
+				free(dir);
+				return(0);
+			}
+			free(chain);
+		}
+		make_entry(dir + entry * 64, name, 0, start, size, deleted);
+		if (o->list != NULL)
+			fprintf(o->list, "%s %s %llu %u\n",
+			    deleted ? "deleted" : "file", subpath,
+			    (unsigned long long)size, start);
+		if (!deleted) {
+			img->nfiles++;
+			img->nbytes += size;
+		}
+	}
+
+	nc = (nent * 64 + 512 * img->spc - 1) / (512 * img->spc);
+	if (nc == 0)
+		nc = 1;
+	if (root) {
+		start = 1;
+		chain = &start;
+	} else {
+		chain = alloc_chain(img, o, (uint64_t)nc * 512 * img->spc, 0,
+		    &nc);
+		if (chain == NULL) {
+			free(dir);
+			return(0);
+		}
+	}
+	for (i = 0; i < nc; i++)
+		if (pwrite(img->fd, dir + i * 512 * img->spc, 512 * img->spc,
+		    cluster_offset(img, chain[i])) != 512 * img->spc) {
+			fprintf(stderr, "mkxtaf: write error %i\n", errno);
+			start = 0;
+			break;
+		}
+	if (!root) {
+		start = i == nc ? chain[0] : 0;
+		free(chain);
+	}
+	free(dir);
+	return(start);
+}
+
+/*
+ * Boot sector, see read_boot() in uxtaf.c.
+ */
+int write_boot(struct image_s *img, struct opts_s *o) {
+	uint8_t boot[512];
+
+	memset(boot, 0, sizeof(boot));
+	memcpy(boot, "XTAF", 4);
+	put32(boot + 4, o->seed); /* volume id */
+	put32(boot + 8, o->spc);
+	put32(boot + 12, 1); /* number of FATs */
+	if (pwrite(img->fd, boot, sizeof(boot), 0) != sizeof(boot) ||
+	    pwrite(img->fd, img->fat, img->fatsize,
+	    (uint64_t)img->fatstart * 512) != img->fatsize) {
+		fprintf(stderr, "mkxtaf: write error %i\n", errno);
+		return(1);
+	}
+	return(0);
+}
+
+/*
+ * Parse a size with an optional k, m, g or t suffix.
+ */
+uint64_t parse_size(char *arg) {
+	char *end;
+	uint64_t size;
+
+	size = strtoull(arg, &end, 0);
+	switch (*end) {
+	case 't': case 'T':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'g': case 'G':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'm': case 'M':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'k': case 'K':
+		size *= 1024;
+	}
+	return(size);
+}
+
+int usage(void) {
+	printf("See mkxtaf.txt for usage information.\n");
+	return(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct opts_s o;
+	struct image_s img;
+	int ch, ret;
+
+	bzero(&o, sizeof(struct opts_s));
+	bzero(&img, sizeof(struct image_s));
+	o.mediasize = 64 * 1024 * 1024;
+	o.spc = 32;
+	o.depth = 2;
+	o.fanout = 4;
+	o.files = 8;
+	o.maxsize = 1024 * 1024;
+	o.seed = 1;
+	while ((ch = getopt(argc, argv, "c:d:f:F:l:m:M:n:qr:s:x:z")) != -1)
+		switch (ch) {
+		case 'c':
+			o.spc = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			o.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			o.frag = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			o.files = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			o.list = fopen(optarg, "w");
+			if (o.list == NULL) {
+				fprintf(stderr, "mkxtaf: cannot open %s\n",
+				    optarg);
+				return(1);
+			}
+			break;
+		case 'm':
+			o.minsize = parse_size(optarg);
+			break;
+		case 'M':
+			o.maxsize = parse_size(optarg);
+			break;
+		case 'n':
+			o.fanout = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			o.quirk = 1;
+			break;
+		case 'r':
+			o.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			o.mediasize = parse_size(optarg);
+			break;
+		case 'x':
+			o.deleted = strtoul(optarg, NULL, 0);
+			break;
+		case 'z':
+			o.nodata = 1;
+			break;
+		default:
+			return(usage());
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || o.spc == 0 || o.spc & (o.spc - 1) ||
+	    o.frag > 100 || o.deleted > 100 || o.maxsize > 0xffffffffULL ||
+	    o.minsize > 0xffffffffULL || o.minsize > o.maxsize)
+		return(usage());
+	rnd_state = o.seed != 0 ? o.seed : 1;
+
+	if (layout(&img, &o))
+		return(1);
+	img.fd = open(argv[0], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (img.fd == -1) {
+		fprintf(stderr, "mkxtaf: cannot create %s: %i\n", argv[0],
+		    errno);
+		return(1);
+	}
+	/* everything not written below stays a hole */
+	if (ftruncate(img.fd, o.mediasize) == -1) {
+		fprintf(stderr, "mkxtaf: ftruncate: %i\n", errno);
+		return(1);
+	}
+	ret = make_dir(&img, &o, 0, "", 1) != 1 || write_boot(&img, &o);
+	close(img.fd);
+	if (o.list != NULL)
+		fclose(o.list);
+	if (ret == 0)
+		printf("%s: FAT%u, %u clusters of %u bytes, %u directories, "
+		    "%u files, %llu bytes\n", argv[0], img.fatmult * 8,
+		    img.maxcluster, 512 * img.spc, img.ndirs, img.nfiles,
+		    (unsigned long long)img.nbytes);
+	free(img.fat);
+	free(img.used);
+	return(ret);
+}
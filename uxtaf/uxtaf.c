@@ -25,590 +25,2117 @@ SUCH DAMAGE.
 See uxtaf.txt for usage information.
 
 */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* copy_file_range(2), splice(2) */
+#endif
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
-/* Undefine this if you have a big endian box */
-/* XXX yeah I know this is ugly... */
-#define LITTLE_ENDIAN_BOX
-
-uint16_t bswap16(uint16_t x) {
-	return(
-#ifdef LITTLE_ENDIAN_BOX
-		((x & 0x00ff) << 8) +
-		((x & 0xff00) >> 8)
-#else
-		x
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define HAVE_ZERO_COPY
 #endif
-	);
-}
-
-uint32_t bswap32(uint32_t x) {
-	return(
-#ifdef LITTLE_ENDIAN_BOX
-		bswap16((x & 0xffff0000) >> 16) +
-		(bswap16(x & 0x0000ffff) << 16)
 
-#else
-		x
-#endif
-	);
-}
+#include "../libxtaf/libxtaf.h"
+#include "../xtaf/sys/fs/xtaf/dot_lookup_table.h"
 
 /* Slightly ugly :-) */
 #define INFONAME "./uxtaf.info"
 
-#define FAT32_MASK 0x0fffffff
-#define FAT16_MASK 0x0000ffff
-#define DOT_NOT_FOUND 0xfffffff0
+#define INDEX_MAGIC "UXTI"
+#define INDEX_VERSION 2
+#define CAT_BUFSIZE (1024 * 1024) /* default, multiple of any cluster size */
+#define CAT_BUFSIZE_MAX (64 * 1024 * 1024)
+
+/* how copy_node() can move data without a userland copy */
+#define ZC_NONE 0
+#define ZC_RANGE 1 /* copy_file_range(2), to regular files */
+#define ZC_SPLICE 2 /* splice(2), to pipes */
+#define ZC_SENDFILE 3 /* sendfile(2), to sockets */
+#define SHELL_MAXARGS 8
+#define SWEEP_GAP (64 * 1024) /* read through gaps up to this, see sweep() */
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK) /* what tar(1) writes by default */
+#define FRAG_WORST 10 /* files listed by frag */
 
-struct boot_s { /* 20 bytes */
-	char magic[4]; /* should be "XTAF" */
-	uint32_t volid; /* volume id */
-	uint32_t spc; /* sectors/cluster */
-	uint32_t nfat; /* should be 1 */
-	uint16_t zero; /* should be 0 */
+struct info_s {
+	struct xtaf_geom geom;
+	uint32_t pwd; /* sector of curdir */
+	char imagename[256]; /* max file name length */
 };
 
-struct direntry_s { /* 64 bytes */
-	uint8_t fnl; /* 0x00 / 0xff -> unused, 0xe5 -> deleted */
-	uint8_t attr;
-	char name[42];
-	uint32_t fstart; /* cluster, 0 (i.e. "root") for nul-files */
-	uint32_t fsize; /* 0 for directories */
-	uint16_t cdate;
-	uint16_t ctime;
-	uint16_t adate;
-	uint16_t atime;
-	uint16_t udate;
-	uint16_t utime;
+/*
+ * Layout of INFONAME: this header, then nnodes struct xtaf_node, then the
+ * string pool.  It is used in place with mmap(2), so it only works on the
+ * machine which wrote it.
+ */
+struct index_hdr_s {
+	char magic[4]; /* INDEX_MAGIC */
+	uint32_t version; /* INDEX_VERSION */
+	uint32_t hdrsize; /* sizeof(struct index_hdr_s) */
+	uint32_t nodesize; /* sizeof(struct xtaf_node) */
+	uint32_t nnodes;
+	uint32_t poolsize;
+	uint32_t pwdnode;
+	uint32_t pad;
+	struct info_s info;
 };
 
-struct datetime_s { /* 12 bytes */
-	uint16_t year;
-	uint16_t month;
-	uint16_t day;
-	uint16_t hour;
-	uint16_t minute;
-	uint16_t second;
+/* everything kept alive while an image is in use */
+struct session_s {
+	struct info_s info;
+	struct xtaf_vol *vol; /* the image, see libxtaf.h */
+	struct xtaf_index index; /* the directory tree of vol */
+	void *map; /* non-NULL if index points into INFONAME */
+	size_t maplen;
+	uint32_t pwdnode; /* node of curdir */
+	struct hash_table dots; /* see need_dots(), empty until first needed */
+	uint32_t bufsize; /* bytes per read in cat and extract */
+	int aioflags; /* XTAF_AIO_DIRECT with --direct */
 };
 
-struct dot_table_s {
-	uint32_t this;
-	uint32_t parent;
-	struct dot_table_s *next;
-};
+/* phases of a run timed by the stats, see show_stats() */
+#define PH_INFOFILE 0 /* reading and writing INFONAME */
+#define PH_FAT 1 /* loading the FAT */
+#define PH_INDEX 2 /* building the index */
+#define PH_COMMAND 3 /* run_command(), includes PH_FAT and PH_INDEX */
+#define PH_TOTAL 4
+#define NPHASES 5
 
-/* 120*1024^3/512 < 2^32, so only define mediasize as uint64_t */
-struct info_s {
-	struct boot_s bootinfo;
-	uint32_t pwd; /* sector of curdir */
-	uint32_t fatmask;
-	uint8_t fatmult;
-	uint32_t fatstart;
-	uint32_t fatsize;
-	uint32_t rootstart;
-	uint32_t firstcluster;
-	uint32_t maxcluster;
-	uint32_t numclusters;
-	uint64_t mediasize;
-	uint32_t fatsecs;
-	char imagename[256]; /* max file name length */
+/*
+ * Counters of the image I/O and of the caches, shown by --stats and dumped
+ * as JSON to the file named by UXTAF_STATS.  libxtaf counts the I/O of a
+ * volume, it is added in here when the volume is closed, see detach().
+ */
+struct stats_s {
+	uint64_t reads;
+	uint64_t seeks; /* reads which do not start where the last one ended */
+	uint64_t bytes; /* read from the image */
+	uint64_t fat_lookups;
+	uint64_t dir_clusters; /* directory clusters read */
+	uint64_t cache_hits; /* blocks in the block cache of libxtaf */
+	uint64_t cache_misses;
+	uint64_t mem_hits; /* FAT, index, usage or dot table in memory */
+	uint64_t mem_misses;
+	double phase[NPHASES]; /* wall time in seconds */
 };
 
-struct fat_s { /* 32 bits indeed... */
-	uint32_t nextval;
-	struct fat_s *next;
+struct stats_s stats;
+char *phase_names[NPHASES] = { "infofile", "fat", "index", "command",
+    "total" };
+
+/* what an image read is for, as logged in the trace, see libxtaf.h */
+char *io_names[] = { "boot", "fat", "dir", "data" };
+
+/*
+ * Trace of all image reads, see open_trace().
+ */
+FILE *tracefile;
+struct xtaf_trace tracer;
+
+double stats_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Log a read of len bytes at image offset off, called by libxtaf.
+ */
+void trace_read(void *arg, uint64_t off, uint64_t len, int purpose) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	fprintf(tracefile, "%llu %llu %llu %s\n",
+	    (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec,
+	    (unsigned long long)off, (unsigned long long)len,
+	    io_names[purpose]);
+}
+
+/*
+ * Append the image reads to the file named by UXTAF_TRACE, one line per
+ * read: wall clock time in microseconds, offset, length and purpose.
+ * Appending lets a series of uxtaf runs make up one trace, see xtafreplay.
+ */
+void open_trace(void) {
+	char *env;
+
+	env = getenv("UXTAF_TRACE");
+	if (env == NULL)
+		return;
+	tracefile = fopen(env, "a");
+	if (tracefile == NULL)
+		fprintf(stderr, "Could not open %s for writing.\n", env);
+	else
+		tracer.fn = trace_read;
+}
+
+void stats_mem(int hit) {
+	if (hit)
+		stats.mem_hits++;
+	else
+		stats.mem_misses++;
+}
+
+/*
+ * Add the time since start to phase.
+ */
+void stats_phase(int phase, double start) {
+	stats.phase[phase] += stats_now() - start;
+}
+
+/*
+ * Add the counters of the attached volume to stats.
+ */
+void collect_stats(struct session_s *sess) {
+	struct xtaf_stats st;
+
+	xtaf_get_stats(sess->vol, &st);
+	stats.reads += st.reads;
+	stats.seeks += st.seeks;
+	stats.bytes += st.bytes;
+	stats.fat_lookups += st.fat_lookups;
+	stats.dir_clusters += st.dir_clusters;
+	stats.cache_hits += st.cache_hits;
+	stats.cache_misses += st.cache_misses;
+	stats.mem_hits += st.mem_hits;
+	stats.mem_misses += st.mem_misses;
+	stats.phase[PH_FAT] += st.fat_seconds;
+	stats.phase[PH_INDEX] += st.index_seconds;
+}
+
+/*
+ * Show the counters on stderr if show is set, and write them as JSON to
+ * the file named by UXTAF_STATS ("-" is stderr).
+ */
+void show_stats(int show) {
+	FILE *f;
+	char *env;
+	int i;
+
+	if (show) {
+		fprintf(stderr, "reads        = %llu\n",
+		    (unsigned long long)stats.reads);
+		fprintf(stderr, "seeks        = %llu\n",
+		    (unsigned long long)stats.seeks);
+		fprintf(stderr, "bytes read   = %llu\n",
+		    (unsigned long long)stats.bytes);
+		fprintf(stderr, "FAT lookups  = %llu\n",
+		    (unsigned long long)stats.fat_lookups);
+		fprintf(stderr, "dir clusters = %llu\n",
+		    (unsigned long long)stats.dir_clusters);
+		fprintf(stderr, "cache hits   = %llu\n",
+		    (unsigned long long)stats.cache_hits);
+		fprintf(stderr, "cache misses = %llu\n",
+		    (unsigned long long)stats.cache_misses);
+		fprintf(stderr, "mem hits     = %llu\n",
+		    (unsigned long long)stats.mem_hits);
+		fprintf(stderr, "mem misses   = %llu\n",
+		    (unsigned long long)stats.mem_misses);
+		for (i = 0; i < NPHASES; i++)
+			fprintf(stderr, "%-12s = %.6f s\n", phase_names[i],
+			    stats.phase[i]);
+	}
+	env = getenv("UXTAF_STATS");
+	if (env == NULL)
+		return;
+	f = strcmp(env, "-") ? fopen(env, "w") : stderr;
+	if (f == NULL) {
+		fprintf(stderr, "Could not open %s for writing.\n", env);
+		return;
+	}
+	fprintf(f, "{\"reads\": %llu, \"seeks\": %llu, \"bytes_read\": %llu, "
+	    "\"fat_lookups\": %llu, \"dir_clusters\": %llu, "
+	    "\"cache_hits\": %llu, \"cache_misses\": %llu, "
+	    "\"mem_hits\": %llu, \"mem_misses\": %llu, \"seconds\": {",
+	    (unsigned long long)stats.reads, (unsigned long long)stats.seeks,
+	    (unsigned long long)stats.bytes,
+	    (unsigned long long)stats.fat_lookups,
+	    (unsigned long long)stats.dir_clusters,
+	    (unsigned long long)stats.cache_hits,
+	    (unsigned long long)stats.cache_misses,
+	    (unsigned long long)stats.mem_hits,
+	    (unsigned long long)stats.mem_misses);
+	for (i = 0; i < NPHASES; i++)
+		fprintf(f, "%s\"%s\": %.6f", i > 0 ? ", " : "", phase_names[i],
+		    stats.phase[i]);
+	fprintf(f, "}}\n");
+	if (f != stderr)
+		fclose(f);
+}
+
+/*
+ * Drop everything belonging to the attached image.
+ */
+void detach(struct session_s *sess) {
+	if (sess->vol != NULL) {
+		collect_stats(sess);
+		xtaf_close(sess->vol);
+	}
+	sess->vol = NULL;
+	if (sess->map != NULL)
+		munmap(sess->map, sess->maplen);
+	sess->map = NULL;
+	bzero(&sess->index, sizeof(struct xtaf_index));
+	dot_table_destroy(&sess->dots);
+}
+
+int attach(struct session_s *sess, char *imagename) {
+	struct info_s *info = &sess->info;
+	struct xtaf_stats st;
+	int i, error;
+
+	detach(sess);
+	for (i = 0; i < 255 && i < strlen(imagename); i++)
+		info->imagename[i] = imagename[i];
+	info->imagename[i] = '\0';
+
+	fprintf(stderr, "Opening %s\n", info->imagename);
+	error = xtaf_open(info->imagename, tracefile != NULL ? &tracer : NULL,
+	    &sess->vol);
+	if (error) {
+		fprintf(stderr, "attach: %s: %s\n", info->imagename,
+		    strerror(error));
+		sess->vol = NULL;
+		return(error);
+	}
+	info->geom = *xtaf_geometry(sess->vol);
+	xtaf_get_index(sess->vol, &sess->index);
+	fprintf(stderr, "rootstart: div=%u mod=%u%s\n",
+	    info->geom.rootstart / info->geom.spc,
+	    info->geom.rootstart % info->geom.spc,
+	    info->geom.rootstart == info->geom.fatstart + info->geom.fatsecs ?
+	    "" : " (hd quirk)");
+	xtaf_get_stats(sess->vol, &st);
+	if (st.baddirs > 0)
+		fprintf(stderr, "build_index: cannot read %u directories\n",
+		    st.baddirs);
+	fprintf(stderr, "build_index: %u entries in %u directories\n",
+	    sess->index.nnodes - 1, st.dirs);
+
+	info->pwd = info->geom.rootstart; /* sensible start */
+	sess->pwdnode = XTAF_ROOT;
+	fprintf(stderr, "attach: done\n");
+	return(0);
+}
+
+/*
+ * Look up pathname, relative to curdir unless it starts with a /.
+ */
+uint32_t resolve_path(struct session_s *sess, char *pathname) {
+	uint32_t n;
+
+	if (pathname == NULL || strlen(pathname) == 0) {
+		fprintf(stderr, "resolve_path: empty path\n");
+		return(XTAF_NO_NODE);
+	}
+	if (xtaf_lookup(sess->vol, sess->pwdnode, pathname, &n))
+		return(XTAF_NO_NODE);
+	return(n);
+}
+
+int ls(struct session_s *sess) {
+	struct xtaf_index *idx = &sess->index;
+	struct xtaf_node *de;
+	char *fname;
+	struct xtaf_datetime da, dc, du;
+	int i;
+	uint32_t n;
+	int freq[256];
+
+	for (i = 0; i < 256; i++)
+		freq[i] = 0;
+
+	printf("entry fnl rhsvda startclust   filesize    "
+	    "create_date_time    access_date_time    update_date_time "
+	    "filename\n");
+	for (n = idx->nodes[sess->pwdnode].first;
+	    n < idx->nodes[sess->pwdnode].first +
+	    idx->nodes[sess->pwdnode].nchild; n++) {
+		de = &idx->nodes[n];
+		fname = idx->pool + de->name;
+		dc = xtaf_dosdati(de->dati[0], de->dati[1]);
+		da = xtaf_dosdati(de->dati[2], de->dati[3]);
+		du = xtaf_dosdati(de->dati[4], de->dati[5]);
+		printf("%5u %3u %c%c%c%c%c%c %10u %10u %04u-%02u-%02u "
+		    "%02u:%02u:%02u %04u-%02u-%02u %02u:%02u:%02u "
+		    "%04u-%02u-%02u %02u:%02u:%02u %s\n",
+		    de->slot, de->fnl,
+		    (de->attr & 1 ? 'r' : '-'),
+		    (de->attr & 2 ? 'h' : '-'),
+		    (de->attr & 4 ? 's' : '-'),
+		    (de->attr & 8 ? 'v' : '-'),
+		    (de->attr & 16 ? 'd' : '-'),
+		    (de->attr & 32 ? 'a' : '-'),
+		    de->fstart, de->fsize, dc.year, dc.month, dc.day,
+		    dc.hour, dc.minute, dc.second, da.year, da.month,
+		    da.day, da.hour, da.minute, da.second, du.year,
+		    du.month, du.day, du.hour, du.minute, du.second,
+		    fname);
+
+		for (i = 0; i < strlen(fname); i++)
+			freq[(uint8_t)fname[i]] = 1;
+	}
+
+	printf("file name characters: ");
+	for (i = 0; i < 256; i++)
+		if (freq[i] == 1)
+			printf("%4i", i);
+	printf("\n");
+	return(0);
+}
+
+void show_info(struct info_s *info) {
+	struct xtaf_geom *g = &info->geom;
+	int i;
+
+	printf("magic        = ");
+	for (i = 0; i < 4; i++)
+		printf("%c", g->magic[i]);
+	printf("\n");
+	printf("volid        = 0x%08x\n", g->volid);
+	printf("spc          = %u\n", g->spc);
+	printf("nfat         = %u\n", g->nfat);
+	printf("pwd          = %u sectors  @ 0x%llx bytes\n", info->pwd,
+	    (uint64_t)info->pwd * 512);
+	printf("fatmask      = 0x%08x\n", g->fatmask);
+	printf("%u bits\n", g->fatmult * 8);
+	printf("fatstart     = %u sectors  @ 0x%llx bytes\n", g->fatstart,
+	    (uint64_t)g->fatstart * 512);
+	printf("fatsize      = %u bytes\n", g->fatsize);
+	printf("rootstart    = %u sectors  @ 0x%llx bytes\n", g->rootstart,
+	    (uint64_t)(g->rootstart * 512));
+	printf("firstcluster = %u sectors  @ 0x%llx bytes\n",
+	    g->firstcluster, (uint64_t)(g->firstcluster * 512));
+	printf("maxcluster   = %u clusters @ 0x%llx bytes\n", g->maxcluster,
+	    (uint64_t)(g->maxcluster * 512 * g->spc));
+	printf("numclusters  = %u\n", g->numclusters);
+	printf("mediasize    = %llu bytes\n",
+	    (unsigned long long)g->mediasize);
+	printf("fatsecs      = %u sectors\n", g->fatsecs);
+	printf("image name   = %s\n", info->imagename);
+}
+
+void cd(struct session_s *sess, char *argv) {
+	struct info_s *info = &sess->info;
+	uint32_t n;
+
+	n = resolve_path(sess, argv);
+	if (n == XTAF_NO_NODE)
+		fprintf(stderr, "cd: pathname not found: %s\n", argv);
+	else if (!xtaf_is_dir(sess->vol, n))
+		fprintf(stderr, "cd: not a directory: %s\n", argv);
+	else {
+		sess->pwdnode = n;
+		if (sess->index.nodes[n].fstart < 2)
+			/* use 0 or 1 for root directory */
+			info->pwd = info->geom.rootstart;
+		else
+			info->pwd = (sess->index.nodes[n].fstart - 1) *
+			    info->geom.spc + info->geom.rootstart;
+	}
+
+	fprintf(stderr, "new pwd = %u sectors @ 0x%llx bytes\n", info->pwd,
+	    (uint64_t)(info->pwd * 512));
+}
+
+/*
+ * write(2) all of buf, pipes and sockets may take less at a time.
+ */
+int write_all(int fd, char *buf, size_t len) {
+	ssize_t s;
+
+	for (; len > 0; buf += s, len -= s) {
+		s = write(fd, buf, len);
+		if (s == -1 && errno == EINTR)
+			s = 0;
+		else if (s <= 0)
+			return(1);
+	}
+	return(0);
+}
+
+/*
+ * Pick the zero-copy method for output descriptor fd.
+ */
+int zero_copy_method(int fd) {
+#ifdef HAVE_ZERO_COPY
+	struct stat st;
+
+	if (getenv("UXTAF_NOZEROCOPY") != NULL || fstat(fd, &st) == -1)
+		return(ZC_NONE);
+	if (S_ISREG(st.st_mode))
+		return(ZC_RANGE);
+	if (S_ISFIFO(st.st_mode))
+		return(ZC_SPLICE);
+	if (S_ISSOCK(st.st_mode))
+		return(ZC_SENDFILE);
+#endif
+	return(ZC_NONE);
+}
+
+/*
+ * Move len bytes at image offset off to fd inside the kernel.  Returns the
+ * number of bytes moved, which is less than len when the kernel refused,
+ * the caller then copies the rest itself.
+ */
+uint64_t zero_copy(struct session_s *sess, int how, int fd, uint64_t off,
+    uint64_t len) {
+	uint64_t done = 0;
+#ifdef HAVE_ZERO_COPY
+	ssize_t s;
+	loff_t in;
+	off_t soff;
+	int ifd = xtaf_fd(sess->vol);
+
+	while (done < len) {
+		in = off + done;
+		soff = off + done;
+		if (how == ZC_RANGE)
+			s = copy_file_range(ifd, &in, fd, NULL, len - done, 0);
+		else if (how == ZC_SPLICE)
+			s = splice(ifd, &in, fd, NULL, len - done,
+			    SPLICE_F_MOVE);
+		else if (how == ZC_SENDFILE)
+			s = sendfile(fd, ifd, &soff, len - done);
+		else
+			break;
+		if (s == -1 && errno == EINTR)
+			continue;
+		if (s <= 0)
+			break;
+		xtaf_count_read(sess->vol, off + done, s, XTAF_IO_DATA);
+		done += s;
+	}
+#endif
+	return(done);
+}
+
+/*
+ * The reads of one thread copying files with copy_node(): an engine of
+ * libxtaf with depth requests in flight, each with a buffer of
+ * sess->bufsize bytes.  The buffers are stride bytes apart, a multiple of
+ * the cluster size and of the page size, so with O_DIRECT every read
+ * starts aligned and the tail of a file can be read as whole sectors.
+ */
+struct reader_s {
+	struct xtaf_aio *aio;
+	unsigned depth;
+	size_t stride;
+	char *bufs;
+	struct xtaf_aio_req *reqs;
+	char *done; /* reqs[i] has completed */
 };
 
-struct datetime_s dosdati(uint16_t date, uint16_t time) {
-	struct datetime_s dt;
+/*
+ * Start a reader for one of nthreads threads, which share the default
+ * depth of libxtaf.
+ */
+int reader_open(struct session_s *sess, int nthreads, struct reader_s *rd) {
+	size_t csize, page;
+	unsigned depth;
+
+	bzero(rd, sizeof(struct reader_s));
+	depth = xtaf_aio_default() / nthreads;
+	if (xtaf_aio_open(sess->vol, depth > 0 ? depth : 1, sess->aioflags,
+	    &rd->aio))
+		return(1);
+	rd->depth = xtaf_aio_depth(rd->aio);
+	csize = (size_t)sess->info.geom.spc * 512;
+	page = sysconf(_SC_PAGESIZE);
+	rd->stride = (sess->bufsize + csize - 1) / csize * csize;
+	rd->stride = (rd->stride + page - 1) / page * page;
+	rd->bufs = xtaf_aio_alloc(rd->aio, rd->depth * rd->stride);
+	rd->reqs = calloc(rd->depth, sizeof(struct xtaf_aio_req));
+	rd->done = calloc(rd->depth, 1);
+	if (rd->bufs == NULL || rd->reqs == NULL || rd->done == NULL) {
+		xtaf_aio_close(rd->aio);
+		free(rd->reqs);
+		free(rd->done);
+		return(1);
+	}
+	return(0);
+}
 
-	dt.year = (date >> 9) + 1980;
-	/* wikipedia says s/1980/2000 for FATX, seems wrong */
-	dt.month = date >> 5 & 0x000f;
-	dt.day = date & 0x001f;
-	dt.hour = time >> 11;
-	dt.minute = time >> 5 & 0x003f;
-	dt.second = (time & 0x001f) << 1;
-	return(dt);
+void reader_close(struct reader_s *rd) {
+	xtaf_aio_close(rd->aio);
+	free(rd->reqs);
+	free(rd->done);
 }
 
-int read_boot(FILE *f, struct boot_s *b) {
+/*
+ * Copy the first size bytes of the next extents in ext to descriptor fd.
+ * Each run of consecutive clusters is handed to the kernel in one go if fd
+ * allows zero-copy (see zero_copy_method()), unless reading with O_DIRECT.
+ * Otherwise, or when the kernel refuses, it is read in chunks of
+ * sess->bufsize bytes with rd->depth of them in flight, which go straight
+ * to fd, in order, without stdio.  The last chunk is the tail of the file,
+ * only rest bytes of it are written even if libxtaf read whole sectors.
+ */
+int copy_extents(struct session_s *sess, struct xtaf_extent *ext,
+    uint32_t next, uint32_t size, int fd, struct reader_s *rd) {
+	struct xtaf_aio_req *r;
+	uint64_t len, pos, seq, head;
+	uint32_t i, rest, q;
 	size_t s;
+	int how, ret = 0;
+
+	rest = size;
+	/* the kernel would copy through the page cache */
+	how = sess->aioflags & XTAF_AIO_DIRECT ? ZC_NONE :
+	    zero_copy_method(fd);
+	for (i = 0, pos = 0; i < next && rest > 0 && how != ZC_NONE; i++) {
+		len = (uint64_t)ext[i].nclust * 512 * sess->info.geom.spc;
+		if (len > rest)
+			len = rest; /* tail of the last cluster */
+		pos = zero_copy(sess, how, fd, (uint64_t)ext[i].sector * 512,
+		    len);
+		rest -= pos;
+		if (pos < len) {
+			how = ZC_NONE; /* refused, use the buffers */
+			break;
+		}
+		pos = 0;
+	}
 
-	s = fread(b->magic, sizeof(char), 4, f);
-	if (s != 4 || strncmp(b->magic, "XTAF", 4)) {
-		fprintf(stderr, "read_boot: magic cmp = %i\n",
-		    strncmp(b->magic, "XTAF", 4));
-		return(1);
+	/* the rest from pos in extent i, reading ahead of the writes */
+	for (seq = head = 0; head < seq || (i < next && rest > 0 && !ret);) {
+		len = i < next ? (uint64_t)ext[i].nclust * 512 *
+		    sess->info.geom.spc : 0;
+		if (i < next && pos == len) {
+			i++;
+			pos = 0;
+			continue;
+		}
+		if (i < next && rest > 0 && !ret && seq - head < rd->depth) {
+			s = len - pos < sess->bufsize ? len - pos :
+			    sess->bufsize;
+			if (s > rest)
+				s = rest;
+			q = seq % rd->depth;
+			r = &rd->reqs[q];
+			r->buf = rd->bufs + q * rd->stride;
+			r->room = rd->stride;
+			r->len = s;
+			r->off = (uint64_t)ext[i].sector * 512 + pos;
+			r->purpose = XTAF_IO_DATA;
+			rd->done[q] = 0;
+			if (xtaf_aio_submit(rd->aio, r)) {
+				ret = 1;
+				continue;
+			}
+			seq++;
+			pos += s;
+			rest -= s;
+			continue;
+		}
+		if (xtaf_aio_wait(rd->aio, &r)) {
+			fprintf(stderr, "copy_extents: read error\n");
+			ret = 1;
+			break;
+		}
+		rd->done[r - rd->reqs] = 1;
+		for (; head < seq && rd->done[head % rd->depth]; head++) {
+			r = &rd->reqs[head % rd->depth];
+			if (ret)
+				continue; /* only collect them */
+			if (r->res != (ssize_t)r->len) {
+				fprintf(stderr, "copy_extents: short read at "
+				    "offset %llu\n",
+				    (unsigned long long)r->off);
+				ret = 1;
+			} else if (write_all(fd, r->buf, r->len)) {
+				fprintf(stderr, "copy_extents: write error "
+				    "%i\n", errno);
+				ret = 1;
+			}
+		}
 	}
+	return(ret);
+}
 
-	s = fread(&b->volid, sizeof(uint32_t), 1, f);
-	b->volid = bswap32(b->volid);
-	if (s != 1) {
-		fprintf(stderr, "read_boot: volid: s = %i\n", s);
+/*
+ * Copy the contents of de to descriptor fd, following its chain.
+ */
+int copy_node(struct session_s *sess, struct xtaf_node *de, int fd,
+    struct reader_s *rd) {
+	struct xtaf_extent *ext;
+	uint32_t next;
+	int error, ret;
+
+	if (de->fsize == 0)
+		return(0); /* nothing allocated */
+	error = xtaf_extents(sess->vol, de->fstart, de->fsize, &ext, &next,
+	    NULL);
+	if (error) {
+		fprintf(stderr, "copy_node: chain of cluster %u: %s\n",
+		    de->fstart, strerror(error));
 		return(1);
 	}
+	ret = copy_extents(sess, ext, next, de->fsize, fd, rd);
+	free(ext);
+	return(ret);
+}
 
-	s = fread(&b->spc, sizeof(uint32_t), 1, f);
-	b->spc = bswap32(b->spc);
-	if (s != 1) {
-		fprintf(stderr, "read_boot: spc: s = %i\n", s);
-		return(1);
+int cat(struct session_s *sess, char *argv) {
+	struct reader_s rd;
+	uint32_t n;
+	int ret;
+
+	n = resolve_path(sess, argv);
+	if (n == XTAF_NO_NODE) {
+		fprintf(stderr, "cat: path not found: %s\n", argv);
+		return(ENOENT);
 	}
+	if (reader_open(sess, 1, &rd))
+		return(1);
+	fflush(stdout); /* keep the order of earlier output */
+	ret = copy_node(sess, &sess->index.nodes[n], fileno(stdout), &rd);
+	reader_close(&rd);
+	return(ret);
+}
+
+/*
+ * Give path the access and update time of node n.
+ */
+void set_times(struct xtaf_node *de, char *path) {
+	struct timeval tv[2];
+
+	tv[0].tv_sec = xtaf_time(de->dati[2], de->dati[3]);
+	tv[0].tv_usec = 0;
+	tv[1].tv_sec = xtaf_time(de->dati[4], de->dati[5]);
+	tv[1].tv_usec = 0;
+	if (utimes(path, tv) == -1)
+		fprintf(stderr, "extract: utimes %s: %i\n", path, errno);
+}
 
-	s = fread(&b->nfat, sizeof(uint32_t), 1, f);
-	b->nfat = bswap32(b->nfat);
-	if (s != 1 || b->nfat != 1) {
-		fprintf(stderr, "read_boot: nfat: s = %i nfat = %u\n", s,
-		    b->nfat);
+/*
+ * Write the path of node n relative to node top, prefixed with destdir,
+ * into path.  Names which would escape destdir are refused.
+ */
+int node_path(struct xtaf_index *idx, uint32_t top, uint32_t n, char *destdir,
+    char *path) {
+	char *name;
+	size_t len;
+
+	if (n == top) {
+		len = snprintf(path, PATH_MAX, "%s", destdir);
+		return(len >= PATH_MAX);
+	}
+	if (node_path(idx, top, idx->nodes[n].parent, destdir, path))
+		return(1);
+	name = idx->pool + idx->nodes[n].name;
+	if (*name == '\0' || !strcmp(name, ".") || !strcmp(name, "..") ||
+	    strchr(name, '/') != NULL) {
+		fprintf(stderr, "extract: refusing name \"%s\"\n", name);
 		return(1);
 	}
+	len = strlen(path);
+	return(snprintf(path + len, PATH_MAX - len, "/%s", name) >=
+	    PATH_MAX - len);
+}
+
+/*
+ * Work shared by the extract threads.  files is sorted by start cluster,
+ * each thread takes the next one under the mutex.  Also used by sweep().
+ */
+struct extract_s {
+	struct session_s *sess;
+	uint32_t top;
+	char *destdir;
+	uint32_t *files;
+	uint32_t nfiles;
+	uint32_t next;
+	uint32_t failed;
+	int nthreads;
+	pthread_mutex_t mtx;
+};
 
-	s = fread(&b->zero, sizeof(uint16_t), 1, f);
-	b->zero = bswap16(b->zero);
-	if (s != 1) {
-		fprintf(stderr, "read_boot: zero: s = %i\n", s);
+/*
+ * Copy de to a new file at path.  copy_node() uses pread(2) and libxtaf is
+ * thread-safe, so several threads can share the volume.
+ */
+int extract_file(struct session_s *sess, struct xtaf_node *de, char *path,
+    struct reader_s *rd) {
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "extract: open %s: %i\n", path, errno);
+		return(1);
+	}
+	if (copy_node(sess, de, fd, rd)) {
+		fprintf(stderr, "extract: %s failed\n", path);
+		close(fd);
 		return(1);
 	}
+	close(fd);
+	set_times(de, path);
 	return(0);
 }
 
-struct fat_s *build_fat_chain(FILE *f, struct info_s *info, uint32_t start,
-    uint32_t size) {
-	struct fat_s *head, *list, *this;
-	size_t s;
-	uint32_t cluster, nc;
-
-	head = calloc(1, sizeof(struct fat_s));
-	head->nextval = (start - 1) * info->bootinfo.spc + info->rootstart;
-	list = head;
-	cluster = start;
+void *extract_worker(void *arg) {
+	struct extract_s *ex = arg;
+	struct reader_s rd;
+	char path[PATH_MAX];
+	uint32_t n;
+	int error;
 
-	nc = size / (512 * info->bootinfo.spc);
-	if (size % (512 * info->bootinfo.spc) > 0)
-		nc++;
+	error = reader_open(ex->sess, ex->nthreads, &rd);
 	for (;;) {
-		fseeko(f, (uint64_t)(info->fatstart * 512 + cluster *
-		    info->fatmult), SEEK_SET);
-		s = fread(&cluster, info->fatmult, 1, f);
-		if (s != 1) {
-			fprintf(stderr, "build_fat_chain: s = %i\n", s);
-			return(NULL);
-		}
-		cluster = info->fatmult == 2 ? bswap16(cluster) :
-		    bswap32(cluster);
-		cluster &= info->fatmask;
-		nc--;
-
-		/* from wikpedia::File_Allocation_Table :
-		   0 = free cluster
-		   2 .. 0x?fffffef = pointer to next, used
-		   1, 0x?ffffff0 .. 0x?ffffff6 = reserved value
-		   0x?ffffff7 = bad sector in cluster or reserved cluster
-		   0x?ffffff8 .. 0x?fffffff = last cluster in file
-		*/
-		if (cluster < 2 || cluster > (0xffffffef & info->fatmask))
+		pthread_mutex_lock(&ex->mtx);
+		if (error || ex->next == ex->nfiles) {
+			ex->failed += error;
+			pthread_mutex_unlock(&ex->mtx);
 			break;
+		}
+		n = ex->files[ex->next++];
+		pthread_mutex_unlock(&ex->mtx);
+
+		if (node_path(&ex->sess->index, ex->top, n, ex->destdir,
+		    path) || extract_file(ex->sess,
+		    &ex->sess->index.nodes[n], path, &rd)) {
+			pthread_mutex_lock(&ex->mtx);
+			ex->failed++;
+			pthread_mutex_unlock(&ex->mtx);
+		}
+	}
+	if (!error)
+		reader_close(&rd);
+	return(NULL);
+}
+
+/*
+ * A piece of a file for sweep(): len bytes at image offset off go to offset
+ * pos of ex->files[file].
+ */
+struct seg_s {
+	uint64_t off;
+	uint32_t pos;
+	uint32_t len;
+	uint32_t file;
+};
 
-		this = calloc(1, sizeof(struct fat_s));
-		this->nextval = (cluster - 1) * info->bootinfo.spc +
-		    info->rootstart; /* convert to sector */
-		list->next = this;
-		list = list->next;
+/* an output file of sweep() */
+struct out_s {
+	int fd; /* -1 while closed */
+	int opened; /* created already, reopen without truncating */
+	int failed;
+	uint32_t left; /* pieces still to be written */
+};
+
+int cmp_seg(const void *a, const void *b) {
+	const struct seg_s *sa = a, *sb = b;
+
+	return(sa->off < sb->off ? -1 : sa->off > sb->off);
+}
+
+/*
+ * Open output file f of the plan, closing all others (listed in live) when
+ * out of descriptors.  They are reopened when their next piece comes up.
+ */
+int sweep_open(struct extract_s *ex, struct out_s *out, uint32_t *live,
+    uint32_t *nlive, uint32_t f, char *path) {
+	if (out[f].fd != -1)
+		return(0);
+	if (node_path(&ex->sess->index, ex->top, ex->files[f], ex->destdir,
+	    path))
+		return(1);
+	for (;;) {
+		out[f].fd = open(path, O_WRONLY | (out[f].opened ? 0 :
+		    O_CREAT | O_TRUNC), 0644);
+		if (out[f].fd != -1 || (errno != EMFILE && errno != ENFILE) ||
+		    *nlive == 0)
+			break;
+		while (*nlive > 0) {
+			close(out[live[--*nlive]].fd);
+			out[live[*nlive]].fd = -1;
+		}
 	}
-	if (nc > 0) {
-		fprintf(stderr, "build_fat_chain: %u clusters left\n", nc);
-		exit(1);
+	if (out[f].fd == -1) {
+		fprintf(stderr, "extract: open %s: %i\n", path, errno);
+		return(1);
 	}
-	list->next = NULL;
-	return(head);
+	out[f].opened = 1;
+	live[(*nlive)++] = f;
+	return(0);
 }
 
-uint32_t find_dot_entry(struct dot_table_s *dot_table, uint32_t startcluster) {
-	struct dot_table_s *dot;
+/*
+ * The file is complete, close it and give it its times.
+ */
+void sweep_done(struct extract_s *ex, struct out_s *out, uint32_t *live,
+    uint32_t *nlive, uint32_t f, char *path) {
+	uint32_t i;
+
+	if (out[f].fd != -1) {
+		close(out[f].fd);
+		out[f].fd = -1;
+		for (i = 0; i < *nlive && live[i] != f; i++)
+			;
+		live[i] = live[--*nlive];
+	}
+	if (out[f].failed)
+		ex->failed++;
+	else if (!node_path(&ex->sess->index, ex->top, ex->files[f],
+	    ex->destdir, path))
+		set_times(&ex->sess->index.nodes[ex->files[f]], path);
+}
 
-	for (dot = dot_table; dot != NULL; dot = dot->next)
-		if (dot->this == startcluster)
-			return(dot->parent);
-	return(DOT_NOT_FOUND);
+/*
+ * Extract ex->files in one pass over the disk instead of file by file.
+ * All chains are resolved to extents first and cut into pieces of at most
+ * bufsize bytes, which are sorted by disk offset.  Neighbouring pieces,
+ * of any file, are then read with one read of up to bufsize bytes,
+ * reading through gaps of up to SWEEP_GAP bytes, and written to their
+ * files with pwrite(2).  The reads are queued in disk order, so the head
+ * only moves forward, which is what spinning disks and USB bridges like
+ * best, while fast devices get the default depth of libxtaf in flight.
+ */
+int sweep(struct extract_s *ex) {
+	struct session_s *sess = ex->sess;
+	struct xtaf_node *de;
+	struct xtaf_extent *ext;
+	struct seg_s *segs = NULL, *sg;
+	struct out_s *out;
+	struct reader_s rd;
+	struct xtaf_aio_req *r;
+	uint64_t start, end, csize;
+	uint32_t f, i, j, k, q, next, rest, len, nsegs = 0, maxsegs = 0;
+	uint32_t *live, nlive = 0, *first, *free_q, nfree, nplanned;
+	char path[PATH_MAX];
+
+	csize = (uint64_t)sess->info.geom.spc * 512;
+	if (reader_open(sess, 1, &rd))
+		return(1);
+	out = calloc(ex->nfiles, sizeof(struct out_s));
+	live = malloc(ex->nfiles * sizeof(uint32_t));
+	first = malloc(rd.depth * sizeof(uint32_t));
+	free_q = malloc(rd.depth * sizeof(uint32_t));
+	if (out == NULL || live == NULL || first == NULL || free_q == NULL) {
+		free(out);
+		free(live);
+		free(first);
+		free(free_q);
+		reader_close(&rd);
+		return(1);
+	}
+	for (nfree = 0; nfree < rd.depth; nfree++)
+		free_q[nfree] = nfree;
+	for (f = 0; f < ex->nfiles; f++)
+		out[f].fd = -1;
+
+	/* the plan */
+	for (nplanned = 0; nplanned < ex->nfiles; nplanned++) {
+		f = nplanned;
+		de = &sess->index.nodes[ex->files[f]];
+		if (de->fsize == 0 || xtaf_extents(sess->vol, de->fstart,
+		    de->fsize, &ext, &next, NULL)) {
+			/* empty, or a broken chain */
+			out[f].failed = de->fsize > 0;
+			if (out[f].failed)
+				fprintf(stderr, "extract: chain of cluster %u "
+				    "is broken\n", de->fstart);
+			if (!out[f].failed &&
+			    sweep_open(ex, out, live, &nlive, f, path))
+				out[f].failed = 1;
+			sweep_done(ex, out, live, &nlive, f, path);
+			continue;
+		}
+		rest = de->fsize;
+		for (i = 0; i < next && rest > 0; i++)
+			for (start = 0; start < ext[i].nclust * csize &&
+			    rest > 0; start += len, rest -= len) {
+				len = ext[i].nclust * csize - start <
+				    sess->bufsize ? ext[i].nclust * csize -
+				    start : sess->bufsize;
+				if (len > rest)
+					len = rest;
+				if (nsegs == maxsegs) {
+					maxsegs = maxsegs > 0 ? maxsegs * 2 :
+					    1024;
+					sg = realloc(segs, maxsegs *
+					    sizeof(struct seg_s));
+					if (sg == NULL) {
+						fprintf(stderr, "extract: out "
+						    "of memory\n");
+						free(ext);
+						goto out;
+					}
+					segs = sg;
+				}
+				segs[nsegs].off = (uint64_t)ext[i].sector *
+				    512 + start;
+				segs[nsegs].pos = de->fsize - rest;
+				segs[nsegs].len = len;
+				segs[nsegs].file = f;
+				nsegs++;
+				out[f].left++;
+			}
+		free(ext);
+	}
+	qsort(segs, nsegs, sizeof(struct seg_s), cmp_seg);
+
+	/* the sweep, reqs[q] reads segs[first[q]] up to the next group */
+	for (i = 0; i < nsegs || nfree < rd.depth;) {
+		if (i < nsegs && nfree > 0) {
+			start = segs[i].off;
+			end = start + segs[i].len;
+			for (j = i + 1; j < nsegs &&
+			    segs[j].off <= end + SWEEP_GAP &&
+			    segs[j].off + segs[j].len - start <= sess->bufsize;
+			    j++)
+				if (segs[j].off + segs[j].len > end)
+					end = segs[j].off + segs[j].len;
+			q = free_q[--nfree];
+			r = &rd.reqs[q];
+			r->buf = rd.bufs + q * rd.stride;
+			r->room = rd.stride;
+			r->len = end - start;
+			r->off = start;
+			r->purpose = XTAF_IO_DATA;
+			r->arg = (void *)(uintptr_t)j;
+			first[q] = i;
+			if (xtaf_aio_submit(rd.aio, r)) {
+				free_q[nfree++] = q;
+				break;
+			}
+			i = j;
+			continue;
+		}
+		if (xtaf_aio_wait(rd.aio, &r))
+			break;
+		q = r - rd.reqs;
+		for (k = first[q]; k < (uintptr_t)r->arg; k++) {
+			f = segs[k].file;
+			if (r->res != (ssize_t)r->len)
+				out[f].failed = 1;
+			else if (!out[f].failed && (sweep_open(ex, out, live,
+			    &nlive, f, path) || pwrite(out[f].fd,
+			    (char *)r->buf + (segs[k].off - r->off),
+			    segs[k].len, segs[k].pos) != segs[k].len))
+				out[f].failed = 1;
+			if (--out[f].left == 0)
+				sweep_done(ex, out, live, &nlive, f, path);
+		}
+		if (r->res != (ssize_t)r->len)
+			fprintf(stderr, "extract: short read at offset %llu\n",
+			    (unsigned long long)r->off);
+		free_q[nfree++] = q;
+	}
+out:
+	reader_close(&rd); /* drops what is still in flight */
+	/* files left over, also those not planned if that ran out of memory */
+	for (f = 0; f < ex->nfiles; f++)
+		if (out[f].left > 0 || f >= nplanned) {
+			out[f].failed = 1;
+			sweep_done(ex, out, live, &nlive, f, path);
+		}
+	free(segs);
+	free(out);
+	free(live);
+	free(first);
+	free(free_q);
+	return(0);
 }
 
-void add_dot_entry(struct dot_table_s **dot_table, uint32_t cluster,
-    uint32_t parent, int check) {
-	struct dot_table_s *newdot;
+/*
+ * Sort files by start cluster, so a spinning disk mostly reads forward.
+ */
+struct xtaf_index *sort_idx;
 
-	if (!check || find_dot_entry(*dot_table, cluster) == DOT_NOT_FOUND) {
-		newdot = calloc(1, sizeof(struct dot_table_s));
-		newdot->this = cluster;
-		newdot->parent = parent;
-		newdot->next = *dot_table;
-		*dot_table = newdot;
-	}
+int cmp_fstart(const void *a, const void *b) {
+	uint32_t ca, cb;
+
+	ca = sort_idx->nodes[*(const uint32_t *)a].fstart;
+	cb = sort_idx->nodes[*(const uint32_t *)b].fstart;
+	return(ca < cb ? -1 : ca > cb);
 }
 
-int attach(struct info_s *info, struct dot_table_s **dot_table) {
+/*
+ * Copy src, a file or a whole directory tree, into destdir using nthreads
+ * threads, or in one sweep over the disk (see sweep()) if nthreads is 0.
+ * Directories are created first, in index order so parents come before
+ * their children, and get their times after all files are written.
+ */
+int extract(struct session_s *sess, char *src, char *destdir, int nthreads) {
+	struct xtaf_index *idx = &sess->index;
+	struct extract_s ex;
+	pthread_t *tids;
+	uint32_t *dirs, ndirs, n, first, last, d;
+	char path[PATH_MAX];
 	int i;
-	uint8_t quirkblk[4096];
-	size_t s;
-	FILE *f;
 
-	fprintf(stderr, "Opening %s in 'rb' mode\n", info->imagename);
-	f = fopen(info->imagename, "rb");
-	if (f == NULL) {
-		fprintf(stderr, "Error opening %s: %i\n",
-		    info->imagename, errno);
-		return(errno);
+	bzero(&ex, sizeof(struct extract_s));
+	ex.sess = sess;
+	ex.destdir = destdir;
+	n = resolve_path(sess, src);
+	if (n == XTAF_NO_NODE) {
+		fprintf(stderr, "extract: path not found: %s\n", src);
+		return(ENOENT);
 	}
-	fseeko(f, 0LL, SEEK_END);
-	info->mediasize = 0;
-	if (ftello(f) != -1)
-		info->mediasize = ftello(f);
-	if (info->mediasize > 0) {
-		fseeko(f, 0LL, SEEK_SET);
-	} else {
-		fprintf(stderr, "attach: fseeko: errno = %i\n", errno);
-		fclose(f);
+	if (mkdir(destdir, 0755) == -1 && errno != EEXIST) {
+		fprintf(stderr, "extract: mkdir %s: %i\n", destdir, errno);
 		return(errno);
 	}
 
-	if (read_boot(f, &info->bootinfo)) {
-		fclose(f);
+	/* the subtree of n, breadth-first like the index itself */
+	dirs = malloc(idx->nnodes * sizeof(uint32_t));
+	ex.files = malloc(idx->nnodes * sizeof(uint32_t));
+	tids = calloc(nthreads > 0 ? nthreads : 1, sizeof(pthread_t));
+	if (dirs == NULL || ex.files == NULL || tids == NULL) {
+		free(dirs);
+		free(ex.files);
+		free(tids);
 		return(1);
 	}
+	ndirs = 0;
+	if (xtaf_is_dir(sess->vol, n)) {
+		ex.top = n;
+		dirs[ndirs++] = n;
+	} else {
+		ex.top = idx->nodes[n].parent;
+		ex.files[ex.nfiles++] = n;
+	}
+	for (d = 0; d < ndirs; d++) {
+		first = idx->nodes[dirs[d]].first;
+		last = first + idx->nodes[dirs[d]].nchild;
+		for (n = first; n < last; n++) {
+			if (idx->nodes[n].fnl == 0xe5)
+				continue;
+			if (xtaf_is_dir(sess->vol, n)) {
+				if (node_path(idx, ex.top, n, destdir, path) ||
+				    (mkdir(path, 0755) == -1 &&
+				    errno != EEXIST)) {
+					fprintf(stderr, "extract: cannot create "
+					    "%s\n", path);
+					ex.failed++;
+					continue;
+				}
+				dirs[ndirs++] = n;
+			} else
+				ex.files[ex.nfiles++] = n;
+		}
+	}
 
-	/* some logic checks */
-	if (info->bootinfo.spc == 0 || info->mediasize == 0 ||
-	    info->bootinfo.spc & (info->bootinfo.spc - 1)) {
-		fprintf(stderr, "attach: geometry error!\n");
-		fclose(f);
+	sort_idx = idx;
+	qsort(ex.files, ex.nfiles, sizeof(uint32_t), cmp_fstart);
+	if (nthreads == 0 && sweep(&ex))
+		ex.failed = ex.nfiles;
+	ex.nthreads = nthreads;
+	pthread_mutex_init(&ex.mtx, NULL);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&tids[i], NULL, extract_worker, &ex)) {
+			fprintf(stderr, "extract: cannot start thread %i\n", i);
+			break;
+		}
+	if (i == 0 && nthreads > 0)
+		extract_worker(&ex);
+	while (--i >= 0)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&ex.mtx);
+
+	/* deepest directories first, so parents keep their times */
+	for (d = ndirs; d-- > 0; )
+		if (dirs[d] != ex.top &&
+		    !node_path(idx, ex.top, dirs[d], destdir, path))
+			set_times(&idx->nodes[dirs[d]], path);
+
+	fprintf(stderr, "extract: %u files, %u directories, %u failed\n",
+	    ex.nfiles, ndirs, ex.failed);
+	free(dirs);
+	free(ex.files);
+	free(tids);
+	return(ex.failed > 0);
+}
+
+/* a ustar header block, see tar(5) */
+struct tar_hdr_s {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6]; /* "ustar" */
+	char version[2]; /* "00" */
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+/*
+ * Fill a numeric field of a header: octal digits and a nul.
+ */
+void tar_octal(char *field, size_t width, uint64_t v) {
+	field[--width] = '\0';
+	while (width-- > 0) {
+		field[width] = '0' + (v & 7);
+		v >>= 3;
+	}
+}
+
+/*
+ * Write a header block of type type for name (at most 100 bytes) and
+ * prefix (at most 155), with its checksum, to fd.  Longer ones are cut.
+ */
+int tar_block(int fd, char *name, char *prefix, int mode, uint64_t size,
+    time_t mtime, char type, uint64_t *total) {
+	struct tar_hdr_s h;
+	unsigned char *p;
+	unsigned sum = 0;
+	size_t i;
+
+	bzero(&h, sizeof(struct tar_hdr_s));
+	memcpy(h.name, name, strnlen(name, sizeof(h.name)));
+	memcpy(h.prefix, prefix, strnlen(prefix, sizeof(h.prefix)));
+	tar_octal(h.mode, sizeof(h.mode), mode);
+	tar_octal(h.uid, sizeof(h.uid), 0);
+	tar_octal(h.gid, sizeof(h.gid), 0);
+	tar_octal(h.size, sizeof(h.size), size);
+	tar_octal(h.mtime, sizeof(h.mtime), mtime > 0 ? mtime : 0);
+	h.typeflag = type;
+	memcpy(h.magic, "ustar", 6);
+	memcpy(h.version, "00", 2);
+	memset(h.chksum, ' ', sizeof(h.chksum));
+	for (i = 0, p = (unsigned char *)&h; i < sizeof(h); i++)
+		sum += p[i];
+	tar_octal(h.chksum, sizeof(h.chksum) - 1, sum); /* and a space */
+	*total += TAR_BLOCK;
+	return(write_all(fd, (char *)&h, TAR_BLOCK));
+}
+
+/*
+ * Write n zero bytes.
+ */
+int tar_zero(int fd, uint64_t *total, uint64_t n) {
+	static char zero[TAR_BLOCK];
+	uint64_t len;
+
+	*total += n;
+	for (; n > 0; n -= len) {
+		len = n < TAR_BLOCK ? n : TAR_BLOCK;
+		if (write_all(fd, zero, len))
+			return(1);
+	}
+	return(0);
+}
+
+/*
+ * Write zeroes up to the next multiple of unit bytes of output.
+ */
+int tar_pad(int fd, uint64_t *total, uint64_t unit) {
+	return(tar_zero(fd, total, (unit - *total % unit) % unit));
+}
+
+/*
+ * Write the header of node de, named path (with a / at the end for
+ * directories).  Names which do not fit name, nor prefix and name split at
+ * a /, get a pax extended header with the full path first, name then only
+ * holds the last part of the path.
+ */
+int tar_header(int fd, struct xtaf_node *de, char *path, int isdir,
+    uint64_t *total) {
+	char prefix[156], rec[PATH_MAX + 32], *slash;
+	size_t len, n;
+	int mode;
+
+	mode = isdir ? 0755 : 0644;
+	if (de->attr & 1)
+		mode &= ~0222; /* read-only */
+	len = strlen(path);
+	prefix[0] = '\0';
+	if (len > 100) {
+		/* the first / which leaves at most 100 bytes of name */
+		for (slash = strchr(path, '/'); slash != NULL &&
+		    len - (slash + 1 - path) > 100;
+		    slash = strchr(slash + 1, '/'))
+			;
+		if (slash != NULL && slash - path <= 155 && slash[1] != '\0') {
+			memcpy(prefix, path, slash - path);
+			prefix[slash - path] = '\0';
+			path = slash + 1;
+		} else {
+			/* "len path=...\n", len counting its own digits */
+			for (n = len + 8; n != (size_t)snprintf(rec,
+			    sizeof(rec), "%zu path=%s\n", n, path); n++)
+				;
+			if (tar_block(fd, "././@PaxHeader", "", 0644, n,
+			    xtaf_time(de->dati[4], de->dati[5]), 'x', total) ||
+			    write_all(fd, rec, n))
+				return(1);
+			*total += n;
+			if (tar_pad(fd, total, TAR_BLOCK))
+				return(1);
+			/* readers without pax get the end of the path */
+			path += len - 100;
+			slash = strchr(path, '/');
+			if (slash != NULL && slash[1] != '\0')
+				path = slash + 1;
+		}
+	}
+	return(tar_block(fd, path, prefix, mode, isdir ? 0 : de->fsize,
+	    xtaf_time(de->dati[4], de->dati[5]), isdir ? '5' : '0', total));
+}
+
+/*
+ * Write src, a file or a whole directory tree, to stdout as a POSIX tar
+ * stream, straight from the image.  Names are relative to the parent of
+ * src, the times are the update times of the entries.  The directories
+ * come first, then the files in order of their start cluster, so the
+ * disk mostly reads forward, each copied with copy_node() and thus
+ * zero-copy where stdout allows it.
+ */
+int tar(struct session_s *sess, char *src) {
+	struct xtaf_index *idx = &sess->index;
+	struct reader_s rd;
+	uint32_t *nodes, nnodes = 0, ndirs, top, n, first, last, d;
+	uint64_t total = 0;
+	char path[PATH_MAX], *topname;
+	int fd = fileno(stdout), ret = 0;
+	size_t len;
+
+	n = resolve_path(sess, src);
+	if (n == XTAF_NO_NODE) {
+		fprintf(stderr, "tar: path not found: %s\n", src);
+		return(ENOENT);
+	}
+	if (isatty(fd)) {
+		fprintf(stderr, "tar: refusing to write to a terminal\n");
+		return(1);
+	}
+	nodes = malloc(idx->nnodes * sizeof(uint32_t));
+	if (nodes == NULL)
+		return(1);
+	if (reader_open(sess, 1, &rd)) {
+		free(nodes);
 		return(1);
 	}
 
-	/* calculate # of FAT sectors in sectors */
-	info->numclusters = info->mediasize / (512 * info->bootinfo.spc);
-	if (info->numclusters >= 0xfff4) {
-		info->fatmask = FAT32_MASK;
-		info->fatmult = 4;
+	/* directories breadth-first, then the files */
+	if (xtaf_is_dir(sess->vol, n)) {
+		top = n;
+		topname = n == XTAF_ROOT ? "." : idx->pool + idx->nodes[n].name;
+		nodes[nnodes++] = n;
+		for (d = 0; d < nnodes; d++) {
+			first = idx->nodes[nodes[d]].first;
+			last = first + idx->nodes[nodes[d]].nchild;
+			for (n = first; n < last; n++)
+				if (idx->nodes[n].fnl != 0xe5 &&
+				    xtaf_is_dir(sess->vol, n))
+					nodes[nnodes++] = n;
+		}
+		ndirs = nnodes;
+		for (d = 0; d < ndirs; d++) {
+			first = idx->nodes[nodes[d]].first;
+			last = first + idx->nodes[nodes[d]].nchild;
+			for (n = first; n < last; n++)
+				if (idx->nodes[n].fnl != 0xe5 &&
+				    !xtaf_is_dir(sess->vol, n))
+					nodes[nnodes++] = n;
+		}
 	} else {
-		info->fatmask = FAT16_MASK;
-		info->fatmult = 2;
-	}
-	info->fatsize = info->numclusters * info->fatmult;
-	if (info->fatsize % 4096 != 0)
-		info->fatsize = ((info->fatsize / 4096) + 1) * 4096;
-	info->fatsecs = info->fatsize / 512; /* convert to sectors */
-	info->fatstart = 8;
-
-	info->rootstart = info->fatsecs + info->fatstart;
-	fprintf(stderr, "rootstart before: div=%i mod=%i\n",
-	    info->rootstart / info->bootinfo.spc,
-	    info->rootstart % info->bootinfo.spc);
-	/* correct for hd quirk */
-	fseeko(f, (uint64_t)info->rootstart * 512, SEEK_SET);
-	s = fread(quirkblk, sizeof(uint8_t), 4096, f);
-	if (s != 4096) {
-		fprintf(stderr, "attach: block read error!\n");
-		fclose(f);
+		top = idx->nodes[n].parent;
+		topname = ".";
+		ndirs = 0;
+		nodes[nnodes++] = n;
+	}
+	sort_idx = idx;
+	qsort(nodes + ndirs, nnodes - ndirs, sizeof(uint32_t), cmp_fstart);
+
+	fflush(stdout); /* keep the order of earlier output */
+	for (d = 0; d < nnodes && ret == 0; d++) {
+		n = nodes[d];
+		if (ndirs == 0)
+			len = snprintf(path, PATH_MAX, "%s",
+			    idx->pool + idx->nodes[n].name);
+		else if (node_path(idx, top, n, topname, path)) {
+			fprintf(stderr, "tar: skipping %s\n",
+			    idx->pool + idx->nodes[n].name);
+			continue;
+		} else
+			len = strlen(path);
+		if (d < ndirs && len + 1 < PATH_MAX)
+			strcat(path, "/");
+		if (tar_header(fd, &idx->nodes[n], path, d < ndirs, &total))
+			ret = 1;
+		else if (d >= ndirs) {
+			if (copy_node(sess, &idx->nodes[n], fd, &rd))
+				ret = 1;
+			total += idx->nodes[n].fsize;
+			if (ret == 0 && tar_pad(fd, &total, TAR_BLOCK))
+				ret = 1;
+		}
+	}
+	/* two zero blocks end the archive, then fill the record */
+	if (ret == 0 && (tar_zero(fd, &total, 2 * TAR_BLOCK) ||
+	    tar_pad(fd, &total, TAR_RECORD)))
+		ret = 1;
+	if (ret)
+		fprintf(stderr, "tar: the archive is incomplete\n");
+	reader_close(&rd);
+	free(nodes);
+	return(ret);
+}
+
+/*
+ * Show how the clusters are used, from the FAT alone.
+ */
+int df(struct session_s *sess) {
+	struct xtaf_usage u;
+	uint64_t csize;
+	int error;
+
+	error = xtaf_usage(sess->vol, &u, NULL);
+	if (error) {
+		fprintf(stderr, "df: %s\n", strerror(error));
 		return(1);
 	}
-	for (i = 0; i < 4096 && quirkblk[i] == 0; i++)
-		;
-	fprintf(stderr, "quirk: i = %i quirkblk[i] = %u\n", i, quirkblk[i]);
-	if (i == 4096)
-		info->rootstart += 8;
-	fprintf(stderr, "rootstart after : div=%i mod=%i\n",
-	    info->rootstart / info->bootinfo.spc,
-	    info->rootstart % info->bootinfo.spc);
-
-	info->firstcluster = info->rootstart + info->bootinfo.spc;
-	info->maxcluster = (info->mediasize / 512 - info->firstcluster) /
-	    info->bootinfo.spc + 1;
-	if (info->maxcluster >= info->numclusters) {
-		fprintf(stderr, "attach: numclusters (%u) exceeds FAT capacity "
-		    "(%u), adjusting\n",
-		info->maxcluster + 1, info->numclusters);
-		info->maxcluster = info->numclusters - 1;
-	}
-
-	fclose(f);
-
-	info->pwd = info->rootstart; /* sensible start */
-	*dot_table = NULL;
-	add_dot_entry(dot_table, 1, 1, 0);
-	fprintf(stderr, "attach: done\n");
+	csize = 512 * sess->info.geom.spc;
+	printf("clusters     = %u of %llu bytes\n", sess->info.geom.maxcluster,
+	    (unsigned long long)csize);
+	printf("free         = %u clusters, %llu bytes\n", u.free,
+	    (unsigned long long)(u.free * csize));
+	printf("used         = %u clusters, %llu bytes\n",
+	    u.used + u.eof, (unsigned long long)
+	    ((u.used + u.eof) * csize));
+	printf("chains       = %u\n", u.eof);
+	printf("bad          = %u clusters\n", u.bad);
+	printf("reserved     = %u clusters\n", u.reserved);
 	return(0);
 }
 
-struct direntry_s get_entry(struct info_s *info, uint32_t clust, char *filename)
-{
-	FILE *f;
-	struct direntry_s de;
-	size_t s;
-	struct fat_s *fatptr;
-	int entry;
-	char fname[43];
+/* space used by a node and everything below it, see tree_usage() */
+struct usage_s {
+	uint64_t alloc; /* bytes in clusters, directories included */
+	uint64_t bytes; /* file sizes */
+	uint32_t files;
+	uint32_t dirs;
+	uint32_t extents; /* runs of consecutive clusters */
+	uint32_t chain; /* extents of the node itself, not summed */
+	uint32_t broken; /* chains which could not be followed */
+};
 
-	f = fopen(info->imagename, "rb");
-	if (f == NULL) {
-		fprintf(stderr, "Error opening %s: %i\n",
-		    info->imagename, errno);
-		de.fnl = 0;
-		return(de);
-	}
-	for (fatptr = build_fat_chain(f, info, clust, 512 * info->bootinfo.spc);
-	    fatptr != NULL; fatptr = fatptr->next) {
-		fseek(f, (uint64_t)(512 * fatptr->nextval), SEEK_SET);
-		for (entry = 0; entry < info->bootinfo.spc; entry++) {
-			s = fread(&de, sizeof(struct direntry_s), 1, f);
-			if (s != 1) {
-				fprintf(stderr, "get_entry: s = %i\n", s);
-				de.fnl = 0;
-				return(de);
-			}
-			if (de.fnl != 0 && de.fnl != 0xff && de.fnl != 0xe5) {
-				bzero(fname, 43 * sizeof(char));
-				strncpy(fname, de.name, de.fnl);
-				if (!strcmp(fname, filename)) {
-					fclose(f);
-					de.fstart = bswap32(de.fstart);
-					de.fsize = bswap32(de.fsize);
-					/* date/time only in ls */
-					return(de); /* found */
-				}
-			}
+/*
+ * Work out the usage of every node in the subtree at top from the FAT and
+ * the index alone, no data is read.  The nodes are listed breadth-first in
+ * *listp, top first, and the usage of each directory is the sum over its
+ * subtree, added up bottom-up.  *usep is indexed by node.
+ */
+int tree_usage(struct session_s *sess, uint32_t top, struct usage_s **usep,
+    uint32_t **listp, uint32_t *nlistp) {
+	struct xtaf_index *idx = &sess->index;
+	struct xtaf_node *de;
+	struct xtaf_extent *ext;
+	struct usage_s *use, *u, *p;
+	uint32_t *list, nlist = 0, i, n, first, last, next, nclust;
+	uint64_t csize;
+	int isdir;
+
+	use = calloc(idx->nnodes, sizeof(struct usage_s));
+	list = malloc(idx->nnodes * sizeof(uint32_t));
+	if (use == NULL || list == NULL) {
+		free(use);
+		free(list);
+		return(ENOMEM);
+	}
+	csize = 512 * sess->info.geom.spc;
+	list[nlist++] = top;
+	for (i = 0; i < nlist; i++) {
+		if (!xtaf_is_dir(sess->vol, list[i]))
+			continue;
+		first = idx->nodes[list[i]].first;
+		last = first + idx->nodes[list[i]].nchild;
+		for (n = first; n < last; n++)
+			if (idx->nodes[n].fnl != 0xe5)
+				list[nlist++] = n;
+	}
+	for (i = 0; i < nlist; i++) {
+		de = &idx->nodes[list[i]];
+		u = &use[list[i]];
+		isdir = xtaf_is_dir(sess->vol, list[i]);
+		if (isdir)
+			u->dirs = 1;
+		else {
+			u->files = 1;
+			u->bytes = de->fsize;
+		}
+		if (de->fstart == 0 || (!isdir && de->fsize == 0))
+			continue; /* nothing allocated */
+		if (xtaf_extents(sess->vol, de->fstart, isdir ? 0 : de->fsize,
+		    &ext, &next, &nclust)) {
+			u->broken = 1;
+			continue;
 		}
+		u->alloc = nclust * csize;
+		u->extents = u->chain = next;
+		free(ext);
+	}
+	for (i = nlist; i-- > 1; ) {
+		u = &use[list[i]];
+		p = &use[idx->nodes[list[i]].parent];
+		p->alloc += u->alloc;
+		p->bytes += u->bytes;
+		p->files += u->files;
+		p->dirs += u->dirs;
+		p->extents += u->extents;
+		p->broken += u->broken;
 	}
-	fclose(f);
-	de.fnl = 0;
-	return(de);
+	*usep = use;
+	*listp = list;
+	*nlistp = nlist;
+	return(0);
 }
 
-struct direntry_s resolve_path(struct info_s *info,
-	struct dot_table_s *dot_table, char *pathname) {
-	struct direntry_s de;
-	uint32_t clust;
-	char *part, *path;
+/*
+ * Write the name of node n for du and frag: src for top itself, else its
+ * path below src, or just its name if that path cannot be made.
+ */
+void usage_path(struct session_s *sess, uint32_t top, uint32_t n, char *src,
+    char *path) {
+	char prefix[PATH_MAX];
+	size_t len;
+
+	len = strlen(src);
+	while (len > 0 && src[len - 1] == '/')
+		len--;
+	snprintf(prefix, sizeof(prefix), "%.*s", (int)len, src);
+	if (n == top)
+		snprintf(path, PATH_MAX, "%s", src);
+	else if (node_path(&sess->index, top, n, prefix, path))
+		snprintf(path, PATH_MAX, "%s",
+		    sess->index.pool + sess->index.nodes[n].name);
+}
 
-	bzero(&de, sizeof(struct direntry_s));
-	if (pathname == NULL || strlen(pathname) == 0) {
-		fprintf(stderr, "resolve_path: empty path\n");
-		return(de);
+void usage_line(struct usage_s *u, char *path) {
+	printf("%15llu %15llu %8u %8u %8u %s\n", (unsigned long long)u->alloc,
+	    (unsigned long long)u->bytes, u->files, u->dirs, u->extents, path);
+}
+
+/*
+ * Show the space used by src: allocated and logical bytes, files,
+ * directories and extents, for each entry of src and for src itself, or
+ * with recurse for every directory below src as well.
+ */
+int du(struct session_s *sess, char *src, int recurse) {
+	struct xtaf_index *idx = &sess->index;
+	struct usage_s *use;
+	uint32_t *list, nlist, top, i, n, broken;
+	char path[PATH_MAX];
+	int error;
+
+	top = resolve_path(sess, src);
+	if (top == XTAF_NO_NODE) {
+		fprintf(stderr, "du: path not found: %s\n", src);
+		return(ENOENT);
+	}
+	error = tree_usage(sess, top, &use, &list, &nlist);
+	if (error) {
+		fprintf(stderr, "du: %s\n", strerror(error));
+		return(1);
 	}
+	printf("      allocated         logical    files     dirs  extents "
+	    "path\n");
+	for (i = 1; i < nlist; i++) {
+		n = list[i];
+		if (recurse ? !xtaf_is_dir(sess->vol, n) :
+		    idx->nodes[n].parent != top)
+			continue;
+		usage_path(sess, top, n, src, path);
+		usage_line(&use[n], path);
+	}
+	usage_line(&use[top], src);
+	broken = use[top].broken;
+	if (broken > 0)
+		fprintf(stderr, "du: %u broken chains\n", broken);
+	free(use);
+	free(list);
+	return(broken > 0);
+}
 
-	clust = pathname[0] == '/' ? 1 :
-	    (info->pwd - info->rootstart) / info->bootinfo.spc + 1;
-	de.fnl = 1;
-	de.fstart = clust;
+/* the worst files first, see frag() */
+struct usage_s *sort_use;
 
-	path = strdup(pathname);
-	for (; (part = strsep(&path, "/")) != NULL; ) {
-		if (*part == '\0' || !strcmp(part, "."))
+int cmp_extents(const void *a, const void *b) {
+	uint32_t ea, eb;
+
+	ea = sort_use[*(const uint32_t *)a].chain;
+	eb = sort_use[*(const uint32_t *)b].chain;
+	return(ea > eb ? -1 : ea < eb);
+}
+
+/*
+ * Show how fragmented the files below src are, from the FAT alone, and
+ * the worst nworst of them.
+ */
+int frag(struct session_s *sess, char *src, int nworst) {
+	struct usage_s *use, *u;
+	uint32_t *list, nlist, top, i, n, nfiles = 0, withdata = 0;
+	uint32_t fragfiles = 0, fragdirs = 0, fileext = 0;
+	char path[PATH_MAX];
+	int error;
+
+	top = resolve_path(sess, src);
+	if (top == XTAF_NO_NODE) {
+		fprintf(stderr, "frag: path not found: %s\n", src);
+		return(ENOENT);
+	}
+	error = tree_usage(sess, top, &use, &list, &nlist);
+	if (error) {
+		fprintf(stderr, "frag: %s\n", strerror(error));
+		return(1);
+	}
+	/* files to the front of list, directories counted on the way */
+	for (i = 0; i < nlist; i++) {
+		n = list[i];
+		u = &use[n];
+		if (xtaf_is_dir(sess->vol, n)) {
+			fragdirs += u->chain > 1;
 			continue;
-		else if (!strcmp(part, "..")) {
-			clust = find_dot_entry(dot_table, clust);
-			if (clust == DOT_NOT_FOUND) {
-				de.fnl = 0;
-				return(de);
-			}
-			de.fnl = 1;
-			de.fstart = clust;
-		} else {
-			de = get_entry(info, clust, part);
-			if (de.fnl == 0)
-				return(de);
-			clust = de.fstart;
 		}
+		list[nfiles++] = n;
+		withdata += u->chain > 0;
+		fragfiles += u->chain > 1;
+		fileext += u->chain;
+	}
+	printf("files        = %u, %u with data\n", nfiles, withdata);
+	printf("fragmented   = %u (%.1f%%)\n", fragfiles,
+	    withdata > 0 ? 100.0 * fragfiles / withdata : 0.0);
+	printf("extents      = %u (%.2f per file with data)\n", fileext,
+	    withdata > 0 ? (double)fileext / withdata : 0.0);
+	printf("directories  = %u, %u fragmented\n", use[top].dirs,
+	    fragdirs);
+	if (use[top].broken > 0)
+		printf("broken       = %u chains\n", use[top].broken);
+
+	sort_use = use;
+	qsort(list, nfiles, sizeof(uint32_t), cmp_extents);
+	if (nworst > 0 && nfiles > 0 && use[list[0]].chain > 1)
+		printf(" extents       allocated path\n");
+	for (i = 0; i < nfiles && i < (uint32_t)nworst &&
+	    use[list[i]].chain > 1; i++) {
+		usage_path(sess, top, list[i], src, path);
+		printf("%8u %15llu %s\n", use[list[i]].chain,
+		    (unsigned long long)use[list[i]].alloc, path);
 	}
-	return(de);
+	free(use);
+	free(list);
+	return(0);
 }
 
-int ls(struct info_s *info, struct dot_table_s **dot_table) {
-	struct direntry_s de;
-	char fname[43];
-	struct datetime_s da, dc, du;
-	int i, entry;
-	size_t s;
-	FILE *f;
-	struct fat_s *fatptr;
-	int freq[256];
-	uint32_t clust;
+/* a deleted file or directory, see scan_deleted() */
+struct deleted_s {
+	struct xtaf_node de; /* only fstart, fsize, attr and dati are used */
+	char *path;
+	int isdir;
+	uint32_t need; /* clusters for the size, 1 for a directory */
+	uint32_t nfree; /* free clusters from fstart on, at most need */
+};
 
-	for (i = 0; i < 256; i++)
-		freq[i] = 0;
+/* the state shared by the threads of scan_deleted() */
+struct delscan_s {
+	struct session_s *sess;
+	const uint32_t *inuse; /* see xtaf_usage() */
+	uint8_t *seen; /* directory clusters read */
+	struct deleted_s *del; /* under mtx */
+	uint32_t ndel;
+	uint32_t adel;
+	uint32_t next; /* next entry to look at for a directory to read */
+	int busy; /* threads reading a directory */
+	int nomem;
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+};
 
-	f = fopen(info->imagename, "rb");
-	if (f == NULL) {
-		fprintf(stderr, "Error opening %s: %i\n",
-		    info->imagename, errno);
-		return(errno);
+int cluster_free(struct delscan_s *ds, uint32_t c) {
+	return(c >= 2 && c <= ds->sess->info.geom.maxcluster &&
+	    !((ds->inuse[c / 32] >> (c % 32)) & 1));
+}
+
+/*
+ * Add the deleted entry de named name in the directory at dirpath, with mtx
+ * held.  A name which cannot be a file name gets its bad bytes replaced.
+ * The clusters it needs are checked against the free bitmap, assuming
+ * they were consecutive.
+ */
+void add_deleted(struct delscan_s *ds, const struct xtaf_node *de,
+    const char *name, const char *dirpath) {
+	struct deleted_s *d;
+	uint64_t csize;
+	char fname[43], *p;
+	uint32_t c;
+
+	if (ds->ndel == ds->adel) {
+		d = realloc(ds->del, (ds->adel + 256) *
+		    sizeof(struct deleted_s));
+		if (d == NULL) {
+			ds->nomem = 1;
+			return;
+		}
+		ds->del = d;
+		ds->adel += 256;
 	}
-	clust = (info->pwd - info->rootstart) / info->bootinfo.spc + 1;
-	for (fatptr = build_fat_chain(f, info, clust, 512 * info->bootinfo.spc);
-	    fatptr != NULL; fatptr = fatptr->next) {
-		fseek(f, (uint64_t)(512 * fatptr->nextval), SEEK_SET);
-
-		printf("entry fnl rhsvda startclust   filesize    "
-		    "create_date_time    access_date_time    update_date_time "
-		    "filename\n");
-		for (entry = 0; entry < info->bootinfo.spc; entry++) {
-			s = fread(&de, sizeof(struct direntry_s), 1, f);
-			if (s != 1) {
-				fprintf(stderr, "ls: s = %i\n", s);
-				return(1);
-			}
+	snprintf(fname, sizeof(fname), "%s", name);
+	if (*fname == '\0' || !strcmp(fname, ".") || !strcmp(fname, ".."))
+		snprintf(fname, sizeof(fname), "_");
+	for (p = fname; *p != '\0'; p++)
+		if (*p == '/')
+			*p = '_';
+	d = &ds->del[ds->ndel];
+	d->de = *de;
+	d->isdir = (de->attr & 16) != 0;
+	d->path = malloc(strlen(dirpath) + strlen(fname) + 2);
+	if (d->path == NULL) {
+		ds->nomem = 1;
+		return;
+	}
+	sprintf(d->path, "%s/%s", dirpath, fname);
+	csize = 512 * ds->sess->info.geom.spc;
+	d->need = d->isdir ? 1 : de->fsize / csize + (de->fsize % csize > 0);
+	if (de->fstart == 0)
+		d->need = 0;
+	for (c = 0; c < d->need && cluster_free(ds, de->fstart + c); c++)
+		;
+	d->nfree = c;
+	ds->ndel++;
+}
 
-			if (de.fnl == 0 || de.fnl == 0xff)
-				continue; /* to next slot */
-
-			de.fstart = bswap32(de.fstart);
-			de.fsize = bswap32(de.fsize);
-			bzero(fname, 43 * sizeof(char));
-			if (de.fnl == 0xe5)
-				for (i = 0; i < 42; i++) {
-					fname[i] = de.name[i];
-					if (de.name[i] == 0x00 ||
-					    (de.name[i] & 0xff) == 0xff) {
-						fname[i] = 0;
-						break;
-					}
-				}
-			else
-				strncpy(fname, de.name, de.fnl);
-			dc = dosdati(bswap16(de.cdate), bswap16(de.ctime));
-			da = dosdati(bswap16(de.adate), bswap16(de.atime));
-			du = dosdati(bswap16(de.udate), bswap16(de.utime));
-			printf("%5u %3u %c%c%c%c%c%c %10u %10u %04u-%02u-%02u "
-			    "%02u:%02u:%02u %04u-%02u-%02u %02u:%02u:%02u "
-			    "%04u-%02u-%02u %02u:%02u:%02u %s\n",
-			    entry, de.fnl,
-			    (de.attr & 1 ? 'r' : '-'),
-			    (de.attr & 2 ? 'h' : '-'),
-			    (de.attr & 4 ? 's' : '-'),
-			    (de.attr & 8 ? 'v' : '-'),
-			    (de.attr & 16 ? 'd' : '-'),
-			    (de.attr & 32 ? 'a' : '-'),
-			    de.fstart, de.fsize, dc.year, dc.month, dc.day,
-			    dc.hour, dc.minute, dc.second, da.year, da.month,
-			    da.day, da.hour, da.minute, da.second, du.year,
-			    du.month, du.day, du.hour, du.minute, du.second,
-			    fname);
-
-			if (de.fnl != 0xe5 && de.attr & 16)
-				add_dot_entry(dot_table, de.fstart, clust, 1);
-
-			for (i = 0; i < strlen(fname); i++)
-				freq[(uint8_t)fname[i]] = 1;
-		}
-	}
-	fclose(f);
+/*
+ * Read the first cluster of a deleted directory and add what it holds,
+ * every entry in it is gone as well.  Slots which do not look like an
+ * entry, as the cluster may have been used and freed since, are skipped.
+ */
+int read_deleted_dir(struct delscan_s *ds, uint32_t fstart, char *path) {
+	struct xtaf_geom *g = &ds->sess->info.geom;
+	struct xtaf_node de;
+	uint64_t off, csize;
+	uint8_t *dir, *p;
+	char fname[43];
+	uint32_t slot;
+	int i;
 
-	printf("file name characters: ");
-	for (i = 0; i < 256; i++)
-		if (freq[i] == 1)
-			printf("%4i", i);
-	printf("\n");
+	csize = 512 * g->spc;
+	off = ((uint64_t)(fstart - 1) * g->spc + g->rootstart) * 512;
+	dir = malloc(csize);
+	if (dir == NULL)
+		return(ENOMEM);
+	if (pread(xtaf_fd(ds->sess->vol), dir, csize, off) != (ssize_t)csize) {
+		free(dir);
+		return(EIO);
+	}
+	xtaf_count_read(ds->sess->vol, off, csize, XTAF_IO_DIR);
+	pthread_mutex_lock(&ds->mtx);
+	for (slot = 0; slot < csize / 64; slot++) {
+		p = dir + slot * 64;
+		if (p[0] == 0x00 || p[0] == 0xff || (p[0] > 42 &&
+		    p[0] != 0xe5) || (p[1] & ~0x3f) != 0)
+			continue;
+		bzero(&de, sizeof(struct xtaf_node));
+		bzero(fname, sizeof(fname));
+		for (i = 0; i < 42 && (p[0] == 0xe5 || i < p[0]); i++) {
+			if (p[2 + i] == 0x00 || p[2 + i] == 0xff)
+				break;
+			fname[i] = p[2 + i];
+		}
+		de.slot = slot;
+		de.fnl = 0xe5;
+		de.attr = p[1];
+		de.fstart = (uint32_t)p[44] << 24 | p[45] << 16 | p[46] << 8 |
+		    p[47];
+		de.fsize = (uint32_t)p[48] << 24 | p[49] << 16 | p[50] << 8 |
+		    p[51];
+		for (i = 0; i < 6; i++)
+			de.dati[i] = p[52 + 2 * i] << 8 | p[53 + 2 * i];
+		if (de.fstart > g->maxcluster)
+			continue;
+		add_deleted(ds, &de, fname, path);
+	}
+	pthread_mutex_unlock(&ds->mtx);
+	free(dir);
 	return(0);
 }
 
-void show_info(struct info_s *info) {
-	int i;
+/*
+ * Take deleted directories whose first cluster is free and read them,
+ * until none are left and no other thread can add any.
+ */
+void *delscan_worker(void *arg) {
+	struct delscan_s *ds = arg;
+	struct deleted_s *d;
+	uint32_t fstart;
+	char *path;
+
+	pthread_mutex_lock(&ds->mtx);
+	for (;;) {
+		if (ds->next == ds->ndel) {
+			if (ds->busy == 0 || ds->nomem)
+				break;
+			pthread_cond_wait(&ds->cv, &ds->mtx);
+			continue;
+		}
+		d = &ds->del[ds->next++];
+		if (!d->isdir || d->nfree == 0 ||
+		    ds->seen[d->de.fstart / 8] & (1 << (d->de.fstart % 8)))
+			continue;
+		ds->seen[d->de.fstart / 8] |= 1 << (d->de.fstart % 8);
+		fstart = d->de.fstart;
+		path = d->path; /* d moves when del grows */
+		ds->busy++;
+		pthread_mutex_unlock(&ds->mtx);
+		if (read_deleted_dir(ds, fstart, path))
+			fprintf(stderr, "scan-deleted: cannot read %s\n", path);
+		pthread_mutex_lock(&ds->mtx);
+		ds->busy--;
+		pthread_cond_broadcast(&ds->cv);
+	}
+	pthread_cond_broadcast(&ds->cv);
+	pthread_mutex_unlock(&ds->mtx);
+	return(NULL);
+}
 
-	printf("magic        = ");
-	for (i = 0; i < 4; i++)
-		printf("%c", info->bootinfo.magic[i]);
-	printf("\n");
-	printf("volid        = 0x%08x\n", info->bootinfo.volid);
-	printf("spc          = %u\n", info->bootinfo.spc);
-	printf("nfat         = %u\n", info->bootinfo.nfat);
-	printf("zero         = %u\n", info->bootinfo.zero);
-	printf("pwd          = %u sectors  @ 0x%llx bytes\n", info->pwd,
-	    (uint64_t)info->pwd * 512);
-	printf("fatmask      = 0x%08x\n", info->fatmask);
-	printf("%u bits\n", info->fatmult * 8);
-	printf("fatstart     = %u sectors  @ 0x%llx bytes\n", info->fatstart,
-	    (uint64_t)info->fatstart * 512);
-	printf("fatsize      = %u bytes\n", info->fatsize);
-	printf("rootstart    = %u sectors  @ 0x%llx bytes\n", info->rootstart,
-	    (uint64_t)(info->rootstart * 512));
-	printf("firstcluster = %u sectors  @ 0x%llx bytes\n",
-	    info->firstcluster, (uint64_t)(info->firstcluster * 512));
-	printf("maxcluster   = %u clusters @ 0x%llx bytes\n", info->maxcluster,
-	    (uint64_t)(info->maxcluster * 512 * info->bootinfo.spc));
-	printf("numclusters  = %u\n", info->numclusters);
-	printf("mediasize    = %llu bytes\n", info->mediasize);
-	printf("fatsecs      = %u sectors\n", info->fatsecs);
-	printf("image name   = %s\n", info->imagename);
+int cmp_deleted(const void *a, const void *b) {
+	return(strcmp(((const struct deleted_s *)a)->path,
+	    ((const struct deleted_s *)b)->path));
 }
 
-void cd(char *argv, struct info_s *info, struct dot_table_s *dot_table) {
-	struct direntry_s de;
+void free_deleted(struct delscan_s *ds) {
+	uint32_t i;
 
-	de = resolve_path(info, dot_table, argv);
-	if (de.fnl == 0)
-		fprintf(stderr, "cd: pathname not found: %s\n", argv);
-	else if (de.fstart < 2)
-		info->pwd = info->rootstart; /* use 0 or 1 for root directory */
+	for (i = 0; i < ds->ndel; i++)
+		free(ds->del[i].path);
+	free(ds->del);
+	free(ds->seen);
+}
+
+/*
+ * Find all deleted entries: those in the index, and those in deleted
+ * directories whose first cluster is still free, which are read by a pool
+ * of threads as they turn up.  The result is sorted by path.
+ */
+int scan_deleted(struct session_s *sess, struct delscan_s *ds, int nthreads) {
+	struct xtaf_index *idx = &sess->index;
+	struct xtaf_usage u;
+	pthread_t *tids;
+	char path[PATH_MAX];
+	uint32_t n;
+	int error, i;
+
+	bzero(ds, sizeof(struct delscan_s));
+	ds->sess = sess;
+	error = xtaf_usage(sess->vol, &u, &ds->inuse);
+	if (error)
+		return(error);
+	ds->seen = calloc(sess->info.geom.maxcluster / 8 + 1, 1);
+	tids = calloc(nthreads, sizeof(pthread_t));
+	if (ds->seen == NULL || tids == NULL) {
+		free(ds->seen);
+		free(tids);
+		return(ENOMEM);
+	}
+	for (n = 0; n < idx->nnodes && !ds->nomem; n++)
+		if (idx->nodes[n].fnl == 0xe5 &&
+		    !node_path(idx, XTAF_ROOT, idx->nodes[n].parent, "", path))
+			add_deleted(ds, &idx->nodes[n],
+			    idx->pool + idx->nodes[n].name, path);
+
+	pthread_mutex_init(&ds->mtx, NULL);
+	pthread_cond_init(&ds->cv, NULL);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&tids[i], NULL, delscan_worker, ds))
+			break;
+	if (i == 0)
+		delscan_worker(ds);
+	while (--i >= 0)
+		pthread_join(tids[i], NULL);
+	pthread_cond_destroy(&ds->cv);
+	pthread_mutex_destroy(&ds->mtx);
+	free(tids);
+	if (ds->nomem) {
+		free_deleted(ds);
+		return(ENOMEM);
+	}
+	qsort(ds->del, ds->ndel, sizeof(struct deleted_s), cmp_deleted);
+	return(0);
+}
+
+/*
+ * Turn src into the path of scan_deleted(), from the root and without a
+ * trailing /, "" for the root itself.
+ */
+int deleted_prefix(struct session_s *sess, char *src, char *prefix) {
+	char pwd[PATH_MAX];
+	size_t len;
+
+	if (*src == '/')
+		len = snprintf(prefix, PATH_MAX, "%s", src);
+	else if (node_path(&sess->index, XTAF_ROOT, sess->pwdnode, "", pwd))
+		return(1);
 	else
-		info->pwd = (de.fstart - 1) * info->bootinfo.spc +
-		    info->rootstart;
+		len = snprintf(prefix, PATH_MAX, "%s/%s", pwd, src);
+	if (len >= PATH_MAX)
+		return(1);
+	while (len > 0 && prefix[len - 1] == '/')
+		prefix[--len] = '\0';
+	return(0);
+}
 
-	fprintf(stderr, "new pwd = %u sectors @ 0x%llx bytes\n", info->pwd,
-	    (uint64_t)(info->pwd * 512));
+/* is path the same as prefix or below it */
+int below(char *path, char *prefix, size_t len) {
+	return(!strncmp(path, prefix, len) &&
+	    (path[len] == '\0' || path[len] == '/'));
 }
 
-int cat(char *argv, struct info_s *info, struct dot_table_s *dot_table) {
-	size_t s;
-	FILE *f;
-	struct fat_s *fatptr;
-	char *buf;
-	struct direntry_s de;
-	uint32_t rest;
+/*
+ * List the deleted entries at or below src whose first cluster is still
+ * free: intact if all clusters the size needs are free, assuming they
+ * were consecutive, partial if only the first nfree are.
+ */
+int show_deleted(struct session_s *sess, char *src, int nthreads) {
+	struct delscan_s ds;
+	struct deleted_s *d;
+	char prefix[PATH_MAX];
+	uint32_t i, intact = 0, partial = 0, gone = 0, empty = 0;
+	size_t len;
+	int error;
+
+	if (deleted_prefix(sess, src, prefix)) {
+		fprintf(stderr, "scan-deleted: bad path %s\n", src);
+		return(1);
+	}
+	len = strlen(prefix);
+	error = scan_deleted(sess, &ds, nthreads);
+	if (error) {
+		fprintf(stderr, "scan-deleted: %s\n", strerror(error));
+		return(1);
+	}
+	printf("status  startclust   filesize   free/need path\n");
+	for (i = 0; i < ds.ndel; i++) {
+		d = &ds.del[i];
+		if (!below(d->path, prefix, len))
+			continue;
+		if (d->need == 0) {
+			empty++;
+			continue;
+		}
+		if (d->nfree == 0) {
+			gone++;
+			continue;
+		}
+		if (d->nfree == d->need)
+			intact++;
+		else
+			partial++;
+		printf("%-7s %10u %10u %5u/%-5u %s%s\n",
+		    d->nfree == d->need ? "intact" : "partial", d->de.fstart,
+		    d->de.fsize, d->nfree, d->need, d->path,
+		    d->isdir ? "/" : "");
+	}
+	fprintf(stderr, "scan-deleted: %u intact, %u partial, %u overwritten, "
+	    "%u empty\n", intact, partial, gone, empty);
+	free_deleted(&ds);
+	return(0);
+}
 
-	de = resolve_path(info, dot_table, argv);
-	if (de.fnl == 0) {
-		fprintf(stderr, "cat: path not found: %s\n", argv);
-		return(ENOENT);
+/*
+ * Create the directories leading to path below destdir.
+ */
+int make_parents(char *path, size_t destlen) {
+	char *p;
+	int ret = 0;
+
+	for (p = path + destlen + 1; ret == 0 &&
+	    (p = strchr(p, '/')) != NULL; p++) {
+		*p = '\0';
+		if (mkdir(path, 0755) == -1 && errno != EEXIST)
+			ret = 1;
+		*p = '/';
 	}
-	rest = de.fsize % (512 * info->bootinfo.spc);
+	return(ret);
+}
 
-	f = fopen(info->imagename, "rb");
-	if (f == NULL) {
-		fprintf(stderr, "Error opening %s: %i\n",
-		    info->imagename, errno);
+/* by start cluster, see undelete() */
+int cmp_deleted_fstart(const void *a, const void *b) {
+	const struct deleted_s *da = *(struct deleted_s * const *)a;
+	const struct deleted_s *db = *(struct deleted_s * const *)b;
+
+	return(da->de.fstart < db->de.fstart ? -1 :
+	    da->de.fstart > db->de.fstart);
+}
+
+/*
+ * Recover the deleted entries at or below src into destdir, as found by
+ * scan_deleted().  A file is read as one run of clusters from its start
+ * cluster, and only if all of them are still free, partial ones are
+ * skipped.  Names clashing with one recovered before get the start cluster
+ * appended.
+ */
+int undelete(struct session_s *sess, char *src, char *destdir,
+    int nthreads) {
+	struct delscan_s ds;
+	struct deleted_s *d, **files;
+	struct xtaf_extent ext;
+	struct reader_s rd;
+	char prefix[PATH_MAX], path[PATH_MAX], *rel;
+	uint32_t i, nfiles = 0, ndirs = 0, skipped = 0, failed = 0;
+	size_t len, destlen;
+	int error, fd;
+
+	if (deleted_prefix(sess, src, prefix)) {
+		fprintf(stderr, "undelete: bad path %s\n", src);
+		return(1);
+	}
+	len = strlen(prefix);
+	destlen = strlen(destdir);
+	if (mkdir(destdir, 0755) == -1 && errno != EEXIST) {
+		fprintf(stderr, "undelete: mkdir %s: %i\n", destdir, errno);
 		return(errno);
 	}
-	buf = calloc(512 * info->bootinfo.spc, sizeof(char));
-	for (fatptr = build_fat_chain(f, info, de.fstart, de.fsize);
-	    fatptr != NULL; fatptr = fatptr->next) {
-		fseek(f, (uint64_t)(512 * fatptr->nextval), SEEK_SET);
+	error = scan_deleted(sess, &ds, nthreads);
+	if (error) {
+		fprintf(stderr, "undelete: %s\n", strerror(error));
+		return(1);
+	}
+	files = malloc((ds.ndel + 1) * sizeof(struct deleted_s *));
+	if (files == NULL || reader_open(sess, 1, &rd)) {
+		free(files);
+		free_deleted(&ds);
+		return(1);
+	}
 
-		s = fread(buf, sizeof(char), 512 * info->bootinfo.spc, f);
-		if (s != 512 * info->bootinfo.spc) {
-			fprintf(stderr, "cat: s = %i\n", s);
-			return(1);
+	/* directories in path order, so parents come first */
+	for (i = 0; i < ds.ndel; i++) {
+		d = &ds.del[i];
+		if (!below(d->path, prefix, len))
+			continue;
+		if (d->nfree < d->need) {
+			skipped++;
+			continue;
+		}
+		if (!d->isdir) {
+			files[nfiles++] = d;
+			continue;
 		}
-		fwrite(buf, sizeof(char), fatptr->next != NULL || rest == 0 ?
-		    512 * info->bootinfo.spc : rest, stdout);
+		/* the contents of a directory src go straight to destdir */
+		rel = d->path[len] == '\0' ? "" : d->path + len;
+		if (snprintf(path, PATH_MAX, "%s%s", destdir, rel) >=
+		    PATH_MAX || make_parents(path, destlen) ||
+		    (mkdir(path, 0755) == -1 && errno != EEXIST)) {
+			fprintf(stderr, "undelete: cannot create %s\n", path);
+			failed++;
+		} else
+			ndirs++;
 	}
-	fclose(f);
-	return(0);
+
+	qsort(files, nfiles, sizeof(struct deleted_s *), cmp_deleted_fstart);
+	for (i = 0; i < nfiles; i++) {
+		d = files[i];
+		rel = d->path[len] == '\0' ? strrchr(d->path, '/') :
+		    d->path + len;
+		if (snprintf(path, PATH_MAX - 12, "%s%s", destdir, rel) >=
+		    PATH_MAX - 12 || make_parents(path, destlen)) {
+			fprintf(stderr, "undelete: cannot create %s\n", path);
+			failed++;
+			continue;
+		}
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd == -1 && errno == EEXIST) {
+			sprintf(path + strlen(path), ".%u", d->de.fstart);
+			fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		}
+		if (fd == -1) {
+			fprintf(stderr, "undelete: open %s: %i\n", path, errno);
+			failed++;
+			continue;
+		}
+		ext.sector = (d->de.fstart - 1) * sess->info.geom.spc +
+		    sess->info.geom.rootstart;
+		ext.nclust = d->need;
+		if (d->need > 0 && copy_extents(sess, &ext, 1, d->de.fsize,
+		    fd, &rd)) {
+			fprintf(stderr, "undelete: %s failed\n", path);
+			failed++;
+		}
+		close(fd);
+		set_times(&d->de, path);
+	}
+
+	fprintf(stderr, "undelete: %u files, %u directories, %u skipped, "
+	    "%u failed\n", nfiles, ndirs, skipped, failed);
+	reader_close(&rd);
+	free(files);
+	free_deleted(&ds);
+	return(failed > 0);
 }
 
-void show_dot_table(struct dot_table_s *dot_table) {
-	struct dot_table_s *dot;
+/*
+ * Fill the dot table from the index, it is not saved in INFONAME.
+ */
+int need_dots(struct session_s *sess) {
+	struct xtaf_index *idx = &sess->index;
+	uint32_t n;
+
+	stats_mem(sess->dots.ht_count > 0);
+	if (sess->dots.ht_count > 0)
+		return(0);
+	for (n = 0; n < idx->nnodes; n++)
+		if (xtaf_is_dir(sess->vol, n) && dot_table_add(&sess->dots,
+		    idx->nodes[n].fstart,
+		    idx->nodes[idx->nodes[n].parent].fstart)) {
+			fprintf(stderr, "need_dots: out of memory\n");
+			return(1);
+		}
+	return(0);
+}
 
+/*
+ * Show the start cluster of every directory and the one of its parent, or
+ * only the parent of directory cluster arg.
+ */
+int show_dot_table(struct session_s *sess, char *arg) {
+	struct xtaf_index *idx = &sess->index;
+	uint32_t n, dot;
+
+	if (arg != NULL) {
+		if (need_dots(sess))
+			return(1);
+		n = strtoul(arg, NULL, 0);
+		dot = dot_table_find(&sess->dots, n);
+		if (dot == DOT_NOT_FOUND) {
+			fprintf(stderr, "dot: no directory at cluster %s\n",
+			    arg);
+			return(ENOENT);
+		}
+		printf("%u\t%u\n", n, dot);
+		return(0);
+	}
 	printf("this\tparent\n");
-	for (dot = dot_table; dot != NULL; dot = dot->next)
-		printf("%u\t%u\n", dot->this, dot->parent);
+	for (n = 0; n < idx->nnodes; n++)
+		if (xtaf_is_dir(sess->vol, n))
+			printf("%u\t%u\n", idx->nodes[n].fstart,
+			    idx->nodes[idx->nodes[n].parent].fstart);
+	return(0);
 }
 
 int usage(void) {
@@ -616,99 +2143,283 @@ int usage(void) {
 	return(1);
 }
 
-void read_infofile(struct info_s *info, struct dot_table_s **dot_table) {
-	FILE *infofile;
-	size_t s = 0;
-	uint32_t this, parent;
-
-	infofile = fopen(INFONAME, "rb");
-	if (infofile == NULL) {
-		fprintf(stderr, "Error opening %s: %i\n",
-		    info->imagename, errno);
-		exit(errno);
-	}
-	if (infofile != NULL) {
-		s = fread(info, sizeof(struct info_s), 1, infofile);
-		if (s != 1) {
-			printf("Could not read %s, aborting.\n", INFONAME);
-			exit(1);
-		}
-		/* read dot_table */
-		*dot_table = NULL;
-		while (!feof(infofile)) {
-			s = fread(&this, sizeof(uint32_t), 1, infofile);
-			if (s == 1)
-				s = fread(&parent, sizeof(uint32_t), 1, infofile);
-			if (s == 1)
-				add_dot_entry(dot_table, this, parent, 0);
-		}
-		fclose(infofile);
-	} else {
+/*
+ * Map INFONAME as written by write_infofile().
+ */
+void read_infofile(struct session_s *sess) {
+	struct index_hdr_s *hdr;
+	struct xtaf_index idx;
+	struct stat st;
+	double start;
+	int fd, error;
+	void *map;
+
+	start = stats_now();
+	fd = open(INFONAME, O_RDONLY);
+	if (fd == -1) {
 		printf("%s does not exist, use attach command.\n", INFONAME);
 		exit(ENOENT);
 	}
-
+	if (fstat(fd, &st) == -1 ||
+	    st.st_size < sizeof(struct index_hdr_s)) {
+		printf("Could not read %s, aborting.\n", INFONAME);
+		exit(1);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Could not map %s: %i\n", INFONAME, errno);
+		exit(errno);
+	}
+	hdr = map;
+	if (strncmp(hdr->magic, INDEX_MAGIC, 4) ||
+	    hdr->version != INDEX_VERSION ||
+	    hdr->hdrsize != sizeof(struct index_hdr_s) ||
+	    hdr->nodesize != sizeof(struct xtaf_node) ||
+	    hdr->nnodes == 0 || hdr->pwdnode >= hdr->nnodes ||
+	    st.st_size != sizeof(struct index_hdr_s) +
+	    (uint64_t)hdr->nnodes * sizeof(struct xtaf_node) + hdr->poolsize) {
+		printf("%s is damaged or from another uxtaf version, "
+		    "attach again.\n", INFONAME);
+		exit(1);
+	}
+	sess->info = hdr->info;
+	sess->pwdnode = hdr->pwdnode;
+	sess->map = map;
+	sess->maplen = st.st_size;
+	idx.nodes = (struct xtaf_node *)(hdr + 1);
+	idx.nnodes = hdr->nnodes;
+	idx.pool = (char *)(idx.nodes + hdr->nnodes);
+	idx.poolsize = hdr->poolsize;
+	error = xtaf_open_index(sess->info.imagename, &sess->info.geom, &idx,
+	    tracefile != NULL ? &tracer : NULL, &sess->vol);
+	if (error) {
+		fprintf(stderr, "Could not open %s: %s\n",
+		    sess->info.imagename, strerror(error));
+		exit(error);
+	}
+	sess->index = idx;
+	stats_mem(1); /* the index does not have to be built */
+	stats_phase(PH_INFOFILE, start);
 }
 
-void write_infofile(struct info_s *info, struct dot_table_s **dot_table) {
+/*
+ * Save the session.  If the index came from INFONAME it is still there and
+ * only the header (with curdir) has to be rewritten.
+ */
+void write_infofile(struct session_s *sess) {
 	FILE *infofile;
-	struct dot_table_s *dot, *tmp;
+	struct index_hdr_s hdr;
+	double start;
 	size_t s = 0;
 
-	infofile = fopen(INFONAME, "wb");
+	start = stats_now();
+	bzero(&hdr, sizeof(struct index_hdr_s));
+	memcpy(hdr.magic, INDEX_MAGIC, 4);
+	hdr.version = INDEX_VERSION;
+	hdr.hdrsize = sizeof(struct index_hdr_s);
+	hdr.nodesize = sizeof(struct xtaf_node);
+	hdr.nnodes = sess->index.nnodes;
+	hdr.poolsize = sess->index.poolsize;
+	hdr.pwdnode = sess->pwdnode;
+	hdr.info = sess->info;
+
+	infofile = fopen(INFONAME, sess->map != NULL ? "r+b" : "wb");
 	if (infofile == NULL) {
 		fprintf(stderr, "Could not open %s for writing.\n", INFONAME);
 		exit(errno);
 	}
-	s = fwrite(info, sizeof(struct info_s), 1, infofile);
+	s = fwrite(&hdr, sizeof(struct index_hdr_s), 1, infofile);
+	if (s == 1 && sess->map == NULL) {
+		s = fwrite(sess->index.nodes, sizeof(struct xtaf_node),
+		    sess->index.nnodes, infofile) == sess->index.nnodes;
+		if (s == 1)
+			s = fwrite(sess->index.pool, sizeof(char),
+			    sess->index.poolsize, infofile) ==
+			    sess->index.poolsize;
+	}
 	if (s != 1)
 		fprintf(stderr, "Could not save info.\n");
-	else {
-		/* write/clean dot table */
-		for (dot = *dot_table; dot != NULL; ) {
-			fwrite(&(dot->this), sizeof(uint32_t), 1, infofile);
-			fwrite(&(dot->parent), sizeof(uint32_t), 1, infofile);
-			tmp = dot;
-			dot = dot->next;
-			free(tmp);
-		}
-	}
 	fclose(infofile);
+	stats_phase(PH_INFOFILE, start);
 }
 
-int main(int argc, char *argv[]) {
-	struct info_s info;
-	struct dot_table_s *dot_table;
+/*
+ * One thread per CPU, but at least one.
+ */
+int default_threads(void) {
+	long ncpu;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	return(ncpu > 0 ? ncpu : 1);
+}
+
+/*
+ * Run one command, argv[0] being its name.  Returns -1 for an unknown
+ * command or wrong number of arguments.
+ */
+int run_command(struct session_s *sess, int argc, char *argv[]) {
+	double start;
 	int ret = 0;
-	int i;
 
-	if (argc < 2)
-		return(usage());
+	start = stats_now();
+
+	if (!strcmp(argv[0], "attach") && argc == 2)
+		ret = attach(sess, argv[1]);
+	else if (!strcmp(argv[0], "info") && argc == 1)
+		show_info(&sess->info);
+	else if (!strcmp(argv[0], "df") && argc == 1)
+		ret = df(sess);
+	else if (!strcmp(argv[0], "dot") && argc <= 2)
+		ret = show_dot_table(sess, argc == 2 ? argv[1] : NULL);
+	else if (!strcmp(argv[0], "du") && argc == 2)
+		ret = du(sess, argv[1], 0);
+	else if (!strcmp(argv[0], "du") && argc == 3 && !strcmp(argv[1], "-r"))
+		ret = du(sess, argv[2], 1);
+	else if (!strcmp(argv[0], "frag") && argc == 2)
+		ret = frag(sess, argv[1], FRAG_WORST);
+	else if (!strcmp(argv[0], "frag") && argc == 4 &&
+	    !strcmp(argv[1], "-n") && atoi(argv[2]) >= 0)
+		ret = frag(sess, argv[3], atoi(argv[2]));
+	else if (!strcmp(argv[0], "scan-deleted") && argc <= 2)
+		ret = show_deleted(sess, argc == 2 ? argv[1] : "/",
+		    default_threads());
+	else if (!strcmp(argv[0], "undelete") && argc == 3)
+		ret = undelete(sess, argv[1], argv[2], default_threads());
+	else if (!strcmp(argv[0], "ls") && argc == 1)
+		ret = ls(sess);
+	else if (!strcmp(argv[0], "cat") && argc == 2)
+		ret = cat(sess, argv[1]);
+	else if (!strcmp(argv[0], "tar") && argc == 2)
+		ret = tar(sess, argv[1]);
+	else if (!strcmp(argv[0], "cd") && argc == 2)
+		cd(sess, argv[1]);
+	else if (!strcmp(argv[0], "extract") && argc == 3)
+		ret = extract(sess, argv[1], argv[2], default_threads());
+	else if (!strcmp(argv[0], "extract") && argc == 5 &&
+	    !strcmp(argv[1], "-j") && atoi(argv[2]) > 0)
+		ret = extract(sess, argv[3], argv[4], atoi(argv[2]));
+	else if (!strcmp(argv[0], "extract") && argc == 4 &&
+	    !strcmp(argv[1], "-s"))
+		ret = extract(sess, argv[2], argv[3], 0);
+	else
+		ret = -1;
+	stats_phase(PH_COMMAND, start);
+	return(ret);
+}
 
-	if (strcmp(argv[1], "attach"))
-		read_infofile(&info, &dot_table);
-
-	if (!strcmp(argv[1], "attach") && argc == 3) {
-		for (i = 0; i < 255 && i < strlen(argv[2]); i++)
-			info.imagename[i] = argv[2][i];
-		info.imagename[i] = '\0';
-		ret = attach(&info, &dot_table);
-	} else if (!strcmp(argv[1], "info") && argc == 2)
-		show_info(&info);
-	else if (!strcmp(argv[1], "dot") && argc == 2)
-		show_dot_table(dot_table);
-	else if (!strcmp(argv[1], "ls") && argc == 2)
-		ret = ls(&info, &dot_table);
-	else if (!strcmp(argv[1], "cat") && argc == 3)
-		ret = cat(argv[2], &info, dot_table);
-	else if (!strcmp(argv[1], "cd") && argc == 3)
-		cd(argv[2], &info, dot_table);
+/*
+ * Read commands from stdin until EOF or "quit", keeping the image, the FAT
+ * and the directory index in memory in between.  A prompt is only shown when
+ * stdin is a terminal, so scripts can be fed in as well.  The state is
+ * saved at the end, so single commands can continue from there.
+ */
+int shell(struct session_s *sess, char *imagename) {
+	char line[1024], *args[SHELL_MAXARGS], *p, *arg;
+	int argc, interactive, ret, failed = 0;
+
+	if (imagename != NULL)
+		failed = attach(sess, imagename);
 	else
+		read_infofile(sess);
+	if (failed)
+		return(failed);
+
+	interactive = isatty(fileno(stdin));
+	for (;;) {
+		if (interactive) {
+			printf("uxtaf> ");
+			fflush(stdout);
+		}
+		if (fgets(line, sizeof(line), stdin) == NULL)
+			break;
+		argc = 0;
+		for (p = line; (arg = strsep(&p, " \t\r\n")) != NULL; )
+			if (*arg != '\0' && argc < SHELL_MAXARGS)
+				args[argc++] = arg;
+		if (argc == 0 || args[0][0] == '#')
+			continue;
+		if (!strcmp(args[0], "quit") || !strcmp(args[0], "exit"))
+			break;
+		ret = run_command(sess, argc, args);
+		fflush(stdout);
+		if (ret == -1)
+			fprintf(stderr, "%s: unknown command or wrong number "
+			    "of arguments\n", args[0]);
+		if (ret != 0)
+			failed = 1;
+	}
+	if (sess->vol != NULL)
+		write_infofile(sess);
+	return(failed);
+}
+
+/*
+ * Size of the reads done by cat and extract, from UXTAF_BUFSIZE (bytes,
+ * with an optional k or m suffix) or CAT_BUFSIZE.  It is rounded down to
+ * a power of two, so it is a multiple of the cluster size once that is
+ * at most this large.
+ */
+uint32_t get_bufsize(void) {
+	char *env, *end;
+	uint64_t size;
+	uint32_t p;
+
+	env = getenv("UXTAF_BUFSIZE");
+	if (env == NULL)
+		return(CAT_BUFSIZE);
+	size = strtoull(env, &end, 0);
+	if (*end == 'k' || *end == 'K')
+		size *= 1024;
+	else if (*end == 'm' || *end == 'M')
+		size *= 1024 * 1024;
+	if (size < 512 || size > CAT_BUFSIZE_MAX) {
+		fprintf(stderr, "UXTAF_BUFSIZE out of range, using %u\n",
+		    CAT_BUFSIZE);
+		return(CAT_BUFSIZE);
+	}
+	for (p = 512; p * 2 <= size; p *= 2)
+		;
+	return(p);
+}
+
+int main(int argc, char *argv[]) {
+	struct session_s sess;
+	double start;
+	int ret = 0, showstats = 0;
+
+	start = stats_now();
+	open_trace();
+	bzero(&sess, sizeof(struct session_s));
+	for (; argc >= 2 && !strncmp(argv[1], "--", 2); argc--, argv++)
+		if (!strcmp(argv[1], "--stats"))
+			showstats = 1;
+		else if (!strcmp(argv[1], "--direct"))
+			sess.aioflags |= XTAF_AIO_DIRECT;
+		else
+			return(usage());
+	if (argc < 2)
 		return(usage());
 
-	if (ret != 0)
-		fprintf(stderr, "uxtaf: something went wrong, aborting\n");
-	else
-		write_infofile(&info, &dot_table);
+	sess.bufsize = get_bufsize();
+	if (!strcmp(argv[1], "shell") && argc <= 3)
+		ret = shell(&sess, argc == 3 ? argv[2] : NULL);
+	else {
+		if (strcmp(argv[1], "attach"))
+			read_infofile(&sess);
+		ret = run_command(&sess, argc - 1, argv + 1);
+		if (ret == -1)
+			ret = usage();
+		else if (ret != 0)
+			fprintf(stderr, "uxtaf: something went wrong, "
+			    "aborting\n");
+		else
+			write_infofile(&sess);
+	}
+	detach(&sess);
+	stats_phase(PH_TOTAL, start);
+	show_stats(showstats);
+	if (tracefile != NULL)
+		fclose(tracefile);
 	return(ret);
 }
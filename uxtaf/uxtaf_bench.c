@@ -0,0 +1,379 @@
+/*
+Copyright (c) 2007,2008 Rene Ladan <r.c.ladan@gmail.com> All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+
+Benchmarks for the hot paths of uxtaf, see uxtaf.txt.
+
+*/
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*
+ * The image reads are counted by libxtaf, the writes of cat and ls by this,
+ * so each benchmark can report how many system calls it needed.
+ */
+uint64_t bench_writes;
+
+ssize_t bench_write(int fd, const void *buf, size_t len) {
+	bench_writes++;
+	return(write(fd, buf, len));
+}
+
+#define write bench_write
+#define main uxtaf_main
+#include "uxtaf.c"
+#undef main
+#undef write
+
+#define BENCH_DIR "/tmp"
+#define BENCH_MKXTAF "../mkxtaf/mkxtaf"
+
+/* the generated images, see generate() */
+struct gen_s {
+	char *name;
+	char *args[16];
+};
+
+struct gen_s gens[] = {
+	{ "64m", { "-s", "64m", "-c", "32", "-d", "2", "-n", "4", "-F", "8",
+	    NULL } },
+	{ "1g", { "-s", "1g", "-c", "16", "-d", "3", "-n", "6", "-F", "16",
+	    "-M", "512k", NULL } },
+	{ "16g", { "-s", "16g", "-c", "32", "-d", "4", "-n", "6", "-F", "32",
+	    "-M", "256k", "-z", NULL } },
+};
+int fraglevels[] = { 0, 25, 75 };
+
+/* one benchmark run, written as a JSON object */
+struct result_s {
+	char *bench;
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t syscalls;
+	double seconds;
+};
+
+FILE *json;
+int njson;
+volatile uint32_t sink; /* keeps lookups from being optimized away */
+
+double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * System calls so far: the reads of the volumes closed before, of the
+ * attached one and the writes.
+ */
+uint64_t syscalls(struct session_s *sess) {
+	struct xtaf_stats st;
+
+	xtaf_get_stats(sess->vol, &st);
+	return(stats.reads + st.reads + bench_writes);
+}
+
+void start(struct session_s *sess, struct result_s *r, char *bench) {
+	bzero(r, sizeof(struct result_s));
+	r->bench = bench;
+	r->syscalls = syscalls(sess);
+	r->seconds = now();
+}
+
+void report(struct session_s *sess, struct result_s *r, char *image) {
+	struct rusage ru;
+	double secs;
+
+	secs = now() - r->seconds;
+	if (secs <= 0)
+		secs = 1e-9;
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(json, "%s\n  {\"image\": \"%s\", \"bench\": \"%s\", "
+	    "\"ops\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+	    "\"bytes\": %llu, \"mb_per_sec\": %.1f, \"syscalls\": %llu, "
+	    "\"peak_rss_kb\": %ld}", njson++ > 0 ? "," : "", image, r->bench,
+	    (unsigned long long)r->ops, secs, r->ops / secs,
+	    (unsigned long long)r->bytes, r->bytes / secs / (1024 * 1024),
+	    (unsigned long long)(syscalls(sess) - r->syscalls),
+	    (long)ru.ru_maxrss);
+	fflush(json);
+}
+
+/*
+ * Run all benchmarks iter times on image.
+ */
+int bench_image(char *image, int iter) {
+	struct session_s sess;
+	struct xtaf_index *idx;
+	struct xtaf_vol *vol;
+	struct xtaf_stats st;
+	struct xtaf_extent *ext;
+	struct result_s r;
+	struct reader_s rd;
+	char **paths, path[PATH_MAX];
+	uint32_t n, next, nclust;
+	int i, fd, ret = 1;
+
+	bzero(&sess, sizeof(struct session_s));
+	sess.bufsize = get_bufsize();
+	if (attach(&sess, image))
+		return(1);
+	if (reader_open(&sess, 1, &rd)) {
+		detach(&sess);
+		return(1);
+	}
+	idx = &sess.index;
+	paths = calloc(idx->nnodes, sizeof(char *));
+	fd = open("/dev/null", O_WRONLY);
+	if (paths == NULL || fd == -1)
+		goto out;
+	for (n = 1; n < idx->nnodes; n++) {
+		if (node_path(idx, 0, n, "", path) ||
+		    (paths[n] = strdup(path)) == NULL)
+			goto out;
+	}
+
+	/* reading the FAT and every directory from the image, as attach does */
+	start(&sess, &r, "walk");
+	for (i = 0; i < iter; i++) {
+		if (xtaf_open(image, NULL, &vol))
+			goto out;
+		xtaf_get_stats(vol, &st);
+		stats.reads += st.reads;
+		r.ops += idx->nnodes;
+		xtaf_close(vol);
+	}
+	report(&sess, &r, image);
+
+	start(&sess, &r, "extents");
+	for (i = 0; i < iter; i++)
+		for (n = 1; n < idx->nnodes; n++) {
+			if (idx->nodes[n].fnl == 0xe5 ||
+			    idx->nodes[n].fstart == 0)
+				continue;
+			if (xtaf_extents(sess.vol, idx->nodes[n].fstart,
+			    xtaf_is_dir(sess.vol, n) ? 0 :
+			    idx->nodes[n].fsize, &ext, &next, &nclust) == 0) {
+				r.bytes += (uint64_t)nclust * 512 *
+				    sess.info.geom.spc;
+				free(ext);
+			}
+			r.ops++;
+		}
+	report(&sess, &r, image);
+
+	start(&sess, &r, "get_entry");
+	for (i = 0; i < iter; i++)
+		for (n = 1; n < idx->nnodes; n++)
+			if (idx->nodes[n].fnl != 0xe5) {
+				sink += xtaf_get_entry(sess.vol,
+				    idx->nodes[n].parent,
+				    idx->pool + idx->nodes[n].name);
+				r.ops++;
+			}
+	report(&sess, &r, image);
+
+	start(&sess, &r, "resolve_path");
+	for (i = 0; i < iter; i++)
+		for (n = 1; n < idx->nnodes; n++)
+			if (idx->nodes[n].fnl != 0xe5) {
+				sink += resolve_path(&sess, paths[n]);
+				r.ops++;
+			}
+	report(&sess, &r, image);
+
+	/* filling the dot table from the index, then a lookup per directory */
+	start(&sess, &r, "dots");
+	for (i = 0; i < iter; i++) {
+		dot_table_destroy(&sess.dots);
+		if (need_dots(&sess))
+			goto out;
+		for (n = 0; n < idx->nnodes; n++)
+			if (xtaf_is_dir(sess.vol, n)) {
+				sink += dot_table_find(&sess.dots,
+				    idx->nodes[n].fstart);
+				r.ops++;
+			}
+	}
+	report(&sess, &r, image);
+
+	/* stdout is /dev/null, see main() */
+	start(&sess, &r, "ls");
+	for (i = 0; i < iter; i++)
+		for (n = 0; n < idx->nnodes; n++)
+			if (xtaf_is_dir(sess.vol, n) &&
+			    idx->nodes[n].nchild > 0) {
+				sess.pwdnode = n;
+				ls(&sess);
+				r.ops++;
+			}
+	fflush(stdout);
+	report(&sess, &r, image);
+
+	start(&sess, &r, "cat");
+	for (i = 0; i < iter; i++)
+		for (n = 1; n < idx->nnodes; n++)
+			if (!xtaf_is_dir(sess.vol, n) &&
+			    idx->nodes[n].fnl != 0xe5) {
+				if (copy_node(&sess, &idx->nodes[n], fd, &rd))
+					goto out;
+				r.bytes += idx->nodes[n].fsize;
+				r.ops++;
+			}
+	report(&sess, &r, image);
+	ret = 0;
+out:
+	if (fd != -1)
+		close(fd);
+	if (paths != NULL)
+		for (n = 1; n < idx->nnodes; n++)
+			free(paths[n]);
+	free(paths);
+	reader_close(&rd);
+	detach(&sess);
+	return(ret);
+}
+
+/*
+ * Create image with mkxtaf unless it is there already, the images only
+ * depend on the arguments so they can be kept between runs.
+ */
+int generate(char *mkxtaf, char *image, struct gen_s *g, int frag) {
+	char *argv[24], fragarg[12];
+	struct stat st;
+	pid_t pid;
+	int argc, i, status;
+
+	if (stat(image, &st) == 0)
+		return(0);
+	argc = 0;
+	argv[argc++] = mkxtaf;
+	for (i = 0; g->args[i] != NULL; i++)
+		argv[argc++] = g->args[i];
+	snprintf(fragarg, sizeof(fragarg), "%i", frag);
+	argv[argc++] = "-f";
+	argv[argc++] = fragarg;
+	argv[argc++] = image;
+	argv[argc] = NULL;
+	pid = fork();
+	if (pid == -1)
+		return(1);
+	if (pid == 0) {
+		dup2(fileno(stderr), fileno(stdout));
+		execv(mkxtaf, argv);
+		fprintf(stderr, "uxtaf_bench: cannot run %s: %i\n", mkxtaf,
+		    errno);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0) {
+		unlink(image);
+		return(1);
+	}
+	return(0);
+}
+
+int bench_usage(void) {
+	fprintf(stderr, "usage: uxtaf_bench [-n iterations] [-d dir] "
+	    "[-m mkxtaf] [image ...]\n");
+	return(1);
+}
+
+int main(int argc, char *argv[]) {
+	char *dir = BENCH_DIR, *mkxtaf = BENCH_MKXTAF, image[PATH_MAX];
+	int ch, fd, i, f, iter = 3, ret = 0;
+
+	while ((ch = getopt(argc, argv, "d:m:n:")) != -1)
+		switch (ch) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'm':
+			mkxtaf = optarg;
+			break;
+		case 'n':
+			iter = atoi(optarg);
+			if (iter < 1)
+				return(bench_usage());
+			break;
+		default:
+			return(bench_usage());
+		}
+	argc -= optind;
+	argv += optind;
+
+	/* JSON goes to the real stdout, ls and friends to /dev/null */
+	fd = dup(fileno(stdout));
+	json = fd == -1 ? NULL : fdopen(fd, "w");
+	fd = open("/dev/null", O_WRONLY);
+	if (json == NULL || fd == -1 || dup2(fd, fileno(stdout)) == -1) {
+		fprintf(stderr, "uxtaf_bench: cannot set up output\n");
+		return(1);
+	}
+	close(fd);
+
+	fprintf(json, "{\"iterations\": %i, \"results\": [", iter);
+	if (argc > 0)
+		for (i = 0; i < argc; i++)
+			ret |= bench_image(argv[i], iter);
+	else
+		for (i = 0; i < sizeof(gens) / sizeof(gens[0]); i++)
+			for (f = 0; f < sizeof(fraglevels) / sizeof(int);
+			    f++) {
+				snprintf(image, sizeof(image),
+				    "%s/uxtaf_bench-%s-f%i.img", dir,
+				    gens[i].name, fraglevels[f]);
+				if (generate(mkxtaf, image, &gens[i],
+				    fraglevels[f])) {
+					fprintf(stderr, "uxtaf_bench: cannot "
+					    "create %s\n", image);
+					ret = 1;
+					continue;
+				}
+				ret |= bench_image(image, iter);
+			}
+	fprintf(json, "\n]}\n");
+	fclose(json);
+	return(ret);
+}
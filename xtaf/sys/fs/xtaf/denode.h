@@ -96,6 +96,8 @@
 
 #include <sys/types.h>
 #include <sys/malloc.h>
+
+#include <fs/xtaf/name_hash.h>
 /*
  * Internal pseudo-offset for (nonexistent) directory entry for the root
  * dir in the root dir
@@ -162,6 +164,8 @@ struct denode {
 	struct fatcache de_fc[FC_SIZE];	/* fat cache */
 	u_quad_t de_modrev;	/* Revision level for lease. */
 	u_int32_t de_inode;	/* Inode number (really byte offset of direntry) */
+	struct hash_table de_names;	/* directories: names to offsets, see
+					 * xtaf_dirhash_lookup() */
 };
 
 /*
@@ -293,6 +297,8 @@ int xtaf_deupdat(struct denode *dep, int waitfor);
 int xtaf_removede(struct denode *pdep, struct denode *dep);
 int xtaf_detrunc(struct denode *dep, u_long length, int flags, struct ucred *cred, struct thread *td);
 int xtafcheckpath(struct denode *source, struct denode *target);
+int xtaf_dirhash_lookup(struct denode *dep, const u_char *name00, const u_char *nameff, struct buf **bpp, int *diroffp, u_long *clusterp);
+void xtaf_dirhash_purge(struct denode *dep);
 #endif	/* _KERNEL */
 
 #endif	/* _XTAF_DENODE_H_ */
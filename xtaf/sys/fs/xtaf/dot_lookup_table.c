@@ -29,73 +29,128 @@
  * directory entries, we keep a lookup table for them ourselves.
  *
  * Note that .. can be retrieved by a double lookup.
+ *
+ * The table itself is plain C so that uxtaf can use this file as well,
+ * only the xtafmount glue at the bottom is kernel-only.
  */
 
+#ifdef _KERNEL
 #include <sys/cdefs.h>
 __FBSDID("$FreeBSD: $");
 
 #include <sys/param.h>
 #include <sys/conf.h>
-#include <sys/malloc.h>
 #include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/sx.h>
 
 #include <fs/xtaf/xtafmount.h>
+#else
+#include <errno.h>
 
-static MALLOC_DEFINE(M_XTAFDOT, "XTAF_dot", "XTAF dot lookup table");
+#include "dot_lookup_table.h"
+#endif
 
 /*
- * Initialize the dot lookup list.
+ * Initialize an empty dot lookup table.
+ */
+int
+dot_table_init(struct hash_table *dt)
+{
+	return (hash_table_init(dt, DOT_MINSIZE * 3 / 4));
+}
+
+/*
+ * Drop the dot lookup table.
+ */
+void
+dot_table_destroy(struct hash_table *dt)
+{
+	hash_table_destroy(dt);
+}
+
+/*
+ * Find the parent of startcluster, DOT_NOT_FOUND if it is not known.
+ */
+uint32_t
+dot_table_find(struct hash_table *dt, uint32_t startcluster)
+{
+	uint32_t dot, pos = 0;
+
+	if (startcluster == DOT_NOT_FOUND ||
+	    (dot = hash_table_find(dt, startcluster, &pos)) == HASH_NOT_FOUND)
+		return (DOT_NOT_FOUND);
+	return (dot);
+}
+
+/*
+ * Add an entry to the dot lookup table, an existing entry for cluster is
+ * kept.
+ */
+int
+dot_table_add(struct hash_table *dt, uint32_t cluster, uint32_t dot)
+{
+	if (cluster == DOT_NOT_FOUND || dot == DOT_NOT_FOUND)
+		return (EINVAL);
+	if (dot_table_find(dt, cluster) != DOT_NOT_FOUND)
+		return (0);
+	return (hash_table_add(dt, cluster, dot));
+}
+
+#ifdef _KERNEL
+/*
+ * The table is shared by the whole mount, and readdir on two directories
+ * only holds the two vnode locks, so every access takes pm_dotlock.  It
+ * is an sx lock as the table may sleep in malloc(9) while growing.
+ */
+
+/*
+ * Initialize the dot lookup table of a mount.
  */
 void
 init_dot_lookup_table(struct xtafmount *pmp)
 {
-	SLIST_INIT(&(pmp->dot_lookup_table));
+	sx_init(&pmp->pm_dotlock, "xtafdot");
+	sx_xlock(&pmp->pm_dotlock);
+	dot_table_init(&(pmp->dot_lookup_table));
+	sx_xunlock(&pmp->pm_dotlock);
 }
 
 /*
- * Find an entry in the dot lookup list.
+ * Find an entry in the dot lookup table.
  */
 u_long
 find_dot_entry(struct xtafmount *pmp, u_long startcluster)
 {
-	struct dot_entry *dot;
+	u_long dot;
 
-	SLIST_FOREACH(dot, &(pmp->dot_lookup_table), next)
-		if (dot->startcluster == startcluster)
-			return (dot->dot);
-	return (DOT_NOT_FOUND);
+	sx_slock(&pmp->pm_dotlock);
+	dot = dot_table_find(&(pmp->dot_lookup_table), startcluster);
+	sx_sunlock(&pmp->pm_dotlock);
+	return (dot);
 }
 
 /*
- * Drop the dot lookup list.
+ * Drop the dot lookup table.
  */
 void
 remove_dot_lookup_table(struct xtafmount *pmp)
 {
-	struct dot_entry *dot;
-
-	while (!SLIST_EMPTY(&(pmp->dot_lookup_table))) {
-		dot = SLIST_FIRST(&(pmp->dot_lookup_table));
-		SLIST_REMOVE_HEAD(&(pmp->dot_lookup_table), next);
-		free(dot, M_XTAFDOT);
-	}
+	sx_xlock(&pmp->pm_dotlock);
+	dot_table_destroy(&(pmp->dot_lookup_table));
+	sx_xunlock(&pmp->pm_dotlock);
+	sx_destroy(&pmp->pm_dotlock);
 }
 
 /*
- * Add an entry to the dot lookup list.
+ * Add an entry to the dot lookup table, O(1) on average.  Cannot fail as
+ * the allocations sleep.
  */
 void
 add_dot_entry(struct xtafmount *pmp, u_long cluster, u_long dot)
 {
-	struct dot_entry *newdot;
-	/*
-	 * Do a lookup in advance to conserve kernel memory.  This makes
-	 * the function O(n) instead of O(1).
-	 */
-	if (find_dot_entry(pmp, cluster) == DOT_NOT_FOUND) {
-		newdot = malloc(sizeof(struct dot_entry), M_XTAFDOT, M_WAITOK);
-		newdot->startcluster = cluster;
-		newdot->dot          = dot;
-		SLIST_INSERT_HEAD(&(pmp->dot_lookup_table), newdot, next);
-	}
+	sx_xlock(&pmp->pm_dotlock);
+	dot_table_add(&(pmp->dot_lookup_table), cluster, dot);
+	sx_xunlock(&pmp->pm_dotlock);
 }
+#endif /* _KERNEL */
@@ -0,0 +1,54 @@
+/*-
+ * Copyright (c) 2006, 2007 Rene Ladan <r.c.ladan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XTAF_DOT_LOOKUP_TABLE_H_
+#define	_XTAF_DOT_LOOKUP_TABLE_H_
+
+/*
+ * Dot lookup table, shared between the kernel module and uxtaf.  It maps
+ * the start cluster of a directory to the start cluster of its parent.
+ */
+
+#ifdef _KERNEL
+#include <fs/xtaf/hash_table.h>
+#else
+#include <stdint.h>
+
+#include "hash_table.h"
+#endif
+
+#define DOT_NOT_FOUND	0xfffffff0	/* not a start cluster */
+#define DOT_MINSIZE	64		/* initial number of slots */
+
+/*
+ * A hash_table with at most one value per key.
+ */
+int dot_table_init(struct hash_table *);
+void dot_table_destroy(struct hash_table *);
+uint32_t dot_table_find(struct hash_table *, uint32_t);
+int dot_table_add(struct hash_table *, uint32_t, uint32_t);
+
+#endif /* !_XTAF_DOT_LOOKUP_TABLE_H_ */
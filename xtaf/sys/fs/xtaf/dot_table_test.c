@@ -0,0 +1,174 @@
+/*-
+ * Copyright (c) 2006, 2007 Rene Ladan <r.c.ladan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Userland test of the dot lookup table and the hash table under it, see
+ * uxtaf.txt for how to build it.  Exits non-zero if a check fails.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "dot_lookup_table.h"
+
+#define	NKEYS	10000	/* enough to grow the table 8 times */
+
+static int failed;
+
+#define	CHECK(cond) do {						\
+	if (!(cond)) {							\
+		printf("%s:%d: %s\n", __FILE__, __LINE__, #cond);	\
+		failed++;						\
+	}								\
+} while (0)
+
+static uint32_t
+slot_of(uint32_t key, uint32_t shift)
+{
+	return ((uint32_t)(key * 0x9e3779b1U) >> (32 - shift));
+}
+
+/*
+ * The table has 64 slots until the 49th entry, which would make it more
+ * than 3/4 full, and keeps everything added when it grows.
+ */
+static void
+test_growth(void)
+{
+	struct hash_table dt;
+	uint32_t i;
+
+	CHECK(dot_table_init(&dt) == 0);
+	CHECK(dt.ht_shift == 6);
+	for (i = 0; i < 48; i++)
+		CHECK(dot_table_add(&dt, i + 2, i) == 0);
+	CHECK(dt.ht_shift == 6 && dt.ht_count == 48);
+	CHECK(dot_table_add(&dt, 50, 48) == 0);
+	CHECK(dt.ht_shift == 7 && dt.ht_count == 49);
+	for (i = 49; i < NKEYS; i++)
+		CHECK(dot_table_add(&dt, i + 2, i) == 0);
+	CHECK(dt.ht_count == NKEYS);
+	CHECK(dt.ht_count * 4 <= (3U << dt.ht_shift));
+	for (i = 0; i < NKEYS; i++)
+		CHECK(dot_table_find(&dt, i + 2) == i);
+	CHECK(dot_table_find(&dt, NKEYS + 2) == DOT_NOT_FOUND);
+	dot_table_destroy(&dt);
+}
+
+/*
+ * A directory is added once per readdir, the first parent stays.
+ */
+static void
+test_duplicate(void)
+{
+	struct hash_table dt;
+
+	CHECK(dot_table_init(&dt) == 0);
+	CHECK(dot_table_add(&dt, 7, 1) == 0);
+	CHECK(dot_table_add(&dt, 7, 9) == 0);
+	CHECK(dt.ht_count == 1);
+	CHECK(dot_table_find(&dt, 7) == 1);
+	dot_table_destroy(&dt);
+}
+
+/*
+ * DOT_NOT_FOUND cannot be stored, neither as a key nor as a value.
+ */
+static void
+test_not_found(void)
+{
+	struct hash_table dt;
+
+	CHECK(dot_table_init(&dt) == 0);
+	CHECK(dot_table_add(&dt, DOT_NOT_FOUND, 1) == EINVAL);
+	CHECK(dot_table_add(&dt, 1, DOT_NOT_FOUND) == EINVAL);
+	CHECK(dt.ht_count == 0);
+	CHECK(dot_table_find(&dt, DOT_NOT_FOUND) == DOT_NOT_FOUND);
+	CHECK(dot_table_find(&dt, 1) == DOT_NOT_FOUND);
+	dot_table_destroy(&dt);
+}
+
+/*
+ * Keys landing in the same slot are probed past each other, also across
+ * the end of the table.
+ */
+static void
+test_collisions(void)
+{
+	struct hash_table dt;
+	uint32_t keys[8], key, n;
+
+	for (n = 0, key = 2; n < 8; key++)
+		if (slot_of(key, 6) == 63)
+			keys[n++] = key;
+	CHECK(dot_table_init(&dt) == 0);
+	for (n = 0; n < 8; n++)
+		CHECK(dot_table_add(&dt, keys[n], n) == 0);
+	CHECK(dt.ht_shift == 6);
+	for (n = 0; n < 8; n++)
+		CHECK(dot_table_find(&dt, keys[n]) == n);
+	while (slot_of(key, 6) != 63)	/* the next one not added */
+		key++;
+	CHECK(dot_table_find(&dt, key) == DOT_NOT_FOUND);
+	dot_table_destroy(&dt);
+}
+
+/*
+ * A destroyed table finds nothing, and starts over on the next add.
+ */
+static void
+test_destroy(void)
+{
+	struct hash_table dt;
+
+	CHECK(dot_table_init(&dt) == 0);
+	CHECK(dot_table_add(&dt, 1, 1) == 0);
+	dot_table_destroy(&dt);
+	CHECK(dt.ht_slots == NULL && dt.ht_count == 0);
+	CHECK(dot_table_find(&dt, 1) == DOT_NOT_FOUND);
+	dot_table_destroy(&dt);
+	CHECK(dot_table_add(&dt, 3, 1) == 0);
+	CHECK(dot_table_find(&dt, 3) == 1);
+	CHECK(dot_table_find(&dt, 1) == DOT_NOT_FOUND);
+	dot_table_destroy(&dt);
+}
+
+int
+main(void)
+{
+	test_growth();
+	test_duplicate();
+	test_not_found();
+	test_collisions();
+	test_destroy();
+	if (failed > 0) {
+		printf("%d checks failed\n", failed);
+		return (1);
+	}
+	printf("all checks passed\n");
+	return (0);
+}
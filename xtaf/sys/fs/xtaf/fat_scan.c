@@ -0,0 +1,223 @@
+/*-
+ * Copyright (c) 2006, 2007 Rene Ladan <r.c.ladan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Count free, used, bad and end-of-chain FAT entries and fill the in-use
+ * bitmap in the same pass.  Only entries which are free or end a chain
+ * need a closer look, so whole groups of 32 entries are tested at once:
+ * with SSE2 or AVX2 in userland, one entry at a time in the kernel where
+ * the FPU may not be touched.
+ *
+ * The FAT is big endian, but testing an entry for zero or for having all
+ * its upper bits set does not depend on byte order, so the vector code
+ * never swaps bytes.
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD: $");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+
+#include <fs/xtaf/fat_scan.h>
+
+#define	FAT_POPCOUNT(x)	bitcount32(x)
+#else
+#include <stdint.h>
+
+#include "fat_scan.h"
+
+#define	FAT_POPCOUNT(x)	__builtin_popcount(x)
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define	FAT_SCAN_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define	FAT_SCAN_SSE2
+#endif
+#endif /* _KERNEL */
+
+/*
+ * Masked value of the big endian entry at p.
+ */
+static uint32_t
+fat_value(const uint8_t *p, int fatmult)
+{
+	if (fatmult == 2)
+		return ((uint32_t)p[0] << 8 | p[1]);
+	return (((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | p[3]) & 0x0fffffff);
+}
+
+/*
+ * Count an entry of at least 0x?ffffff0.
+ */
+static void
+fat_special(struct fat_usage *fu, uint32_t v, int fatmult)
+{
+	uint32_t mask;
+
+	mask = fatmult == 2 ? 0x0000ffff : 0x0fffffff;
+	if (v == (0xfffffff7 & mask))
+		fu->fu_bad++;
+	else if (v >= (0xfffffff8 & mask))
+		fu->fu_eof++;
+	else
+		fu->fu_reserved++;
+}
+
+/*
+ * Test the 32 entries at p.  Bit i of the result is set if entry i is
+ * free, bit i of *special is set if it is at least 0x?ffffff0.
+ */
+static uint32_t
+fat_group(const uint8_t *p, int fatmult, uint32_t *special)
+{
+	uint32_t freebits = 0, v;
+	int i;
+#if defined(FAT_SCAN_AVX2)
+	__m256i x, m, s;
+	uint32_t b;
+
+	*special = 0;
+	if (fatmult == 4) {
+		/* 8 entries per vector, the top nibble is not part of it */
+		m = _mm256_set1_epi32((int)0xffffff0f);
+		s = _mm256_set1_epi32((int)0xf0ffff0f);
+		for (i = 0; i < 4; i++) {
+			x = _mm256_loadu_si256((const __m256i *)(p + 32 * i));
+			freebits |= (uint32_t)_mm256_movemask_ps(
+			    _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+			    _mm256_and_si256(x, m),
+			    _mm256_setzero_si256()))) << (8 * i);
+			*special |= (uint32_t)_mm256_movemask_ps(
+			    _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+			    _mm256_and_si256(x, s), s))) << (8 * i);
+		}
+	} else {
+		/* 16 entries per vector, pack the 16 bit lanes to bytes */
+		s = _mm256_set1_epi16((short)0xf0ff);
+		for (i = 0; i < 2; i++) {
+			x = _mm256_loadu_si256((const __m256i *)(p + 32 * i));
+			b = _mm256_movemask_epi8(_mm256_packs_epi16(
+			    _mm256_cmpeq_epi16(x, _mm256_setzero_si256()),
+			    _mm256_setzero_si256()));
+			freebits |= ((b & 0xff) | (b >> 8 & 0xff00)) <<
+			    (16 * i);
+			b = _mm256_movemask_epi8(_mm256_packs_epi16(
+			    _mm256_cmpeq_epi16(_mm256_and_si256(x, s), s),
+			    _mm256_setzero_si256()));
+			*special |= ((b & 0xff) | (b >> 8 & 0xff00)) <<
+			    (16 * i);
+		}
+	}
+	(void)v;
+#elif defined(FAT_SCAN_SSE2)
+	__m128i x, m, s;
+
+	*special = 0;
+	if (fatmult == 4) {
+		m = _mm_set1_epi32((int)0xffffff0f);
+		s = _mm_set1_epi32((int)0xf0ffff0f);
+		for (i = 0; i < 8; i++) {
+			x = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+			freebits |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(
+			    _mm_cmpeq_epi32(_mm_and_si128(x, m),
+			    _mm_setzero_si128()))) << (4 * i);
+			*special |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(
+			    _mm_cmpeq_epi32(_mm_and_si128(x, s), s))) <<
+			    (4 * i);
+		}
+	} else {
+		s = _mm_set1_epi16((short)0xf0ff);
+		for (i = 0; i < 4; i++) {
+			x = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+			freebits |= (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(
+			    _mm_cmpeq_epi16(x, _mm_setzero_si128()),
+			    _mm_setzero_si128())) << (8 * i);
+			*special |= (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(
+			    _mm_cmpeq_epi16(_mm_and_si128(x, s), s),
+			    _mm_setzero_si128())) << (8 * i);
+		}
+	}
+	(void)v;
+#else
+	*special = 0;
+	for (i = 0; i < 32; i++, p += fatmult) {
+		v = fat_value(p, fatmult);
+		if (v == 0)
+			freebits |= 1U << i;
+		else if (v >= (fatmult == 2 ? 0xfff0 : 0x0ffffff0))
+			*special |= 1U << i;
+	}
+#endif
+	return (freebits);
+}
+
+/*
+ * Scan count entries starting with the one for cluster cn, which is at
+ * buf.  The counts are added to fu, and the bits for these clusters in
+ * the in-use bitmap map (32 clusters per word) are set or cleared.
+ */
+void
+fat_scan(const uint8_t *buf, uint32_t cn, uint32_t count, int fatmult,
+    struct fat_usage *fu, uint32_t *map)
+{
+	uint32_t end, freebits, special, v;
+	int i;
+
+	for (end = cn + count; cn < end; ) {
+		if (cn % 32 == 0 && end - cn >= 32) {
+			freebits = fat_group(buf, fatmult, &special);
+			fu->fu_free += FAT_POPCOUNT(freebits);
+			fu->fu_used += 32 - FAT_POPCOUNT(freebits) -
+			    FAT_POPCOUNT(special);
+			for (i = 0; special != 0; i++, special >>= 1)
+				if (special & 1)
+					fat_special(fu, fat_value(buf +
+					    i * fatmult, fatmult), fatmult);
+			map[cn / 32] = ~freebits;
+			buf += 32 * fatmult;
+			cn += 32;
+			continue;
+		}
+		v = fat_value(buf, fatmult);
+		if (v == 0) {
+			fu->fu_free++;
+			map[cn / 32] &= ~(1U << (cn % 32));
+		} else {
+			if (v >= (fatmult == 2 ? 0xfff0 : 0x0ffffff0))
+				fat_special(fu, v, fatmult);
+			else
+				fu->fu_used++;
+			map[cn / 32] |= 1U << (cn % 32);
+		}
+		buf += fatmult;
+		cn++;
+	}
+}
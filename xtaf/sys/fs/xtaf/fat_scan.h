@@ -0,0 +1,49 @@
+/*-
+ * Copyright (c) 2006, 2007 Rene Ladan <r.c.ladan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XTAF_FAT_SCAN_H_
+#define	_XTAF_FAT_SCAN_H_
+
+/*
+ * Counting FAT scan, shared between the kernel module and uxtaf.
+ */
+
+#ifndef _KERNEL
+#include <stdint.h>
+#endif
+
+struct fat_usage {
+	uint32_t fu_free;	/* 0 */
+	uint32_t fu_used;	/* 2 .. 0x?fffffef, pointer to the next cluster */
+	uint32_t fu_reserved;	/* 0x?ffffff0 .. 0x?ffffff6 */
+	uint32_t fu_bad;	/* 0x?ffffff7 */
+	uint32_t fu_eof;	/* 0x?ffffff8 .. 0x?fffffff, one per chain */
+};
+
+void fat_scan(const uint8_t *, uint32_t, uint32_t, int, struct fat_usage *,
+    uint32_t *);
+
+#endif /* !_XTAF_FAT_SCAN_H_ */
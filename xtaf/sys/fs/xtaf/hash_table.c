@@ -0,0 +1,163 @@
+/*-
+ * Copyright (c) 2006, 2007 Rene Ladan <r.c.ladan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The table itself is plain C so that userland can use this file as well.
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD: $");
+
+#include <sys/param.h>
+#include <sys/malloc.h>
+#include <sys/kernel.h>
+
+#include <fs/xtaf/hash_table.h>
+
+static MALLOC_DEFINE(M_XTAFHASH, "XTAF_hash", "XTAF hash tables");
+
+#define	HASH_ALLOC(n)	malloc((n), M_XTAFHASH, M_WAITOK)
+#define	HASH_FREE(p)	free((p), M_XTAFHASH)
+#else
+#include <errno.h>
+#include <stdlib.h>
+
+#include "hash_table.h"
+
+#define	HASH_ALLOC(n)	malloc(n)
+#define	HASH_FREE(p)	free(p)
+#endif
+
+/*
+ * Fibonacci hashing, take the top ht_shift bits of the product.
+ */
+static uint32_t
+hash_slot(struct hash_table *ht, uint32_t key)
+{
+	return ((uint32_t)(key * 0x9e3779b1U) >> (32 - ht->ht_shift));
+}
+
+static int
+hash_table_alloc(struct hash_table *ht, uint32_t shift)
+{
+	uint32_t i;
+
+	ht->ht_slots = HASH_ALLOC(sizeof(struct hash_entry) << shift);
+	if (ht->ht_slots == NULL)
+		return (ENOMEM);
+	for (i = 0; i < (1U << shift); i++)
+		ht->ht_slots[i].he_value = HASH_NOT_FOUND;
+	ht->ht_shift = shift;
+	ht->ht_count = 0;
+	return (0);
+}
+
+/*
+ * Initialize an empty hash table with room for count entries.
+ */
+int
+hash_table_init(struct hash_table *ht, uint32_t count)
+{
+	uint32_t shift;
+
+	for (shift = 1; (1U << shift) < HASH_MINSIZE ||
+	    (1U << shift) * 3 < count * 4; shift++)
+		;
+	return (hash_table_alloc(ht, shift));
+}
+
+/*
+ * Drop the hash table.
+ */
+void
+hash_table_destroy(struct hash_table *ht)
+{
+	if (ht->ht_slots != NULL)
+		HASH_FREE(ht->ht_slots);
+	ht->ht_slots = NULL;
+	ht->ht_count = 0;
+}
+
+/*
+ * Return the next value of key, HASH_NOT_FOUND if there are no more.
+ * *pos has to be 0 for the first call and is kept between calls for the
+ * same key.
+ */
+uint32_t
+hash_table_find(struct hash_table *ht, uint32_t key, uint32_t *pos)
+{
+	uint32_t i, mask;
+
+	if (ht->ht_slots == NULL)
+		return (HASH_NOT_FOUND);
+	mask = (1U << ht->ht_shift) - 1;
+	for (i = (hash_slot(ht, key) + *pos) & mask;
+	    ht->ht_slots[i].he_value != HASH_NOT_FOUND && *pos <= mask;
+	    i = (i + 1) & mask) {
+		(*pos)++;
+		if (ht->ht_slots[i].he_key == key)
+			return (ht->ht_slots[i].he_value);
+	}
+	return (HASH_NOT_FOUND);
+}
+
+/*
+ * Add value under key, values already there for key are all kept.  Grows
+ * the table when it gets 3/4 full.
+ */
+int
+hash_table_add(struct hash_table *ht, uint32_t key, uint32_t value)
+{
+	struct hash_table old;
+	uint32_t i, mask;
+	int error;
+
+	if (value == HASH_NOT_FOUND)
+		return (EINVAL);
+	if (ht->ht_slots == NULL && (error = hash_table_init(ht, 0)) != 0)
+		return (error);
+	if ((ht->ht_count + 1) * 4 > (3U << ht->ht_shift)) {
+		old = *ht;
+		if ((error = hash_table_alloc(ht, old.ht_shift + 1)) != 0) {
+			*ht = old;
+			return (error);
+		}
+		for (i = 0; i < (1U << old.ht_shift); i++)
+			if (old.ht_slots[i].he_value != HASH_NOT_FOUND)
+				hash_table_add(ht, old.ht_slots[i].he_key,
+				    old.ht_slots[i].he_value);
+		hash_table_destroy(&old);
+	}
+	mask = (1U << ht->ht_shift) - 1;
+	for (i = hash_slot(ht, key);
+	    ht->ht_slots[i].he_value != HASH_NOT_FOUND; i = (i + 1) & mask)
+		;
+	ht->ht_slots[i].he_key = key;
+	ht->ht_slots[i].he_value = value;
+	ht->ht_count++;
+	return (0);
+}
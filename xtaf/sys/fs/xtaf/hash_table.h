@@ -0,0 +1,63 @@
+/*-
+ * Copyright (c) 2006, 2007 Rene Ladan <r.c.ladan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XTAF_HASH_TABLE_H_
+#define	_XTAF_HASH_TABLE_H_
+
+/*
+ * Hash table from a 32 bit key to 32 bit values, shared between the kernel
+ * module and userland.  A key can have several values, the dot lookup table
+ * and the name tables of directories are built on it.
+ */
+
+#ifndef _KERNEL
+#include <stdint.h>
+#endif
+
+#define HASH_NOT_FOUND	0xffffffff	/* also marks an empty slot */
+#define HASH_MINSIZE	16		/* least number of slots */
+
+struct hash_entry {
+	uint32_t he_key;
+	uint32_t he_value;
+};
+
+/*
+ * Open addressing with linear probing.  The number of slots is a power of
+ * two and doubles when the table is 3/4 full.
+ */
+struct hash_table {
+	struct hash_entry *ht_slots;
+	uint32_t ht_shift;	/* log2 of the number of slots */
+	uint32_t ht_count;	/* slots in use */
+};
+
+int hash_table_init(struct hash_table *, uint32_t);
+void hash_table_destroy(struct hash_table *);
+uint32_t hash_table_find(struct hash_table *, uint32_t, uint32_t *);
+int hash_table_add(struct hash_table *, uint32_t, uint32_t);
+
+#endif /* !_XTAF_HASH_TABLE_H_ */
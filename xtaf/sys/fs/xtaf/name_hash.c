@@ -0,0 +1,63 @@
+/*-
+ * Copyright (c) 2006, 2007 Rene Ladan <r.c.ladan@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Every lookup in a directory used to compare the name with each of its
+ * 64 byte slots, which makes walking a tree with big directories
+ * quadratic.  A name table is built with one pass over the directory and
+ * turns the following lookups into a hash probe and one name compare.
+ *
+ * The table is a hash_table (see hash_table.c) keyed by name_hash().  Both
+ * are plain C so that libxtaf can use them as well.
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD: $");
+
+#include <sys/param.h>
+
+#include <fs/xtaf/name_hash.h>
+#else
+#include "name_hash.h"
+#endif
+
+/*
+ * FNV-1a hash of a name of at most len bytes.  It stops at the first 0x00
+ * or 0xff byte, so a name hashes the same with either padding.
+ */
+uint32_t
+name_hash(const uint8_t *name, size_t len)
+{
+	uint32_t h = 0x811c9dc5U;
+	size_t i;
+
+	for (i = 0; i < len && name[i] != 0x00 && name[i] != 0xff; i++) {
+		h ^= name[i];
+		h *= 0x01000193U;
+	}
+	return (h);
+}
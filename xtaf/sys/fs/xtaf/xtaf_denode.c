@@ -269,6 +269,7 @@ xtaf_reclaim(struct vop_reclaim_args *ap)
 	/*
 	 * Purge old data structures associated with the denode.
 	 */
+	xtaf_dirhash_purge(dep);
 	free(dep, M_XTAFNODE);
 	vp->v_data = NULL;
 
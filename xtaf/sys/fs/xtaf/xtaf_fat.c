@@ -61,6 +61,7 @@
 #include <fs/xtaf/direntry.h>
 #include <fs/xtaf/denode.h>
 #include <fs/xtaf/fat.h>
+#include <fs/xtaf/fat_scan.h>
 
 static void	fatblock(struct xtafmount *pmp, u_long ofs, u_long *bnp,
 		    u_long *sizep, u_long *bop);
@@ -414,10 +415,11 @@ xtaf_fatentry(int function, struct xtafmount *pmp, u_long cn,
 int
 xtaf_fillinusemap(struct xtafmount *pmp)
 {
-	struct buf *bp = NULL;
-	u_long cn, readcn;
+	struct buf *bp;
+	struct fat_usage fu;
+	u_long cn, count;
 	int error;
-	u_long bn, bo, bsize, byteoffset;
+	u_long bn, bo, bsize;
 
 	XTAF_ASSERT_MP_LOCKED(pmp);
 
@@ -431,33 +433,24 @@ xtaf_fillinusemap(struct xtafmount *pmp)
 	/*
 	 * Figure how many free clusters are in the filesystem by ripping
 	 * through the fat counting the number of entries whose content is
-	 * zero.  These represent free clusters.
+	 * zero.  These represent free clusters.  fat_scan() takes a whole
+	 * FAT block at a time and fills the in-use map word by word.
 	 */
-	pmp->pm_freeclustercount = 0;
-	for (cn = CLUST_FIRST; cn <= pmp->pm_maxcluster; cn++) {
-		byteoffset = FATOFS(pmp, cn);
-		bo = byteoffset % pmp->pm_fatblocksize;
-		if (!bo || !bp) {
-			/* Read new FAT block */
-			if (bp)
-				brelse(bp);
-			fatblock(pmp, byteoffset, &bn, &bsize, NULL);
-			error = bread(pmp->pm_devvp, bn, bsize, NOCRED, &bp);
-			if (error) {
-				brelse(bp);
-				return (error);
-			}
+	bzero(&fu, sizeof(fu));
+	for (cn = CLUST_FIRST; cn <= pmp->pm_maxcluster; cn += count) {
+		fatblock(pmp, FATOFS(pmp, cn), &bn, &bsize, &bo);
+		error = bread(pmp->pm_devvp, bn, bsize, NOCRED, &bp);
+		if (error) {
+			brelse(bp);
+			return (error);
 		}
-		if (FAT32(pmp))
-			readcn = be32dec(&bp->b_data[bo]);
-		else
-			readcn = be16dec(&bp->b_data[bo]);
-		readcn &= pmp->pm_fatmask;
-		if (readcn == 0)
-			usemap_free(pmp, cn);
-	}
-	if (bp != NULL)
+		count = min((bsize - bo) / pmp->pm_fatmult,
+		    pmp->pm_maxcluster + 1 - cn);
+		fat_scan((uint8_t *)&bp->b_data[bo], cn, count,
+		    pmp->pm_fatmult, &fu, (uint32_t *)pmp->pm_inusemap);
 		brelse(bp);
+	}
+	pmp->pm_freeclustercount = fu.fu_free;
 	return (0);
 }
 
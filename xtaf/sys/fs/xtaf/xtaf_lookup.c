@@ -241,6 +241,7 @@ xtaf_createde(struct denode *dep, struct denode *ddep, struct denode **depp,
 	ne = bptoep(pmp, bp, ddep->de_fndoffset);
 
 	DE_EXTERNALIZE(ne, dep);
+	xtaf_dirhash_purge(ddep);
 
 	if (DETOV(ddep)->v_mount->mnt_flag & MNT_ASYNC)
 		bdwrite(bp);
@@ -392,6 +393,7 @@ xtaf_removede(struct denode *pdep, struct denode *dep)
 			break;
 		}
 		ep--->deLength = LEN_DELETED;
+		xtaf_dirhash_purge(pdep);
 		if (DETOV(pdep)->v_mount->mnt_flag & MNT_ASYNC)
 			bdwrite(bp);
 		else if ((error = bwrite(bp)) != 0)
@@ -400,6 +402,116 @@ xtaf_removede(struct denode *pdep, struct denode *dep)
 	return 0;
 }
 
+/*
+ * Build the name table of directory dep with one pass over its clusters,
+ * adding the offset of every entry in use under the hash of its name.
+ */
+static int
+xtaf_dirhash_build(struct denode *dep)
+{
+	struct xtafmount *pmp = dep->de_pmp;
+	struct direntry *ep;
+	struct buf *bp;
+	daddr_t bn;
+	u_long frcn;
+	int blkoff, blsize, diroff, error;
+
+	error = hash_table_init(&dep->de_names, 0);
+	if (error)
+		return (error);
+	diroff = 0;
+	for (frcn = 0;; frcn++) {
+		error = xtaf_pcbmap(dep, frcn, &bn, NULL, &blsize);
+		if (error == E2BIG)
+			return (0);
+		if (error)
+			break;
+		error = bread(pmp->pm_devvp, bn, blsize, NOCRED, &bp);
+		if (error) {
+			brelse(bp);
+			break;
+		}
+		for (blkoff = 0; blkoff < blsize;
+		     blkoff += sizeof(struct direntry),
+		     diroff += sizeof(struct direntry)) {
+			ep = (struct direntry *)(bp->b_data + blkoff);
+			if (ep->deLength == SLOT_EMPTY) {
+				brelse(bp);
+				return (0);
+			}
+			if (ep->deLength != LEN_DELETED)
+				hash_table_add(&dep->de_names,
+				    name_hash(ep->deName, 42), diroff);
+		}
+		brelse(bp);
+	}
+	xtaf_dirhash_purge(dep);
+	return (error);
+}
+
+/*
+ * Look up the entry named name00 (padded with 0x00) or nameff (padded with
+ * 0xff) in directory dep through its name table, building the table first
+ * if needed.  On success the buffer holding the entry is returned in *bpp,
+ * its offset in the directory in *diroffp and the cluster it is in, as
+ * from xtaf_pcbmap(), in *clusterp.  Returns ENOENT if there is no such
+ * entry, other errors mean the caller has to scan the directory itself.
+ */
+int
+xtaf_dirhash_lookup(struct denode *dep, const u_char *name00,
+		    const u_char *nameff, struct buf **bpp, int *diroffp,
+		    u_long *clusterp)
+{
+	struct xtafmount *pmp = dep->de_pmp;
+	struct direntry *ep;
+	struct buf *bp;
+	daddr_t bn;
+	uint32_t hash, pos, diroff;
+	int blsize, error;
+
+	if (dep->de_names.ht_slots == NULL &&
+	    (error = xtaf_dirhash_build(dep)) != 0)
+		return (error);
+	hash = name_hash(name00, 42);
+	pos = 0;
+	while ((diroff = hash_table_find(&dep->de_names, hash, &pos)) !=
+	    HASH_NOT_FOUND) {
+		error = xtaf_pcbmap(dep, de_cluster(pmp, diroff), &bn,
+		    clusterp, &blsize);
+		if (error) {
+			/* the table is stale, E2BIG must not reach namei */
+			xtaf_dirhash_purge(dep);
+			return (EIO);
+		}
+		error = bread(pmp->pm_devvp, bn, blsize, NOCRED, &bp);
+		if (error) {
+			brelse(bp);
+			return (error);
+		}
+		ep = bptoep(pmp, bp, diroff);
+		if (ep->deLength != SLOT_EMPTY &&
+		    ep->deLength != LEN_DELETED &&
+		    (!bcmp(name00, ep->deName, 42) ||
+		    !bcmp(nameff, ep->deName, 42))) {
+			*bpp = bp;
+			*diroffp = diroff;
+			return (0);
+		}
+		brelse(bp);
+	}
+	return (ENOENT);
+}
+
+/*
+ * Drop the name table of directory dep after it changed, the next lookup
+ * builds a new one.
+ */
+void
+xtaf_dirhash_purge(struct denode *dep)
+{
+	hash_table_destroy(&dep->de_names);
+}
+
 /*
  * Create a unique XTAF name in dvp
  */
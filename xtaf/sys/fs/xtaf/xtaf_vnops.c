@@ -1716,6 +1716,24 @@ xtaf_lookup(struct vop_cachedlookup_args *ap)
 	 * by cnp->cn_nameptr.
 	 */
 	tdep = NULL;
+	/*
+	 * Unless we are looking for a free slot, use the name table of the
+	 * directory: one hash probe and one block read instead of comparing
+	 * every slot.  Fall back to the scan below if it cannot be built.
+	 */
+	if (slotcount) {
+		error = xtaf_dirhash_lookup(dep, xtaffilename_00,
+		    xtaffilename_ff, &bp, &diroff, &cluster);
+		if (error == 0) {
+			blkoff = diroff & pmp->pm_crbomask;
+			ep = bptoep(pmp, bp, diroff);
+			dep->de_fndoffset = diroff;
+			goto found;
+		}
+		if (error == ENOENT)
+			goto notfound;
+		bp = NULL;
+	}
 	/*
 	 * The outer loop ranges over the clusters that make up the
 	 * directory.  Note that the root directory is different from all
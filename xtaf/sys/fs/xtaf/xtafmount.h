@@ -57,18 +57,18 @@
 #include <sys/types.h>
 #include <sys/lock.h>
 #include <sys/lockmgr.h>
+#include <sys/sx.h>
 
 #include <sys/queue.h>
 #include <sys/mount.h>
 
 #include <fs/xtaf/bpb.h>
+#include <fs/xtaf/dot_lookup_table.h>
 
 #ifdef MALLOC_DECLARE
 MALLOC_DECLARE(M_XTAFMNT);
 #endif
 
-struct dot_entry;
-
 /*
  * Layout of the mount control block for an XTAF filesystem.
  */
@@ -108,20 +108,13 @@ struct xtafmount {
 	u_int *pm_inusemap;	/* ptr to bitmap of in-use clusters */
 	u_int pm_flags;		/* see below */
 	struct lock pm_fatlock; /* lockmgr protecting allocations */
-	SLIST_HEAD(dot_head, dot_entry) dot_lookup_table;
+	struct hash_table dot_lookup_table;
+	struct sx pm_dotlock;	/* protects dot_lookup_table */
 };
 
 /*
- * Dot lookup table
+ * Dot lookup table, see dot_lookup_table.h
  */
-#define DOT_NOT_FOUND 0xfffffff0
-
-struct dot_entry {
-	SLIST_ENTRY(dot_entry) next;
-	u_long startcluster;
-	u_long dot;
-};
-
 void init_dot_lookup_table(struct xtafmount *);
 void remove_dot_lookup_table(struct xtafmount *);
 u_long find_dot_entry(struct xtafmount *, u_long);
@@ -0,0 +1,462 @@
+/*
+Copyright (c) 2007,2008 Rene Ladan <r.c.ladan@gmail.com> All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+
+See xtafcarve.txt for usage information.
+
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CARVE_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CARVE_SSE2
+#endif
+
+#include "../libxtaf/libxtaf.h"
+
+#define CHUNK (4 * 1024 * 1024) /* bytes per read */
+#define MAXSIG 12 /* longest signature */
+#define PAD 64 /* zeroes after a chunk, the vector loop reads past it */
+#define PNG_MAX (64 * 1024 * 1024) /* longer PNG files are not believed */
+
+/* where a signature has to start to count, unless -a is given */
+#define A_CLUSTER 0 /* a file, at the start of a cluster */
+#define A_SECTOR 1 /* a volume, at the start of a sector */
+#define A_ANY 2 /* embedded in other files, like the icons of packages */
+
+/* the known signatures, see extract360.py */
+struct sig_s {
+	char *name;
+	char *magic;
+	int len;
+	int align;
+};
+
+struct sig_s sigs[] = {
+	{ "CON", "CON ", 4, A_CLUSTER },
+	{ "LIVE", "LIVE", 4, A_CLUSTER },
+	{ "PIRS", "PIRS", 4, A_CLUSTER },
+	{ "FMIM", "FMIM\0\0\0\1\0\1\0\1", 12, A_CLUSTER },
+	{ "XUIZ", "XUIZ", 4, A_CLUSTER },
+	{ "PNG", "\x89PNG\r\n\x1a\n", 8, A_ANY },
+	{ "XTAF", "XTAF", 4, A_SECTOR },
+};
+#define NSIGS (int)(sizeof(sigs) / sizeof(sigs[0]))
+#define S_XUIZ 4
+#define S_PNG 5
+#define S_XTAF 6
+
+/* a signature found, see scan_chunk() */
+struct hit_s {
+	uint64_t off;
+	int sig;
+	uint64_t len; /* candidate length */
+	int exact; /* len comes from the header, else up to the next hit */
+};
+
+/* the state shared by the scan threads */
+struct carve_s {
+	int fd;
+	uint64_t start; /* of the data area */
+	uint64_t end;
+	uint64_t csize; /* alignment of files */
+	int anywhere; /* -a */
+	uint64_t next; /* next chunk to scan, taken with atomics */
+	uint64_t bytes; /* scanned */
+	struct hit_s *hits; /* under mtx */
+	uint32_t nhits;
+	uint32_t ahits;
+	int failed;
+	pthread_mutex_t mtx;
+};
+
+double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+uint32_t be32(const uint8_t *p) {
+	return((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | p[3]);
+}
+
+/*
+ * Check the candidate at p, at image offset off with avail bytes left in
+ * the buffer, against all signatures starting with the same two bytes.
+ */
+int match(struct carve_s *cv, const uint8_t *p, size_t avail, uint64_t off) {
+	uint32_t spc;
+	int i;
+
+	for (i = 0; i < NSIGS; i++) {
+		if ((size_t)sigs[i].len > avail ||
+		    memcmp(p, sigs[i].magic, sigs[i].len))
+			continue;
+		if (!cv->anywhere && ((sigs[i].align == A_CLUSTER &&
+		    (off - cv->start) % cv->csize != 0) ||
+		    (sigs[i].align == A_SECTOR && off % 512 != 0)))
+			continue;
+		if (i == S_XTAF) { /* a boot block: spc and nfat */
+			if (avail < 16)
+				continue;
+			spc = be32(p + 8);
+			if (spc == 0 || spc & (spc - 1) || be32(p + 12) != 1)
+				continue;
+		}
+		return(i);
+	}
+	return(-1);
+}
+
+void add_hit(struct carve_s *cv, uint64_t off, int sig) {
+	struct hit_s *h;
+
+	pthread_mutex_lock(&cv->mtx);
+	if (cv->nhits == cv->ahits) {
+		h = realloc(cv->hits, (cv->ahits + 256) *
+		    sizeof(struct hit_s));
+		if (h == NULL) {
+			cv->failed = 1;
+			pthread_mutex_unlock(&cv->mtx);
+			return;
+		}
+		cv->hits = h;
+		cv->ahits += 256;
+	}
+	h = &cv->hits[cv->nhits++];
+	bzero(h, sizeof(struct hit_s));
+	h->off = off;
+	h->sig = sig;
+	pthread_mutex_unlock(&cv->mtx);
+}
+
+/*
+ * Find the signatures starting in the first n bytes of buf, which holds
+ * the image from off on, len bytes in all followed by PAD zeroes.  All
+ * positions are tested at once for the first two bytes of every
+ * signature, 32 or 16 at a time with AVX2 or SSE2, and only those which
+ * pass are compared in full, which leaves a few per megabyte of random
+ * data.
+ */
+void scan_chunk(struct carve_s *cv, const uint8_t *buf, size_t n,
+    size_t len, uint64_t off) {
+	size_t i;
+	int s;
+#if defined(CARVE_AVX2) || defined(CARVE_SSE2)
+	uint32_t bits;
+	int j, k;
+#endif
+#if defined(CARVE_AVX2)
+	__m256i a[NSIGS], b[NSIGS], v0, v1, m;
+
+	for (k = 0; k < NSIGS; k++) {
+		a[k] = _mm256_set1_epi8(sigs[k].magic[0]);
+		b[k] = _mm256_set1_epi8(sigs[k].magic[1]);
+	}
+	for (i = 0; i < n; i += 32) {
+		v0 = _mm256_loadu_si256((const __m256i *)(buf + i));
+		v1 = _mm256_loadu_si256((const __m256i *)(buf + i + 1));
+		m = _mm256_setzero_si256();
+		for (k = 0; k < NSIGS; k++)
+			m = _mm256_or_si256(m, _mm256_and_si256(
+			    _mm256_cmpeq_epi8(v0, a[k]),
+			    _mm256_cmpeq_epi8(v1, b[k])));
+		for (bits = _mm256_movemask_epi8(m); bits != 0;
+		    bits &= bits - 1) {
+			j = __builtin_ctz(bits);
+			if (i + j < n && (s = match(cv, buf + i + j,
+			    len - i - j, off + i + j)) >= 0)
+				add_hit(cv, off + i + j, s);
+		}
+	}
+#elif defined(CARVE_SSE2)
+	__m128i a[NSIGS], b[NSIGS], v0, v1, m;
+
+	for (k = 0; k < NSIGS; k++) {
+		a[k] = _mm_set1_epi8(sigs[k].magic[0]);
+		b[k] = _mm_set1_epi8(sigs[k].magic[1]);
+	}
+	for (i = 0; i < n; i += 16) {
+		v0 = _mm_loadu_si128((const __m128i *)(buf + i));
+		v1 = _mm_loadu_si128((const __m128i *)(buf + i + 1));
+		m = _mm_setzero_si128();
+		for (k = 0; k < NSIGS; k++)
+			m = _mm_or_si128(m, _mm_and_si128(
+			    _mm_cmpeq_epi8(v0, a[k]),
+			    _mm_cmpeq_epi8(v1, b[k])));
+		for (bits = _mm_movemask_epi8(m); bits != 0;
+		    bits &= bits - 1) {
+			j = __builtin_ctz(bits);
+			if (i + j < n && (s = match(cv, buf + i + j,
+			    len - i - j, off + i + j)) >= 0)
+				add_hit(cv, off + i + j, s);
+		}
+	}
+#else
+	uint8_t first[256];
+
+	bzero(first, sizeof(first));
+	for (s = 0; s < NSIGS; s++)
+		first[(uint8_t)sigs[s].magic[0]] = 1;
+	for (i = 0; i < n; i++)
+		if (first[buf[i]] &&
+		    (s = match(cv, buf + i, len - i, off + i)) >= 0)
+			add_hit(cv, off + i, s);
+#endif
+}
+
+/*
+ * Take chunks of the data area in order until it is done.  Each chunk is
+ * read with MAXSIG - 1 bytes of the next one, so signatures across the
+ * border are found, by the chunk they start in.
+ */
+void *carve_worker(void *arg) {
+	struct carve_s *cv = arg;
+	uint64_t c, off, bytes = 0;
+	uint8_t *buf;
+	size_t n, len, got;
+	ssize_t s;
+
+	buf = malloc(CHUNK + MAXSIG + PAD);
+	if (buf == NULL) {
+		cv->failed = 1;
+		return(NULL);
+	}
+	for (;;) {
+		c = __atomic_fetch_add(&cv->next, 1, __ATOMIC_RELAXED);
+		off = cv->start + c * CHUNK;
+		if (off >= cv->end)
+			break;
+		n = cv->end - off < CHUNK ? cv->end - off : CHUNK;
+		len = cv->end - off < CHUNK + MAXSIG - 1 ? cv->end - off :
+		    CHUNK + MAXSIG - 1;
+		for (got = 0; got < len; got += s) {
+			s = pread(cv->fd, buf + got, len - got, off + got);
+			if (s == -1 && errno == EINTR)
+				s = 0;
+			else if (s <= 0)
+				break;
+		}
+		if (got < len) {
+			fprintf(stderr, "xtafcarve: read error at %llu\n",
+			    (unsigned long long)(off + got));
+			cv->failed = 1;
+			len = got;
+			if (n > len)
+				n = len;
+		}
+		bzero(buf + len, CHUNK + MAXSIG + PAD - len);
+		scan_chunk(cv, buf, n, len, off);
+		bytes += n;
+	}
+	__atomic_fetch_add(&cv->bytes, bytes, __ATOMIC_RELAXED);
+	free(buf);
+	return(NULL);
+}
+
+int cmp_hit(const void *a, const void *b) {
+	const struct hit_s *ha = a, *hb = b;
+
+	return(ha->off < hb->off ? -1 : ha->off > hb->off);
+}
+
+/*
+ * Length of the PNG file at off, following its chunks up to IEND.  0 if
+ * they do not add up.
+ */
+uint64_t png_length(struct carve_s *cv, uint64_t off) {
+	uint8_t ch[8];
+	uint64_t pos;
+	uint32_t len;
+
+	for (pos = off + 8; pos - off < PNG_MAX; pos += 12 + (uint64_t)len) {
+		if (pread(cv->fd, ch, sizeof(ch), pos) != sizeof(ch))
+			return(0);
+		len = be32(ch);
+		if (len > PNG_MAX)
+			return(0);
+		if (!memcmp(ch + 4, "IEND", 4))
+			return(pos + 12 + len - off);
+	}
+	return(0);
+}
+
+/*
+ * Work out the candidate length of every hit: from the header where it
+ * tells, otherwise up to the next hit which is not embedded (a PNG) or
+ * the end of the data area.
+ */
+void hit_lengths(struct carve_s *cv) {
+	struct hit_s *h;
+	uint64_t bound, size;
+	uint8_t hdr[12];
+	uint32_t i, j;
+
+	for (i = 0; i < cv->nhits; i++) {
+		h = &cv->hits[i];
+		if (h->sig == S_PNG)
+			h->len = png_length(cv, h->off);
+		else if (h->sig == S_XUIZ && /* size at 8 */
+		    pread(cv->fd, hdr, sizeof(hdr), h->off) == sizeof(hdr)) {
+			size = be32(hdr + 8);
+			if (size >= 22 && h->off + size <= cv->end)
+				h->len = size;
+		}
+		if (h->len > 0) {
+			h->exact = 1;
+			continue;
+		}
+		for (j = i + 1; j < cv->nhits &&
+		    sigs[cv->hits[j].sig].align == A_ANY; j++)
+			;
+		bound = j < cv->nhits ? cv->hits[j].off : cv->end;
+		h->len = bound - h->off;
+	}
+}
+
+int usage(void) {
+	printf("See xtafcarve.txt for usage information.\n");
+	return(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct carve_s cv;
+	struct xtaf_geom geom;
+	struct hit_s *h;
+	pthread_t *tids;
+	uint32_t spc = 1, i;
+	double start, secs;
+	int ch, t, nthreads, raw = 0, geomok;
+	off_t size;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	bzero(&cv, sizeof(struct carve_s));
+	while ((ch = getopt(argc, argv, "ac:j:r")) != -1)
+		switch (ch) {
+		case 'a':
+			cv.anywhere = 1;
+			break;
+		case 'c':
+			spc = atoi(optarg);
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'r':
+			raw = 1;
+			break;
+		default:
+			return(usage());
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || nthreads < 1 || spc == 0 || spc & (spc - 1))
+		return(usage());
+
+	/*
+	 * The data area if the boot block is still there, else everything,
+	 * with files on sector or -c boundaries.
+	 */
+	geomok = !raw && xtaf_probe(argv[0], &geom) == 0;
+	cv.fd = open(argv[0], O_RDONLY);
+	if (cv.fd == -1) {
+		fprintf(stderr, "xtafcarve: cannot open %s: %i\n", argv[0],
+		    errno);
+		return(1);
+	}
+	size = lseek(cv.fd, 0, SEEK_END);
+	if (size <= 0) {
+		fprintf(stderr, "xtafcarve: %s is empty\n", argv[0]);
+		return(1);
+	}
+	cv.end = size;
+	if (geomok) {
+		cv.start = (uint64_t)geom.rootstart * 512;
+		spc = geom.spc;
+	}
+	cv.csize = 512 * (uint64_t)spc;
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(cv.fd, cv.start, cv.end - cv.start,
+	    POSIX_FADV_SEQUENTIAL);
+#endif
+	tids = calloc(nthreads, sizeof(pthread_t));
+	if (tids == NULL)
+		return(1);
+	pthread_mutex_init(&cv.mtx, NULL);
+
+	start = now();
+	for (t = 0; t < nthreads; t++)
+		if (pthread_create(&tids[t], NULL, carve_worker, &cv))
+			break;
+	if (t == 0)
+		carve_worker(&cv);
+	while (--t >= 0)
+		pthread_join(tids[t], NULL);
+	secs = now() - start;
+
+	if (cv.nhits > 0)
+		qsort(cv.hits, cv.nhits, sizeof(struct hit_s), cmp_hit);
+	hit_lengths(&cv);
+	printf("          offset    cluster signature       length\n");
+	for (i = 0; i < cv.nhits; i++) {
+		h = &cv.hits[i];
+		if (geomok && (h->off - cv.start) % cv.csize == 0)
+			printf("%16llu %10llu ", (unsigned long long)h->off,
+			    (unsigned long long)((h->off - cv.start) /
+			    cv.csize + 1));
+		else
+			printf("%16llu %10s ", (unsigned long long)h->off,
+			    "-");
+		printf("%-9s %12llu %s\n", sigs[h->sig].name,
+		    (unsigned long long)h->len, h->exact ? "exact" : "bound");
+	}
+	fprintf(stderr, "xtafcarve: %llu bytes from %llu in %.2f s (%.1f "
+	    "MB/s) with %i threads, %u hits%s\n",
+	    (unsigned long long)cv.bytes, (unsigned long long)cv.start, secs,
+	    secs > 0 ? cv.bytes / secs / 1e6 : 0.0, nthreads, cv.nhits,
+	    geomok ? "" : raw ? ", raw" : ", no XTAF boot block");
+
+	pthread_mutex_destroy(&cv.mtx);
+	close(cv.fd);
+	free(cv.hits);
+	free(tids);
+	return(cv.failed);
+}
@@ -0,0 +1,403 @@
+/*
+Copyright (c) 2007,2008 Rene Ladan <r.c.ladan@gmail.com> All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+
+See xtaffuse.txt for usage information.
+
+*/
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+#include "../libxtaf/libxtaf.h"
+
+#define MAX_READ (1024 * 1024) /* bytes per read request from the kernel */
+#define TIMEOUT 3600.0 /* seconds, the volume does not change */
+
+/*
+ * Where the data of a file lives: its extents and the file offset each one
+ * starts at.  Made on the first open of the file and kept until unmount.
+ */
+struct fmap_s {
+	uint32_t node;
+	uint32_t next; /* number of extents */
+	struct xtaf_extent *ext;
+	uint64_t *start;
+};
+
+struct xtaffuse_s {
+	char *image;
+	struct xtaf_vol *vol;
+	struct xtaf_index idx;
+	uint32_t csize; /* bytes per cluster */
+	struct fmap_s **maps; /* by node, see get_map() */
+	pthread_mutex_t mapmtx;
+};
+
+struct xtaffuse_s xf;
+
+/*
+ * The index is in the volume and does not change, so lookups can run in
+ * all FUSE threads at once.
+ */
+int lookup(const char *path, uint32_t *np) {
+	int error;
+
+	if (xf.vol == NULL) /* see xf_init() */
+		return(-EIO);
+	error = xtaf_lookup(xf.vol, XTAF_ROOT, path, np);
+	return(-error);
+}
+
+void fill_stat(uint32_t n, struct stat *st) {
+	struct xtaf_node *de = &xf.idx.nodes[n];
+
+	bzero(st, sizeof(struct stat));
+	st->st_ino = n + 1;
+	if (xtaf_is_dir(xf.vol, n)) {
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+	} else {
+		st->st_mode = S_IFREG | 0444;
+		st->st_nlink = 1;
+		st->st_size = de->fsize;
+		st->st_blocks = (de->fsize + xf.csize - 1) / xf.csize *
+		    (xf.csize / 512);
+	}
+	st->st_blksize = xf.csize;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	if (n == XTAF_ROOT)
+		return;
+	st->st_ctime = xtaf_time(de->dati[0], de->dati[1]);
+	st->st_atime = xtaf_time(de->dati[2], de->dati[3]);
+	st->st_mtime = xtaf_time(de->dati[4], de->dati[5]);
+}
+
+/*
+ * Return the extent map of file node n, following its chain only the
+ * first time.
+ */
+int get_map(uint32_t n, struct fmap_s **mapp) {
+	struct xtaf_node *de = &xf.idx.nodes[n];
+	struct fmap_s *m;
+	uint64_t pos;
+	uint32_t i, nclust;
+	int error = 0;
+
+	pthread_mutex_lock(&xf.mapmtx);
+	m = xf.maps[n];
+	if (m == NULL) {
+		m = calloc(1, sizeof(struct fmap_s));
+		if (m == NULL)
+			error = ENOMEM;
+		else if (de->fstart != 0 && (error = xtaf_extents(xf.vol,
+		    de->fstart, de->fsize, &m->ext, &m->next, &nclust)) == 0 &&
+		    (m->start = malloc(m->next * sizeof(uint64_t))) == NULL)
+			error = ENOMEM;
+		if (error == 0) {
+			m->node = n;
+			for (i = 0, pos = 0; i < m->next; i++) {
+				m->start[i] = pos;
+				pos += (uint64_t)m->ext[i].nclust * xf.csize;
+			}
+			xf.maps[n] = m;
+		} else if (m != NULL) {
+			free(m->ext);
+			free(m);
+		}
+	}
+	pthread_mutex_unlock(&xf.mapmtx);
+	*mapp = m;
+	return(error);
+}
+
+int xf_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+	uint32_t n;
+	int error;
+
+	if (fi != NULL)
+		n = ((struct fmap_s *)(uintptr_t)fi->fh)->node;
+	else if ((error = lookup(path, &n)) != 0)
+		return(error);
+	fill_stat(n, st);
+	return(0);
+}
+
+int xf_opendir(const char *path, struct fuse_file_info *fi) {
+	uint32_t n;
+	int error;
+
+	error = lookup(path, &n);
+	if (error)
+		return(error);
+	if (!xtaf_is_dir(xf.vol, n))
+		return(-ENOTDIR);
+	fi->fh = n;
+	return(0);
+}
+
+int xf_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+    off_t off, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+	struct xtaf_dir *dir;
+	struct xtaf_stat xs;
+	struct stat st;
+	int error;
+
+	error = xtaf_opendir(xf.vol, fi->fh, &dir);
+	if (error)
+		return(-error);
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	while (xtaf_readdir(dir, &xs) == 0) {
+		if (xs.deleted || *xs.name == '\0' ||
+		    !strcmp(xs.name, ".") || !strcmp(xs.name, "..") ||
+		    strchr(xs.name, '/') != NULL)
+			continue;
+		fill_stat(xs.node, &st);
+		if (filler(buf, xs.name, &st, 0, 0))
+			break;
+	}
+	xtaf_closedir(dir);
+	return(0);
+}
+
+int xf_open(const char *path, struct fuse_file_info *fi) {
+	struct fmap_s *m;
+	uint32_t n;
+	int error;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return(-EROFS);
+	error = lookup(path, &n);
+	if (error)
+		return(error);
+	if (xtaf_is_dir(xf.vol, n))
+		return(-EISDIR);
+	error = get_map(n, &m);
+	if (error)
+		return(-error);
+	fi->fh = (uintptr_t)m;
+	fi->keep_cache = 1;
+	return(0);
+}
+
+/*
+ * Read straight from the extents of the file, one pread(2) per extent
+ * touched.
+ */
+int xf_read(const char *path, char *buf, size_t size, off_t off,
+    struct fuse_file_info *fi) {
+	struct fmap_s *m = (struct fmap_s *)(uintptr_t)fi->fh;
+	uint64_t fsize, pos, eoff, chunk;
+	uint32_t lo, hi, mid;
+	size_t done;
+	ssize_t s;
+
+	fsize = xf.idx.nodes[m->node].fsize;
+	if (off < 0 || off >= fsize || m->next == 0)
+		return(0);
+	if (size > fsize - off)
+		size = fsize - off;
+
+	/* the last extent starting at or before off */
+	lo = 0;
+	hi = m->next;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (m->start[mid] <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	for (done = 0; done < size && lo < m->next; done += s) {
+		eoff = off + done - m->start[lo];
+		chunk = (uint64_t)m->ext[lo].nclust * xf.csize - eoff;
+		if (chunk == 0) {
+			lo++;
+			s = 0;
+			continue;
+		}
+		if (chunk > size - done)
+			chunk = size - done;
+		pos = (uint64_t)m->ext[lo].sector * 512 + eoff;
+		xtaf_count_read(xf.vol, pos, chunk, XTAF_IO_DATA);
+		s = pread(xtaf_fd(xf.vol), buf + done, chunk, pos);
+		if (s == -1 && errno == EINTR)
+			s = 0;
+		else if (s <= 0)
+			return(done > 0 ? done : -EIO);
+	}
+	return(done);
+}
+
+int xf_statfs(const char *path, struct statvfs *sv) {
+	const struct xtaf_geom *g;
+	struct xtaf_usage u;
+	int error;
+
+	if (xf.vol == NULL)
+		return(-EIO);
+	g = xtaf_geometry(xf.vol);
+	error = xtaf_usage(xf.vol, &u, NULL);
+	if (error)
+		return(-error);
+	bzero(sv, sizeof(struct statvfs));
+	sv->f_bsize = xf.csize;
+	sv->f_frsize = xf.csize;
+	sv->f_blocks = g->maxcluster;
+	sv->f_bfree = u.free;
+	sv->f_bavail = u.free;
+	sv->f_files = xf.idx.nnodes;
+	sv->f_namemax = 42;
+	sv->f_flag = ST_RDONLY;
+	return(0);
+}
+
+/*
+ * Open the volume here and not in main(), FUSE may fork into the background
+ * after main() and the threads which libxtaf starts while reading the
+ * volume would stay behind in the parent.  If that fails, the operations
+ * return EIO until FUSE has stopped.
+ */
+void *xf_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+	struct xtaf_vol *vol;
+	int error;
+
+	conn->max_readahead = MAX_READ;
+	cfg->kernel_cache = 1;
+	cfg->use_ino = 1;
+	cfg->entry_timeout = TIMEOUT;
+	cfg->attr_timeout = TIMEOUT;
+	cfg->negative_timeout = TIMEOUT;
+
+	error = xtaf_open(xf.image, NULL, &vol);
+	if (error == 0) {
+		xtaf_get_index(vol, &xf.idx);
+		xf.csize = xtaf_geometry(vol)->spc * 512;
+		xf.maps = calloc(xf.idx.nnodes, sizeof(struct fmap_s *));
+		if (xf.maps == NULL) {
+			xtaf_close(vol);
+			error = ENOMEM;
+		}
+	}
+	if (error) {
+		fprintf(stderr, "xtaffuse: %s: %s\n", xf.image,
+		    strerror(error));
+		fuse_exit(fuse_get_context()->fuse);
+		return(NULL);
+	}
+	xf.vol = vol;
+	return(NULL);
+}
+
+void xf_destroy(void *data) {
+	uint32_t n;
+
+	if (xf.vol == NULL)
+		return;
+	for (n = 0; n < xf.idx.nnodes; n++)
+		if (xf.maps[n] != NULL) {
+			free(xf.maps[n]->ext);
+			free(xf.maps[n]->start);
+			free(xf.maps[n]);
+		}
+	free(xf.maps);
+	xtaf_close(xf.vol);
+}
+
+struct fuse_operations xf_ops = {
+	.getattr = xf_getattr,
+	.opendir = xf_opendir,
+	.readdir = xf_readdir,
+	.open = xf_open,
+	.read = xf_read,
+	.statfs = xf_statfs,
+	.init = xf_init,
+	.destroy = xf_destroy,
+};
+
+/*
+ * The first argument which is not an option is the image, the rest goes
+ * to FUSE.
+ */
+int opt_proc(void *data, const char *arg, int key, struct fuse_args *args) {
+	if (key == FUSE_OPT_KEY_NONOPT && xf.image == NULL) {
+		xf.image = strdup(arg);
+		return(0);
+	}
+	return(1);
+}
+
+int usage(void) {
+	printf("See xtaffuse.txt for usage information.\n");
+	return(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_opt opts[] = { FUSE_OPT_END };
+	struct xtaf_geom geom;
+	char opt[64], *path;
+	int error, ret;
+
+	if (fuse_opt_parse(&args, NULL, opts, opt_proc) == -1 ||
+	    xf.image == NULL)
+		return(usage());
+
+	/*
+	 * FUSE changes to / when it detaches, so keep the full path.  Only
+	 * the boot block is checked here, the volume is opened by xf_init().
+	 */
+	path = realpath(xf.image, NULL);
+	error = path == NULL ? errno : xtaf_probe(path, &geom);
+	if (error) {
+		fprintf(stderr, "xtaffuse: %s: %s\n", xf.image,
+		    strerror(error));
+		return(1);
+	}
+	free(xf.image);
+	xf.image = path;
+	pthread_mutex_init(&xf.mapmtx, NULL);
+
+	snprintf(opt, sizeof(opt), "-oro,subtype=xtaf,max_read=%u", MAX_READ);
+	if (fuse_opt_add_arg(&args, opt) == -1)
+		return(1);
+	ret = fuse_main(args.argc, args.argv, &xf_ops, NULL);
+	fuse_opt_free_args(&args);
+	return(ret);
+}
@@ -0,0 +1,396 @@
+/*
+Copyright (c) 2007,2008 Rene Ladan <r.c.ladan@gmail.com> All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+SUCH DAMAGE.
+
+See xtafreplay.txt for usage information.
+
+*/
+#ifdef __linux__
+#define _GNU_SOURCE /* O_DIRECT */
+#endif
+#include <aio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+
+#define NPURPOSES 4
+#define DIRECT_ALIGN 4096 /* offsets and lengths are rounded to this */
+
+char *purpose_names[NPURPOSES] = { "boot", "fat", "dir", "data" };
+
+/* one line of the trace, see open_trace() in uxtaf.c */
+struct rec_s {
+	uint64_t usec; /* relative to the first record */
+	uint64_t off;
+	uint64_t len;
+	int purpose;
+};
+
+/* the state shared by the replay threads */
+struct replay_s {
+	struct rec_s *recs;
+	uint32_t nrecs;
+	uint32_t next; /* next record to issue, under mtx */
+	double *lat; /* latency per record in seconds */
+	uint64_t maxlen;
+	int fd;
+	int depth;
+	int direct;
+	double speed; /* 0: as fast as possible */
+	double start;
+	uint32_t errors;
+	pthread_mutex_t mtx;
+};
+
+/* one in-flight read of a thread */
+struct slot_s {
+	struct aiocb cb;
+	uint32_t rec;
+	double issued;
+	char *buf;
+	int busy;
+};
+
+double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Read the trace, keeping only the purposes set in mask.  Lines which do
+ * not parse are skipped with a warning.
+ */
+int read_trace(char *name, int mask, struct replay_s *rp) {
+	struct rec_s *recs;
+	unsigned long long usec, off, len, first = 0;
+	uint32_t nalloc = 0, lineno = 0;
+	char line[256], purpose[16];
+	FILE *f;
+	int p;
+
+	f = strcmp(name, "-") ? fopen(name, "r") : stdin;
+	if (f == NULL) {
+		fprintf(stderr, "xtafreplay: cannot open %s: %i\n", name,
+		    errno);
+		return(1);
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%llu %llu %llu %15s", &usec, &off, &len,
+		    purpose) != 4) {
+			fprintf(stderr, "xtafreplay: %s:%u: bad line\n", name,
+			    lineno);
+			continue;
+		}
+		for (p = 0; p < NPURPOSES; p++)
+			if (!strcmp(purpose, purpose_names[p]))
+				break;
+		if (p == NPURPOSES || len == 0 || !(mask & 1 << p))
+			continue;
+		if (rp->nrecs == nalloc) {
+			nalloc = nalloc == 0 ? 4096 : nalloc * 2;
+			recs = realloc(rp->recs, nalloc * sizeof(struct rec_s));
+			if (recs == NULL) {
+				fprintf(stderr, "xtafreplay: out of memory\n");
+				return(1);
+			}
+			rp->recs = recs;
+		}
+		if (rp->nrecs == 0)
+			first = usec;
+		/* appended runs can go back in time a bit, never wait then */
+		rp->recs[rp->nrecs].usec = usec > first ? usec - first : 0;
+		rp->recs[rp->nrecs].off = off;
+		rp->recs[rp->nrecs].len = len;
+		rp->recs[rp->nrecs].purpose = p;
+		if (len > rp->maxlen)
+			rp->maxlen = len;
+		rp->nrecs++;
+	}
+	if (f != stdin)
+		fclose(f);
+	return(0);
+}
+
+/*
+ * Start the read of the next record in slot s, returns 1 when the trace is
+ * done.  With a speed, wait until the record is due.
+ */
+int issue(struct replay_s *rp, struct slot_s *s) {
+	struct rec_s *r;
+	uint64_t off, len;
+	double due;
+
+	pthread_mutex_lock(&rp->mtx);
+	if (rp->next == rp->nrecs) {
+		pthread_mutex_unlock(&rp->mtx);
+		return(1);
+	}
+	s->rec = rp->next++;
+	pthread_mutex_unlock(&rp->mtx);
+
+	r = &rp->recs[s->rec];
+	if (rp->speed > 0) {
+		due = rp->start + r->usec / 1e6 / rp->speed;
+		while (now() < due)
+			usleep((due - now()) * 1e6 + 1);
+	}
+	off = r->off;
+	len = r->len;
+	if (rp->direct) {
+		off -= off % DIRECT_ALIGN;
+		len = (r->off + r->len - off + DIRECT_ALIGN - 1) /
+		    DIRECT_ALIGN * DIRECT_ALIGN;
+	}
+	bzero(&s->cb, sizeof(struct aiocb));
+	s->cb.aio_fildes = rp->fd;
+	s->cb.aio_buf = s->buf;
+	s->cb.aio_nbytes = len;
+	s->cb.aio_offset = off;
+	s->issued = now();
+	if (aio_read(&s->cb) == -1) {
+		pthread_mutex_lock(&rp->mtx);
+		rp->errors++;
+		pthread_mutex_unlock(&rp->mtx);
+		rp->lat[s->rec] = 0;
+		return(0);
+	}
+	s->busy = 1;
+	return(0);
+}
+
+/*
+ * Each thread keeps up to depth reads in flight.
+ */
+void *replay_worker(void *arg) {
+	struct replay_s *rp = arg;
+	struct slot_s *slots;
+	const struct aiocb **list;
+	uint64_t buflen;
+	int i, busy, done = 0;
+
+	slots = calloc(rp->depth, sizeof(struct slot_s));
+	list = calloc(rp->depth, sizeof(struct aiocb *));
+	buflen = rp->maxlen + 2 * DIRECT_ALIGN;
+	for (i = 0; slots != NULL && i < rp->depth; i++)
+		if (posix_memalign((void **)&slots[i].buf, DIRECT_ALIGN,
+		    buflen))
+			slots[i].buf = NULL;
+	for (i = 0; slots != NULL && i < rp->depth; i++)
+		if (slots[i].buf == NULL)
+			break;
+	if (slots == NULL || list == NULL || i < rp->depth) {
+		fprintf(stderr, "xtafreplay: out of memory\n");
+		done = 1;
+	}
+
+	for (;;) {
+		for (i = 0; !done && i < rp->depth; i++)
+			if (!slots[i].busy)
+				done = issue(rp, &slots[i]);
+		for (i = 0, busy = 0; i < rp->depth; i++)
+			list[i] = slots[i].busy ? &slots[i].cb : NULL;
+		for (i = 0; i < rp->depth; i++)
+			busy += slots[i].busy;
+		if (busy == 0 && done)
+			break;
+		if (busy == 0) /* every read of this round failed to start */
+			continue;
+		aio_suspend(list, rp->depth, NULL);
+		for (i = 0; i < rp->depth; i++) {
+			if (!slots[i].busy ||
+			    aio_error(&slots[i].cb) == EINPROGRESS)
+				continue;
+			slots[i].busy = 0;
+			rp->lat[slots[i].rec] = now() - slots[i].issued;
+			if (aio_return(&slots[i].cb) <
+			    (ssize_t)rp->recs[slots[i].rec].len) {
+				pthread_mutex_lock(&rp->mtx);
+				rp->errors++;
+				pthread_mutex_unlock(&rp->mtx);
+			}
+		}
+	}
+	for (i = 0; slots != NULL && i < rp->depth; i++)
+		free(slots[i].buf);
+	free(slots);
+	free(list);
+	return(NULL);
+}
+
+int cmp_double(const void *a, const void *b) {
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return(da < db ? -1 : da > db);
+}
+
+void report(struct replay_s *rp, double elapsed) {
+	uint64_t bytes[NPURPOSES], count[NPURPOSES], total = 0;
+	double sum = 0;
+	uint32_t i;
+	int p;
+
+	bzero(bytes, sizeof(bytes));
+	bzero(count, sizeof(count));
+	for (i = 0; i < rp->nrecs; i++) {
+		bytes[rp->recs[i].purpose] += rp->recs[i].len;
+		count[rp->recs[i].purpose]++;
+		total += rp->recs[i].len;
+		sum += rp->lat[i];
+	}
+	qsort(rp->lat, rp->nrecs, sizeof(double), cmp_double);
+	printf("reads        = %u, %u failed\n", rp->nrecs, rp->errors);
+	for (p = 0; p < NPURPOSES; p++)
+		if (count[p] > 0)
+			printf("  %-10s = %llu reads, %llu bytes\n",
+			    purpose_names[p], (unsigned long long)count[p],
+			    (unsigned long long)bytes[p]);
+	printf("bytes        = %llu\n", (unsigned long long)total);
+	printf("elapsed      = %.6f s\n", elapsed);
+	printf("throughput   = %.1f MB/s, %.1f reads/s\n",
+	    total / elapsed / (1024 * 1024), rp->nrecs / elapsed);
+	if (rp->nrecs > 0)
+		printf("latency      = avg %.1f p50 %.1f p99 %.1f max %.1f us\n",
+		    sum / rp->nrecs * 1e6, rp->lat[rp->nrecs / 2] * 1e6,
+		    rp->lat[(uint64_t)rp->nrecs * 99 / 100] * 1e6,
+		    rp->lat[rp->nrecs - 1] * 1e6);
+}
+
+/*
+ * Parse a comma separated list of purposes into a bit mask.
+ */
+int parse_purposes(char *arg) {
+	char *p;
+	int mask = 0, i;
+
+	while ((p = strsep(&arg, ",")) != NULL) {
+		for (i = 0; i < NPURPOSES; i++)
+			if (!strcmp(p, purpose_names[i]))
+				break;
+		if (i == NPURPOSES)
+			return(0);
+		mask |= 1 << i;
+	}
+	return(mask);
+}
+
+int usage(void) {
+	printf("See xtafreplay.txt for usage information.\n");
+	return(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct replay_s rp;
+	pthread_t *tids;
+	int ch, i, nthreads = 1, mask = (1 << NPURPOSES) - 1, flags;
+
+	bzero(&rp, sizeof(struct replay_s));
+	rp.depth = 1;
+	while ((ch = getopt(argc, argv, "Dj:p:q:s:t")) != -1)
+		switch (ch) {
+		case 'D':
+			rp.direct = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'p':
+			mask = parse_purposes(optarg);
+			break;
+		case 'q':
+			rp.depth = atoi(optarg);
+			break;
+		case 's':
+			rp.speed = strtod(optarg, NULL);
+			break;
+		case 't':
+			rp.speed = 1;
+			break;
+		default:
+			return(usage());
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2 || nthreads < 1 || rp.depth < 1 || mask == 0 ||
+	    rp.speed < 0)
+		return(usage());
+
+	if (read_trace(argv[0], mask, &rp))
+		return(1);
+	flags = O_RDONLY;
+	if (rp.direct) {
+#ifdef O_DIRECT
+		flags |= O_DIRECT;
+#else
+		fprintf(stderr, "xtafreplay: O_DIRECT is not supported\n");
+		return(1);
+#endif
+	}
+	rp.fd = open(argv[1], flags);
+	if (rp.fd == -1) {
+		fprintf(stderr, "xtafreplay: cannot open %s: %i\n", argv[1],
+		    errno);
+		return(1);
+	}
+	rp.lat = calloc(rp.nrecs + 1, sizeof(double));
+	tids = calloc(nthreads, sizeof(pthread_t));
+	if (rp.lat == NULL || tids == NULL) {
+		fprintf(stderr, "xtafreplay: out of memory\n");
+		return(1);
+	}
+	pthread_mutex_init(&rp.mtx, NULL);
+
+	rp.start = now();
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&tids[i], NULL, replay_worker, &rp)) {
+			fprintf(stderr, "xtafreplay: cannot start thread %i\n",
+			    i);
+			break;
+		}
+	if (i == 0)
+		replay_worker(&rp);
+	while (--i >= 0)
+		pthread_join(tids[i], NULL);
+	rp.errors += rp.nrecs - rp.next; /* not replayed, see replay_worker() */
+	report(&rp, now() - rp.start);
+
+	pthread_mutex_destroy(&rp.mtx);
+	close(rp.fd);
+	free(rp.recs);
+	free(rp.lat);
+	free(tids);
+	return(rp.errors > 0);
+}